@@ -13,6 +13,7 @@
 
 #include "trustid_image_processing/dlib_impl/face_detector.h"
 #include "trustid_image_processing/dlib_impl/face_verificator.h"
+#include "trustid_image_processing/dlib_impl/template_store.h"
 
 int main(int argc, char **argv) {
   std::cout << "Building face model using test images.." << std::endl;
@@ -96,5 +97,15 @@ int main(int argc, char **argv) {
   // Serialize the data and save it to a file
   dlib::serialize("face_verificator.dat") << faceVerificatorUserParams;
 
+  // Or add it to a template store, which keeps every user in a single
+  // memory-mapped file and loads them without deserializing anything
+  trustid::image::impl::TemplateStore::create("face_templates.dat");
+  trustid::image::impl::TemplateStore templateStore("face_templates.dat", false);
+  templateStore.append("person1", faceVerificatorUserParams);
+
+  auto storedFaceVerificator =
+      std::make_unique<trustid::image::impl::DlibFaceVerificator>(
+          net, sp, templateStore.getUser("person1"));
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,110 @@
+/**
+ * @file embedding_batcher_load_test.cc
+ * @brief Load test of the embedding batcher
+ *
+ * Runs a number of concurrent clients, each one submitting a face chip and
+ * waiting for its embedding in a closed loop, against batchers with different
+ * batch size/wait settings. Prints the throughput and latency percentiles of
+ * every setting, to pick the latency budget of a deployment.
+ *
+ * Usage: embedding_batcher_load_test [clients] [seconds per setting]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "trustid_image_processing/dlib_impl/embedding_batcher.h"
+
+namespace {
+double percentile(std::vector<double>& values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  size_t idx = static_cast<size_t>(p * (values.size() - 1));
+  std::nth_element(values.begin(), values.begin() + idx, values.end());
+  return values[idx];
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  const unsigned clients = argc > 1 ? std::atoi(argv[1]) : 16;
+  const double secondsPerSetting = argc > 2 ? std::atof(argv[2]) : 5;
+
+  auto net = trustid::image::impl::loadResNet34FromDisk(
+      "resources/dlib_face_recognition_resnet_model_v1.dat");
+
+  // random chips, the cost of a forward pass does not depend on the content
+  dlib::rand rnd;
+  std::vector<dlib::matrix<dlib::rgb_pixel>> chips(clients);
+  for (auto &chip : chips) {
+    chip.set_size(150, 150);
+    for (auto &pixel : chip) {
+      pixel = dlib::rgb_pixel(rnd.get_random_8bit_number(),
+                              rnd.get_random_8bit_number(),
+                              rnd.get_random_8bit_number());
+    }
+  }
+
+  std::cout << clients << " clients, " << secondsPerSetting
+            << " s per setting" << std::endl;
+  std::cout << std::setw(6) << "batch" << std::setw(10) << "wait(ms)"
+            << std::setw(14) << "emb/s" << std::setw(12) << "avg batch"
+            << std::setw(12) << "p50(ms)" << std::setw(12) << "p99(ms)"
+            << std::endl;
+
+  for (size_t maxBatchSize : {1, 4, 8, 16, 32}) {
+    for (int maxWaitMs : {0, 2, 5, 10}) {
+      trustid::image::impl::EmbeddingBatcherConfig config;
+      config.maxBatchSize = maxBatchSize;
+      config.maxWait = std::chrono::milliseconds(maxWaitMs);
+      trustid::image::impl::EmbeddingBatcher batcher(net, config);
+
+      std::vector<std::vector<double>> latencies(clients);
+      auto begin = std::chrono::steady_clock::now();
+      auto end = begin + std::chrono::duration_cast<
+                             std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double>(secondsPerSetting));
+      std::vector<std::thread> threads;
+      for (unsigned c = 0; c < clients; c++) {
+        threads.emplace_back([&, c]() {
+          while (std::chrono::steady_clock::now() < end) {
+            auto submitTime = std::chrono::steady_clock::now();
+            batcher.submit(chips[c]).get();
+            latencies[c].push_back(
+                std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - submitTime)
+                    .count());
+          }
+        });
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+      double elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - begin)
+                           .count();
+
+      std::vector<double> allLatencies;
+      for (auto &clientLatencies : latencies) {
+        allLatencies.insert(allLatencies.end(), clientLatencies.begin(),
+                            clientLatencies.end());
+      }
+      std::cout << std::setw(6) << maxBatchSize << std::setw(10) << maxWaitMs
+                << std::setw(14) << std::fixed << std::setprecision(1)
+                << allLatencies.size() / elapsed << std::setw(12)
+                << std::setprecision(2)
+                << double(batcher.getEmbeddingCount()) /
+                       std::max<uint64_t>(batcher.getBatchCount(), 1)
+                << std::setw(12) << percentile(allLatencies, 0.5)
+                << std::setw(12) << percentile(allLatencies, 0.99)
+                << std::endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file encoded_ingest_benchmark.cc
+ * @brief Benchmark of the detection on encoded images
+ *
+ * Detects the faces of a JPEG file, either decoding it at full resolution and
+ * calling detectFaces ("full"), or passing the encoded bytes to
+ * detectFacesEncoded ("encoded"). Prints the time per image, the size of the
+ * image kept by the result and the peak memory of the process. The peak only
+ * grows, so each mode runs in its own process.
+ *
+ * Usage: encoded_ingest_benchmark <image> <full|encoded> [iterations]
+ *        [reduction factor]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <opencv2/imgcodecs.hpp>
+#include <string>
+#include <vector>
+
+#include "trustid_image_processing/dlib_impl/face_detector.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+// Returns the peak resident memory of the process, in megabytes.
+double getPeakMemoryMegabytes() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+  return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;  // kilobytes on Linux
+#endif
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0]
+              << " <image> <full|encoded> [iterations] [reduction factor]"
+              << std::endl;
+    return 1;
+  }
+  const std::string mode = argv[2];
+  const int iterations = argc > 3 ? std::atoi(argv[3]) : 20;
+  const int reductionFactor = argc > 4 ? std::atoi(argv[4]) : 4;
+  if (mode != "full" && mode != "encoded") {
+    std::cerr << "Unknown mode " << mode << std::endl;
+    return 1;
+  }
+
+  std::ifstream in(argv[1], std::ios::binary);
+  const std::vector<unsigned char> encodedImage(
+      (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  if (encodedImage.empty()) {
+    std::cerr << "Could not read " << argv[1] << std::endl;
+    return 1;
+  }
+  const double startMemory = getPeakMemoryMegabytes();
+
+  trustid::image::impl::DlibFaceDetector detector;
+  trustid::image::FaceDetectionResult result;
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    if (mode == "full") {
+      result = detector.detectFaces(
+          cv::imdecode(encodedImage, cv::IMREAD_COLOR));
+    } else {
+      result = detector.detectFacesEncoded(encodedImage, reductionFactor);
+    }
+  }
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+
+  const cv::Mat image = result.getImage();
+  std::cout << mode << ": " << result.getBoundingBoxes().size() << " faces, "
+            << seconds * 1000 / iterations << " ms per image, kept "
+            << image.cols << "x" << image.rows << " image, peak memory "
+            << getPeakMemoryMegabytes() << " MB (" << startMemory
+            << " MB before detecting)" << std::endl;
+  return 0;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file enrollment_records.cc
+ * @brief Packs an enrollment dataset into a record file and enrolls from it
+ *
+ * "pack" walks a dataset directory holding one subdirectory of images per
+ * user, and appends the image files as they are (without decoding them) to a
+ * record file. "enroll" reads the record file back in large sequential
+ * chunks, decoding and detecting the faces in parallel, and adds the model of
+ * every user to a template store.
+ *
+ * Usage:
+ *   enrollment_records pack <dataset directory> <record file>
+ *   enrollment_records enroll <record file> <template store>
+ */
+
+#include <dlib/dir_nav.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trustid_image_processing/dlib_impl/enrollment_records.h"
+#include "trustid_image_processing/dlib_impl/face_detector.h"
+#include "trustid_image_processing/dlib_impl/face_verificator.h"
+#include "trustid_image_processing/dlib_impl/template_store.h"
+
+namespace {
+std::vector<unsigned char> readFile(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::vector<unsigned char>(std::istreambuf_iterator<char>(in),
+                                    std::istreambuf_iterator<char>());
+}
+
+void pack(const std::string& datasetPath, const std::string& recordsPath) {
+  trustid::image::impl::EnrollmentRecordWriter writer(recordsPath);
+  for (auto& userDir : dlib::directory(datasetPath).get_dirs()) {
+    for (auto& f : userDir.get_files()) {
+      trustid::image::impl::EnrollmentRecord record;
+      record.userId = userDir.name();
+      record.encodedImage = readFile(f.full_name());
+      writer.append(record);
+    }
+  }
+  writer.close();
+  std::cout << "packed " << writer.size() << " images" << std::endl;
+}
+
+void enroll(const std::string& recordsPath, const std::string& storePath) {
+  auto net = trustid::image::impl::loadResNet34FromDisk(
+      "resources/dlib_face_recognition_resnet_model_v1.dat");
+  auto sp =
+      trustid::image::impl::loadShapePredictorFromDisk("resources/ERT68.dat");
+  auto faceDetector =
+      std::make_shared<trustid::image::impl::DlibFaceDetector>();
+
+  trustid::image::impl::TemplateStore::create(storePath);
+  trustid::image::impl::TemplateStore templateStore(storePath, false);
+
+  auto begin = std::chrono::steady_clock::now();
+  trustid::image::impl::EnrollmentRecordReader reader(recordsPath);
+  reader.readUsers(
+      [&](const std::string& userId,
+          std::vector<trustid::image::FaceDetectionResultEntry>& entries) {
+        if (entries.empty()) {
+          std::cout << userId << ": no usable image" << std::endl;
+          return;
+        }
+        trustid::image::impl::DlibFaceVerificator faceVerificator(net, sp,
+                                                                  entries);
+        templateStore.append(userId, faceVerificator.getUserParams());
+        std::cout << userId << ": " << entries.size() << " images"
+                  << std::endl;
+      },
+      faceDetector);
+  templateStore.flush();
+
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+  std::cout << "enrolled " << templateStore.size() << " users from "
+            << reader.size() << " images in " << seconds << "s" << std::endl;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 4) {
+    std::cerr << "Usage: " << argv[0]
+              << " pack <dataset directory> <record file>" << std::endl
+              << "       " << argv[0]
+              << " enroll <record file> <template store>" << std::endl;
+    return 1;
+  }
+  const std::string mode = argv[1];
+  if (mode == "pack") {
+    pack(argv[2], argv[3]);
+  } else if (mode == "enroll") {
+    enroll(argv[2], argv[3]);
+  } else {
+    std::cerr << "Unknown mode " << mode << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,263 @@
+/**
+ * @file serialization_benchmark.cc
+ * @brief Benchmark of the cv::Mat and detection result serialization
+ *
+ * Serializes and deserializes large frames (whole frames and ROIs) through
+ * in-memory streams, and prints the throughput of each direction next to the
+ * former approach of copying the pixels into a std::vector first.
+ *
+ * Then serializes a detection result of a frame (the given image, or a
+ * synthetic 1080p frame) with every image encoding, and prints the payload
+ * size and the encode/decode cost of each one.
+ *
+ * Finally loads a batch of user models written in the former dlib encoded
+ * format and in the compact format (float32 and fp16).
+ *
+ * Usage: serialization_benchmark [iterations] [image]
+ */
+
+#include <dlib/rand.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "trustid_image_processing/dlib_impl/face_verificator.h"
+#include "trustid_image_processing/face_detector.h"
+#include "trustid_image_processing/serialize.h"
+
+namespace {
+template <typename Body>
+double measureSeconds(int iterations, Body body) {
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    body();
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       begin)
+             .count() /
+         iterations;
+}
+
+void printRow(const std::string& name, size_t bytes, double serializeSeconds,
+              double deserializeSeconds) {
+  const double megabytes = bytes / (1024.0 * 1024.0);
+  std::cout << std::setw(24) << name << std::setw(12) << std::fixed
+            << std::setprecision(1) << megabytes << std::setw(16)
+            << megabytes / serializeSeconds << std::setw(16)
+            << megabytes / deserializeSeconds << std::endl;
+}
+
+// Measures the payload of a detection result serialized with the given
+// options, and the cost of serializing it and of deserializing and decoding
+// it.
+void benchmarkPayload(const std::string& name,
+                      const trustid::image::FaceDetectionResult& result,
+                      const trustid::image::ImageSerializationOptions& options,
+                      int iterations) {
+  const double serializeSeconds = measureSeconds(iterations, [&]() {
+    std::ostringstream out;
+    trustid::image::serialize(result, out, options);
+  });
+  std::ostringstream out;
+  trustid::image::serialize(result, out, options);
+  const std::string buffer = out.str();
+
+  const double deserializeSeconds = measureSeconds(iterations, [&]() {
+    std::istringstream in(buffer);
+    trustid::image::FaceDetectionResult deserialized;
+    trustid::image::deserialize(deserialized, in);
+    deserialized.getImage();
+  });
+  std::cout << std::setw(24) << name << std::setw(12) << std::fixed
+            << std::setprecision(1) << buffer.size() / 1024.0 << std::setw(16)
+            << serializeSeconds * 1000 << std::setw(16)
+            << deserializeSeconds * 1000 << std::endl;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? std::atoi(argv[1]) : 50;
+  const std::string imagePath = argc > 2 ? argv[2] : "";
+
+  cv::Mat frame1080(1080, 1920, CV_8UC3);
+  cv::randu(frame1080, cv::Scalar::all(0), cv::Scalar::all(255));
+  cv::Mat frame4k(2160, 3840, CV_8UC3);
+  cv::randu(frame4k, cv::Scalar::all(0), cv::Scalar::all(255));
+  cv::Mat depth(1080, 1920, CV_32FC1);
+  cv::randu(depth, cv::Scalar::all(0), cv::Scalar::all(1));
+
+  struct Case {
+    std::string name;
+    cv::Mat mat;
+  };
+  std::vector<Case> cases = {
+      {"1080p BGR", frame1080},
+      {"1080p BGR ROI", frame1080(cv::Rect(320, 180, 1280, 720))},
+      {"4K BGR", frame4k},
+      {"1080p float", depth},
+  };
+
+  std::cout << iterations << " iterations per case" << std::endl;
+  std::cout << std::setw(24) << "case" << std::setw(12) << "MB"
+            << std::setw(16) << "write(MB/s)" << std::setw(16) << "read(MB/s)"
+            << std::endl;
+
+  for (auto& testCase : cases) {
+    const size_t bytes = testCase.mat.total() * testCase.mat.elemSize();
+    const double serializeSeconds = measureSeconds(iterations, [&]() {
+      std::ostringstream out;
+      cv::serialize(testCase.mat, out);
+    });
+    std::ostringstream out;
+    cv::serialize(testCase.mat, out);
+    const std::string buffer = out.str();
+
+    // the deserialized matrix is reused, as a receiving loop would
+    cv::Mat result;
+    const double deserializeSeconds = measureSeconds(iterations, [&]() {
+      std::istringstream in(buffer);
+      cv::deserialize(result, in);
+    });
+    if (cv::norm(result, testCase.mat, cv::NORM_INF) != 0) {
+      std::cerr << testCase.name << ": round trip mismatch" << std::endl;
+      return 1;
+    }
+    printRow(testCase.name, bytes, serializeSeconds, deserializeSeconds);
+
+    // former approach, through a temporary vector (continuous matrices only)
+    if (testCase.mat.isContinuous()) {
+      const double copySerializeSeconds = measureSeconds(iterations, [&]() {
+        std::ostringstream out;
+        std::vector<unsigned char> data(testCase.mat.datastart,
+                                        testCase.mat.dataend);
+        dlib::serialize(data, out);
+      });
+      std::ostringstream copyOut;
+      dlib::serialize(std::vector<unsigned char>(testCase.mat.datastart,
+                                                 testCase.mat.dataend),
+                      copyOut);
+      const std::string copyBuffer = copyOut.str();
+      const double copyDeserializeSeconds = measureSeconds(iterations, [&]() {
+        std::istringstream in(copyBuffer);
+        std::vector<unsigned char> data;
+        dlib::deserialize(data, in);
+        cv::Mat copy(testCase.mat.rows, testCase.mat.cols, testCase.mat.type());
+        std::copy(data.begin(), data.end(), copy.data);
+      });
+      printRow(testCase.name + " (vector)", bytes, copySerializeSeconds,
+               copyDeserializeSeconds);
+    }
+  }
+
+  // detection result payloads, on a smooth frame when no image is given
+  // (noise doesn't compress like a camera frame)
+  cv::Mat frame;
+  if (!imagePath.empty()) {
+    frame = cv::imread(imagePath, cv::IMREAD_COLOR);
+    if (frame.empty()) {
+      std::cerr << "Could not read " << imagePath << std::endl;
+      return 1;
+    }
+  } else {
+    cv::GaussianBlur(frame1080, frame, cv::Size(0, 0), 8);
+  }
+  const int faceSize = std::min(frame.cols, frame.rows) / 4;
+  trustid::image::FaceDetectionConfidenceBoundingBox face;
+  face.boundingBox = cv::Rect((frame.cols - faceSize) / 2,
+                              (frame.rows - faceSize) / 2, faceSize, faceSize);
+  face.confidenceScore = 1.0;
+  trustid::image::FaceDetectionResult result(frame, {face});
+
+  std::cout << std::endl
+            << "detection result of a " << frame.cols << "x" << frame.rows
+            << " frame" << std::endl;
+  std::cout << std::setw(24) << "encoding" << std::setw(12) << "KB"
+            << std::setw(16) << "write(ms)" << std::setw(16) << "read(ms)"
+            << std::endl;
+  struct PayloadCase {
+    std::string name;
+    trustid::image::ImageEncodingEnum encoding;
+    int quality;
+  };
+  const std::vector<PayloadCase> payloadCases = {
+      {"raw", trustid::image::RAW_IMAGE, 0},
+      {"jpeg q90", trustid::image::JPEG_IMAGE, 90},
+      {"jpeg q75", trustid::image::JPEG_IMAGE, 75},
+      {"png level 3", trustid::image::PNG_IMAGE, 3},
+      {"webp q90", trustid::image::WEBP_IMAGE, 90},
+  };
+  for (bool faceRegionOnly : {false, true}) {
+    for (auto& payloadCase : payloadCases) {
+      trustid::image::ImageSerializationOptions options;
+      options.encoding = payloadCase.encoding;
+      options.quality = payloadCase.quality;
+      options.faceRegionOnly = faceRegionOnly;
+      benchmarkPayload(payloadCase.name + (faceRegionOnly ? " (face)" : ""),
+                       result, options, iterations);
+    }
+  }
+
+  // user models: 1000 users with 20 ground truth vectors each
+  dlib::rand rnd;
+  std::vector<trustid::image::impl::DlibFaceVerificatorModelParams> users;
+  for (int u = 0; u < 1000; u++) {
+    std::vector<dlib::matrix<float, 0, 1>> groundTruthVecs(20);
+    for (auto& groundTruthVec : groundTruthVecs) {
+      groundTruthVec.set_size(128);
+      for (auto& value : groundTruthVec) {
+        value = rnd.get_random_gaussian() * 0.1f;
+      }
+    }
+    users.emplace_back(groundTruthVecs);
+  }
+
+  std::cout << std::endl
+            << users.size() << " user models" << std::endl;
+  std::cout << std::setw(24) << "format" << std::setw(12) << "KB"
+            << std::setw(16) << "users/s" << std::endl;
+  auto printUsers = [&](const std::string& name, const std::string& buffer,
+                        double seconds) {
+    std::cout << std::setw(24) << name << std::setw(12) << std::fixed
+              << std::setprecision(1) << buffer.size() / 1024.0
+              << std::setw(16) << users.size() / seconds << std::endl;
+  };
+
+  // former format (version 3), through the dlib encoding of every float
+  std::ostringstream legacyOut;
+  for (auto& user : users) {
+    dlib::serialize(-3, legacyOut);
+    dlib::serialize(user.groundTruthVecs, legacyOut);
+    dlib::serialize(user.groundTruthWeights, legacyOut);
+    dlib::serialize(user.distanceThreshold, legacyOut);
+    dlib::serialize(user.votingThreshold, legacyOut);
+    dlib::serialize(static_cast<int>(user.metric), legacyOut);
+  }
+  const std::string legacyBuffer = legacyOut.str();
+  printUsers("dlib (v3)", legacyBuffer, measureSeconds(iterations, [&]() {
+               trustid::image::impl::deserializeUserParamsBatch(
+                   legacyBuffer.data(), legacyBuffer.size());
+             }));
+
+  for (auto precision : {trustid::image::impl::FLOAT32_PRECISION,
+                         trustid::image::impl::FLOAT16_PRECISION}) {
+    std::ostringstream out;
+    trustid::image::impl::serializeUserParamsBatch(users, out, precision);
+    const std::string buffer = out.str();
+    printUsers(precision == trustid::image::impl::FLOAT32_PRECISION
+                   ? "compact float32"
+                   : "compact fp16",
+               buffer, measureSeconds(iterations, [&]() {
+                 trustid::image::impl::deserializeUserParamsBatch(
+                     buffer.data(), buffer.size());
+               }));
+  }
+  return 0;
+}
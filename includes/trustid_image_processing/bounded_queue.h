@@ -0,0 +1,127 @@
+#ifndef TRUSTID_BOUNDED_QUEUE_H_
+#define TRUSTID_BOUNDED_QUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace trustid {
+namespace image {
+/**
+ * Thread-safe FIFO queue with a fixed capacity, used to connect processing
+ * stages. Producers block while the queue is full, which propagates
+ * backpressure upstream instead of queueing unbounded work.
+ */
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : maxSize(capacity) {}
+
+  /**
+   * Adds an item, blocking while the queue is full. Returns false if the
+   * queue was closed.
+   */
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return closed || items.size() < maxSize; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  /**
+   * Adds an item if there is room for it, without blocking.
+   */
+  bool tryPush(T& item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (closed || items.size() >= maxSize) {
+      return false;
+    }
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  /**
+   * Removes the oldest item, blocking while the queue is empty. Returns false
+   * once the queue is closed and drained.
+   */
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  /**
+   * Removes the oldest item, blocking while the queue is empty until the
+   * given deadline. Returns false on timeout or once the queue is closed and
+   * drained.
+   */
+  template <typename Clock, typename Duration>
+  bool popUntil(T& item,
+                const std::chrono::time_point<Clock, Duration>& deadline) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait_until(lock, deadline,
+                        [this] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  /**
+   * Removes the oldest item if there is one, without blocking.
+   */
+  bool tryPop(T& item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  /**
+   * Stops accepting items and wakes up every waiting thread. Items already in
+   * the queue can still be popped.
+   */
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return items.size();
+  }
+
+  size_t capacity() const { return maxSize; }
+
+ private:
+  mutable std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::deque<T> items;
+  size_t maxSize;
+  bool closed = false;
+};
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_BOUNDED_QUEUE_H_
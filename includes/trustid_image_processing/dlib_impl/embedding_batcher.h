@@ -0,0 +1,102 @@
+#ifndef TRUSTID_DLIB_EMBEDDING_BATCHER_H_
+#define TRUSTID_DLIB_EMBEDDING_BATCHER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "trustid_image_processing/bounded_queue.h"
+#include "trustid_image_processing/dlib_impl/face_verificator.h"
+#include "trustid_image_processing/executor.h"
+
+namespace trustid {
+namespace image {
+namespace impl {
+
+/**
+ * Batching policy of an EmbeddingBatcher.
+ */
+struct EmbeddingBatcherConfig {
+  // maximum number of chips embedded in a single forward pass
+  size_t maxBatchSize = 16;
+
+  // maximum time the oldest chip of a batch waits for others to join it
+  std::chrono::microseconds maxWait = std::chrono::milliseconds(5);
+
+  // maximum number of chips waiting to be embedded, submit() blocks beyond it
+  size_t queueCapacity = 256;
+};
+
+/**
+ * Scheduler that coalesces face chips submitted by independent callers into
+ * batched ResNet34 forward passes.
+ *
+ * Chips are collected until either maxBatchSize chips are waiting or the
+ * oldest one has waited for maxWait, then the whole batch runs through the
+ * network at once and the future of every caller is completed. A maxWait of
+ * zero only batches chips that are already waiting, so an idle batcher adds
+ * no latency.
+ *
+ * The batches are collected by a thread of the batcher, which only waits on
+ * the queue, and their forward passes run on the shared executor, one at a
+ * time. A batch that no worker picks up within a couple of milliseconds,
+ * e.g. because every worker is waiting on an embedding, is run by the
+ * collecting thread instead.
+ */
+class EmbeddingBatcher {
+ public:
+  EmbeddingBatcher(const std::shared_ptr<ResNet34> net,
+                   const EmbeddingBatcherConfig config =
+                       EmbeddingBatcherConfig());
+
+  // Completes the pending chips and stops the collecting thread.
+  ~EmbeddingBatcher();
+
+  EmbeddingBatcher(const EmbeddingBatcher&) = delete;
+  EmbeddingBatcher& operator=(const EmbeddingBatcher&) = delete;
+
+  // Queues a 150x150 face chip, as extracted by DlibFaceChipExtractor.
+  std::future<FaceEmbedding> submit(dlib::matrix<dlib::rgb_pixel> chip);
+
+  // Number of forward passes run so far.
+  uint64_t getBatchCount() const;
+
+  // Number of embeddings computed so far.
+  uint64_t getEmbeddingCount() const;
+
+ private:
+  struct Request {
+    dlib::matrix<dlib::rgb_pixel> chip;
+    std::promise<FaceEmbedding> promise;
+    std::chrono::steady_clock::time_point submitTime;
+  };
+
+  struct Batch {
+    std::vector<std::unique_ptr<Request>> requests;
+    std::atomic<bool> claimed{false};  // by a worker or the collector
+    std::promise<void> done;
+  };
+
+  // Collecting loop, handing batches to the executor until the queue is
+  // closed.
+  void run();
+
+  // Runs a forward pass over the batch and completes its futures.
+  void runBatch(Batch& batch);
+
+  EmbeddingBatcherConfig config;
+  ResNet34 net;  // own copy, forward passes are not thread-safe
+  BoundedQueue<std::unique_ptr<Request>> queue;
+  std::atomic<uint64_t> batchCount{0};
+  std::atomic<uint64_t> embeddingCount{0};
+  std::thread collector;
+};
+
+}  // namespace impl
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_DLIB_EMBEDDING_BATCHER_H_
@@ -0,0 +1,170 @@
+#ifndef TRUSTID_DLIB_ENROLLMENT_RECORDS_H_
+#define TRUSTID_DLIB_ENROLLMENT_RECORDS_H_
+
+#include <dlib/image_processing.h>
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "trustid_image_processing/face_detector.h"
+
+namespace trustid {
+namespace image {
+namespace impl {
+
+/**
+ * A record of an enrollment dataset: an encoded image of a user and,
+ * optionally, the face found on it and its landmarks, so the detector and the
+ * shape predictor don't have to run again when enrolling.
+ */
+struct EnrollmentRecord {
+  std::string userId;
+
+  // image in any format cv::imdecode reads, e.g. the bytes of a JPEG file
+  std::vector<unsigned char> encodedImage;
+
+  bool hasDetection = false;
+  FaceDetectionConfidenceBoundingBox boundingBox = {};
+
+  // landmarks of the face (68 points), empty if not precomputed
+  std::vector<cv::Point2f> landmarks;
+};
+
+/**
+ * A record decoded by an EnrollmentRecordReader.
+ */
+struct DecodedEnrollmentRecord {
+  uint64_t recordIdx;
+  std::string userId;
+
+  // the decoded image and its face, only set if the record is valid
+  FaceDetectionResultEntry entry;
+
+  // whether the image was decoded and holds exactly one face
+  bool valid = false;
+
+  std::vector<cv::Point2f> landmarks;
+
+  // Returns the precomputed landmarks as a dlib shape, e.g. for
+  // DlibFaceChipExtractor::extractChip. Throws if there are none.
+  dlib::full_object_detection getShape() const;
+};
+
+/**
+ * Writes an enrollment dataset into a single record file, so it can be read
+ * back sequentially instead of opening one small file per image (which is
+ * slow on network filesystems).
+ *
+ * The file holds a header, the records one after the other and, once the
+ * writer is closed, an index of the records and a footer pointing at it. The
+ * records of a user should be appended together, which is what
+ * EnrollmentRecordReader::readUsers expects.
+ */
+class EnrollmentRecordWriter {
+ public:
+  // Creates the given file, replacing any existing one.
+  EnrollmentRecordWriter(const std::string& pathToFile);
+
+  // Closes the file, if not already closed.
+  ~EnrollmentRecordWriter();
+
+  EnrollmentRecordWriter(const EnrollmentRecordWriter&) = delete;
+  EnrollmentRecordWriter& operator=(const EnrollmentRecordWriter&) = delete;
+
+  // Appends the given record.
+  void append(const EnrollmentRecord& record);
+
+  // Appends the image and the face of the given entry, encoded as JPEG.
+  void append(const std::string& userId, const FaceDetectionResultEntry& entry,
+              int jpegQuality = 90);
+
+  // Writes the index and the footer, and closes the file.
+  void close();
+
+  // Number of records written.
+  uint64_t size() const;
+
+  // Maximum length of a user id.
+  static constexpr uint32_t kMaxUserIdLength = 1024;
+
+ private:
+  std::string pathToFile;
+  std::ofstream out;
+  std::vector<char> buffer;
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> userHashes;
+  uint64_t offset;
+};
+
+/**
+ * Reads an enrollment record file, either one record at a time through its
+ * index, or sequentially in large chunks with the images decoded in parallel.
+ *
+ * Files whose writer was not closed have no index, so their records are found
+ * by walking the file, up to the last complete record. A reader must not be
+ * used from several threads at once.
+ */
+class EnrollmentRecordReader {
+ public:
+  // Records of a user, ready for the DlibFaceVerificator enrollment
+  // constructor or an EnrollmentSelector.
+  using UserCallback =
+      std::function<void(const std::string& userId,
+                         std::vector<FaceDetectionResultEntry>& entries)>;
+  using ChunkCallback =
+      std::function<void(std::vector<DecodedEnrollmentRecord>& records)>;
+
+  // Opens an existing record file.
+  EnrollmentRecordReader(const std::string& pathToFile);
+
+  // Number of records in the file.
+  uint64_t size() const;
+
+  // Reads the given record, without decoding its image.
+  EnrollmentRecord read(uint64_t recordIdx);
+
+  // Returns the indices of the records of the given user.
+  std::vector<uint64_t> findUser(std::string_view userId);
+
+  // Reads every record in file order, about chunkSize bytes at a time, and
+  // calls onChunk with the decoded records of each chunk. The images of a
+  // chunk are decoded in parallel on the library executor while the next
+  // chunk is read there, through a stream of its own, so onChunk may call
+  // read and findUser. Records without a precomputed face are run through
+  // the given detector, or marked invalid if there is none.
+  void readDecoded(const ChunkCallback& onChunk,
+                   std::shared_ptr<IFaceDetector> detector = nullptr,
+                   size_t chunkSize = kDefaultChunkSize);
+
+  // Same as readDecoded, calling onUser with the valid entries of each user
+  // (possibly none) once all of its records were decoded.
+  void readUsers(const UserCallback& onUser,
+                 std::shared_ptr<IFaceDetector> detector = nullptr,
+                 size_t chunkSize = kDefaultChunkSize);
+
+  static constexpr size_t kDefaultChunkSize = 64 * 1024 * 1024;
+
+ private:
+  // Reads the index, or rebuilds it if the file was not closed.
+  void open();
+
+  // Reads the bytes of the records in [first, last) from the given stream of
+  // the file.
+  std::vector<char> readChunk(std::ifstream& stream, uint64_t first,
+                              uint64_t last) const;
+
+  std::string pathToFile;
+  std::ifstream in;
+  std::vector<uint64_t> offsets;  // one past the last record at the end
+  std::vector<uint64_t> userHashes;
+};
+
+}  // namespace impl
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_DLIB_ENROLLMENT_RECORDS_H_
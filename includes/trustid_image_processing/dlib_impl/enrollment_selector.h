@@ -0,0 +1,112 @@
+#ifndef TRUSTID_DLIB_ENROLLMENT_SELECTOR_H_
+#define TRUSTID_DLIB_ENROLLMENT_SELECTOR_H_
+
+#include <dlib/image_processing.h>
+
+#include <memory>
+#include <vector>
+
+#include "trustid_image_processing/face_detector.h"
+#include "trustid_image_processing/face_normalization.h"
+#include "trustid_image_processing/utils.h"
+
+namespace trustid {
+namespace image {
+namespace impl {
+
+/**
+ * Scoring and selection settings of an EnrollmentSelector.
+ */
+struct EnrollmentSelectorConfig {
+  // maximum number of frames selected for enrollment
+  size_t maxFrames = 10;
+
+  // frames failing the quality check are never selected
+  bool qualityGate = true;
+  utils::ImageQualityThresholds qualityThresholds;
+
+  // frames turned beyond these yaw and pitch (degrees) are never selected
+  double maxYaw = 30;
+  double maxPitch = 25;
+
+  // weight of the detector confidence in the frame score, next to the
+  // frontality of the face (1 for a frontal face, 0 at the pose limits)
+  double confidenceWeight = 0.5;
+
+  // weight of the landmark distance to the frames already selected, so
+  // frames showing the face differently are preferred over better scored
+  // near duplicates
+  double diversityWeight = 1.0;
+
+  // mean landmark displacement (as a fraction of the face box size) at which
+  // a frame counts as fully different from the selected ones
+  double diversityScale = 0.05;
+
+  // frames closer than this to a selected frame are near duplicates and are
+  // skipped
+  double minLandmarkDistance = 0.01;
+};
+
+/**
+ * Cheap measurements of an enrollment candidate frame.
+ */
+struct EnrollmentFrameScore {
+  size_t index;  // index of the frame in the candidates
+  utils::ImageQualityResultEnum quality;
+  HeadPoseEstimationResult pose;
+  double score;   // confidence and frontality, 0 for rejected frames
+  bool accepted;  // whether the frame passed the quality and pose checks
+};
+
+/**
+ * Picks the frames worth embedding out of the (often redundant) frames of an
+ * enrollment capture, so only a handful of forward passes are needed per
+ * user.
+ *
+ * Every candidate is scored without the network: quality check, head pose
+ * and detector confidence. Then at most maxFrames accepted frames are picked
+ * greedily, each time taking the frame with the best score plus diversity
+ * bonus, the diversity being the landmark distance to the frames picked so
+ * far. The result can be passed as is to the DlibFaceVerificator enrollment
+ * constructor.
+ */
+class EnrollmentSelector {
+ public:
+  EnrollmentSelector(
+      std::shared_ptr<dlib::shape_predictor> sp,
+      const EnrollmentSelectorConfig config = EnrollmentSelectorConfig());
+
+  // Scores every candidate frame, in parallel on the library executor.
+  std::vector<EnrollmentFrameScore> scoreFrames(
+      const std::vector<FaceDetectionResultEntry>& candidates) const;
+
+  // Returns the indices of the selected frames, in selection order (best
+  // first). Fewer than maxFrames are returned when not enough frames pass
+  // the checks or differ from each other, and none if every frame fails.
+  std::vector<size_t> select(
+      const std::vector<FaceDetectionResultEntry>& candidates) const;
+
+  // Returns the selected frames, in selection order.
+  std::vector<FaceDetectionResultEntry> selectEntries(
+      const std::vector<FaceDetectionResultEntry>& candidates) const;
+
+ private:
+  // Scores the given frame, keeping its landmarks relative to the face box.
+  EnrollmentFrameScore scoreFrame(const FaceDetectionResultEntry& candidate,
+                                  std::vector<cv::Point2f>& landmarks) const;
+
+  // Scores every candidate frame, keeping the landmarks of each one (empty
+  // for rejected frames).
+  std::vector<EnrollmentFrameScore> scoreFrames(
+      const std::vector<FaceDetectionResultEntry>& candidates,
+      std::vector<std::vector<cv::Point2f>>& landmarks) const;
+
+  std::shared_ptr<dlib::shape_predictor> sp;
+  FaceNormalizer normalizer;
+  EnrollmentSelectorConfig config;
+};
+
+}  // namespace impl
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_DLIB_ENROLLMENT_SELECTOR_H_
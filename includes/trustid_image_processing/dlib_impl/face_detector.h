@@ -20,6 +20,12 @@ class DlibFaceDetector : public trustid::image::IFaceDetector {
  private:
   trustid::image::FaceDetectionResult _detectFaces(
       const cv::Mat image) override;
+
+  // Detects the images in parallel on the library executor, each one with its
+  // own copy of the detector.
+  std::vector<trustid::image::FaceDetectionResult> _detectFacesBatch(
+      const std::vector<cv::Mat>& images) override;
+
   dlib::frontal_face_detector ffdetector;
 };
 }  // namespace impl
@@ -0,0 +1,239 @@
+#ifndef TRUSTID_DLIB_FACE_PIPELINE_H_
+#define TRUSTID_DLIB_FACE_PIPELINE_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trustid_image_processing/bounded_queue.h"
+#include "trustid_image_processing/dlib_impl/face_detector.h"
+#include "trustid_image_processing/dlib_impl/face_verificator.h"
+#include "trustid_image_processing/face_normalization.h"
+#include "trustid_image_processing/utils.h"
+
+namespace trustid {
+namespace image {
+namespace impl {
+
+/**
+ * What a FacePipeline does with new requests once it is full.
+ */
+enum AdmissionPolicyEnum {
+  // block the caller until the request can be queued
+  BLOCK_CALLER,
+  // fail the new request
+  REJECT_NEW,
+  // fail the oldest queued request to make room for the new one
+  DROP_OLDEST,
+  // detect faces on downscaled frames (cropping the faces from the full
+  // frame) while every in-flight slot is taken, and fail new requests once
+  // the queue is full
+  DEGRADE_TO_LOW_RES
+};
+
+/**
+ * Error held by the future of a request that was rejected or shed by the
+ * admission control of a FacePipeline.
+ */
+class FacePipelineOverloadedError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+/**
+ * Number of workers of each stage of a FacePipeline, size of the queues
+ * between them and admission control settings.
+ */
+struct FacePipelineConfig {
+  unsigned decodeWorkers = 1;
+  unsigned detectWorkers = 2;
+  unsigned chipWorkers = 1;
+  unsigned embedWorkers = 1;
+  unsigned matchWorkers = 1;
+
+  // maximum number of requests waiting in front of each stage
+  size_t queueCapacity = 32;
+
+  // maximum number of chips embedded in a single forward pass
+  size_t maxEmbedBatchSize = 8;
+
+  // maximum number of requests inside the stages (at most queueCapacity)
+  size_t maxInFlight = 16;
+
+  // maximum number of admitted requests waiting to enter the stages (with 0,
+  // requests are only admitted while an in-flight slot is free)
+  size_t maxQueuedRequests = 64;
+
+  AdmissionPolicyEnum admissionPolicy = BLOCK_CALLER;
+
+  // longest side of the frames detected in DEGRADE_TO_LOW_RES mode
+  int degradedMaxImageSize = 640;
+
+  // check the quality of the largest face after detection, and skip the
+  // chip, embed and match stages for faces failing the check
+  bool qualityGate = false;
+  utils::ImageQualityThresholds qualityThresholds;
+
+  // estimate the head pose from the chip landmarks, and skip the embed and
+  // match stages for faces turned beyond the given yaw and pitch (degrees)
+  bool poseGate = false;
+  double maxYaw = 30;
+  double maxPitch = 25;
+};
+
+/**
+ * Image to run through a FacePipeline.
+ */
+struct FacePipelineRequest {
+  // encoded image (e.g. JPEG), decoded by the pipeline when image is empty
+  std::vector<unsigned char> encodedImage;
+
+  // already decoded BGR image
+  cv::Mat image;
+
+  // user the largest face is verified against, if any
+  std::shared_ptr<IFaceVerificator> verificator;
+};
+
+/**
+ * Result of running an image through a FacePipeline.
+ */
+struct FacePipelineResult {
+  FacePipelineResult()
+      : verificationResult(FaceDetectionResultEntry(), 0, UNKNOWN) {}
+
+  FaceDetectionResult detectionResult;
+
+  // quality of the largest face, UNKNOWN if no face was found or the quality
+  // gate is disabled. The face is only embedded if it is GOOD_QUALITY.
+  utils::ImageQualityResultEnum quality = utils::UNKNOWN;
+
+  // head pose of the largest face, only estimated with the pose gate
+  HeadPoseEstimationResult headPose;
+  bool frontal = false;  // whether the face passed the pose gate
+
+  // embedding of the largest face, empty if no face was found
+  FaceEmbedding embedding;
+
+  // UNKNOWN if no face was found or the request had no verificator
+  FaceVerificationResult verificationResult;
+};
+
+/**
+ * Runtime statistics of a stage of a FacePipeline.
+ */
+struct FacePipelineStageStats {
+  std::string name;
+  size_t queueDepth;     // requests currently waiting for the stage
+  size_t queueCapacity;  // maximum number of waiting requests
+  unsigned workers;
+  double utilization;  // fraction of the worker time spent processing
+  uint64_t processed;  // requests that went through the stage
+};
+
+/**
+ * Admission control counters of a FacePipeline.
+ */
+struct FacePipelineAdmissionStats {
+  size_t inFlight;    // requests inside the stages
+  size_t queued;      // requests waiting to enter the stages
+  uint64_t admitted;  // requests accepted by submit()
+  uint64_t rejected;  // requests failed by submit() (REJECT_NEW and others)
+  uint64_t shed;      // queued requests failed to make room (DROP_OLDEST)
+  uint64_t degraded;  // requests detected on a downscaled frame
+  uint64_t poorQuality;  // requests whose face failed the quality gate
+  uint64_t nonFrontal;   // requests whose face failed the pose gate
+};
+
+/**
+ * End to end face processing engine, running decode, detect, landmark/chip,
+ * embed and match as separate stages connected by bounded queues.
+ *
+ * Every stage has its own worker threads, so the CPU heavy stages of
+ * different requests overlap instead of running one request at a time. The
+ * embed stage takes every chip waiting in its queue (up to
+ * maxEmbedBatchSize) and runs them through the network in a single batched
+ * forward pass.
+ *
+ * Requests go through an admission layer first: at most maxInFlight requests
+ * are inside the stages and at most maxQueuedRequests wait for a slot, so
+ * the pipeline never holds more than a bounded number of frames. What
+ * happens to requests beyond that depends on the admission policy.
+ */
+class FacePipeline {
+ public:
+  FacePipeline(const std::shared_ptr<ResNet34> net,
+               const std::shared_ptr<dlib::shape_predictor> sp,
+               const FacePipelineConfig config = FacePipelineConfig());
+
+  // Waits for the pending requests and stops every worker.
+  ~FacePipeline();
+
+  FacePipeline(const FacePipeline&) = delete;
+  FacePipeline& operator=(const FacePipeline&) = delete;
+
+  // Queues the given request according to the admission policy. The
+  // returned future holds the exception thrown by any stage of the request,
+  // or a FacePipelineOverloadedError if the request was rejected or shed.
+  std::future<FacePipelineResult> submit(FacePipelineRequest request);
+
+  // Returns the statistics of every stage, in processing order.
+  std::vector<FacePipelineStageStats> getStageStats() const;
+
+  // Returns the admission control counters.
+  FacePipelineAdmissionStats getAdmissionStats() const;
+
+ private:
+  struct Job;
+  struct Stage;
+  typedef std::unique_ptr<Job> JobPtr;
+
+  // Starts the workers of the given stage. Each worker calls makeBody once to
+  // build its own processing function (with its own detector or network
+  // copy), which then runs over the batches taken from the stage queue.
+  template <typename MakeBody>
+  void startStage(size_t stageIdx, MakeBody makeBody);
+
+  // Completes the given job with its result or the given exception, and
+  // admits the next queued request into the stages.
+  void complete(JobPtr job, std::exception_ptr exception = nullptr);
+
+  // Moves queued requests into the stages while there are free slots. The
+  // admission mutex must be held.
+  void dispatchQueuedJobs();
+
+  // Stage bodies, completing the given job or leaving it for the next stage.
+  void decode(Job& job);
+  void detect(IFaceDetector& detector, IFaceDetector& degradedDetector,
+              Job& job);
+  void extractChip(DlibFaceChipExtractor& chipExtractor,
+                   FaceNormalizer& normalizer, Job& job);
+  void embed(ResNet34& net, std::vector<JobPtr>& jobs);
+  void match(Job& job);
+
+  FacePipelineConfig config;
+  std::chrono::steady_clock::time_point startTime;
+  std::vector<std::unique_ptr<Stage>> stages;
+
+  // admission control state
+  mutable std::mutex admissionMutex;
+  std::condition_variable admissionChanged;
+  std::deque<JobPtr> queuedJobs;
+  size_t inFlight = 0;
+  bool stopping = false;
+  FacePipelineAdmissionStats admissionStats = {};
+};
+
+}  // namespace impl
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_DLIB_FACE_PIPELINE_H_
@@ -0,0 +1,154 @@
+#ifndef TRUSTID_DLIB_FACE_STREAM_PROCESSOR_H_
+#define TRUSTID_DLIB_FACE_STREAM_PROCESSOR_H_
+
+#include <dlib/image_processing.h>
+#include <dlib/opencv.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "trustid_image_processing/face_detector.h"
+#include "trustid_image_processing/face_verificator.h"
+
+namespace trustid {
+namespace image {
+namespace impl {
+
+/**
+ * Detection, tracking and verification settings of a FaceStreamProcessor.
+ */
+struct FaceStreamProcessorConfig {
+  // run the detector on every Nth frame (and on frames where a track is lost)
+  unsigned detectEveryNFrames = 10;
+
+  // peak-to-sidelobe ratio below which a correlation track is considered lost
+  double minTrackQuality = 7.0;
+
+  // minimum overlap (intersection over union) between a detection and a
+  // track for the detection to re-anchor the track
+  double minMatchOverlap = 0.3;
+
+  // frames after which the identity of a track is stale and re-verified
+  unsigned maxIdentityAge = 30;
+
+  // mean landmark displacement, as a fraction of the face box size, beyond
+  // which the pose of a track changed and its embedding is recomputed (only
+  // with a shape predictor)
+  double maxPoseChange = 0.05;
+
+  // mean absolute difference between the 32x32 grayscale thumbnails of the
+  // face (in 0-255 levels) beyond which its embedding is recomputed
+  double maxAppearanceChange = 12;
+
+  // number of embeddings averaged by each track, older ones then fade out
+  unsigned maxAveragedEmbeddings = 10;
+};
+
+/**
+ * Face followed by a FaceStreamProcessor across frames.
+ */
+struct FaceTrack {
+  uint64_t trackId;
+  FaceDetectionConfidenceBoundingBox boundingBox;  // in the last frame
+
+  // result of the last verification of the track, UNKNOWN until verified or
+  // without verificator
+  FaceVerificationResultEnum identity = UNKNOWN;
+  double matchConfidence = 0;
+
+  // frames since the last verification of the track
+  unsigned identityAge = 0;
+
+  // running mean of the embeddings computed for the track, the identity is
+  // verified against it
+  FaceEmbedding embedding;
+  unsigned embeddingCount = 0;
+};
+
+/**
+ * Tracks of a processed frame.
+ */
+struct FaceStreamFrameResult {
+  std::vector<FaceTrack> tracks;
+  bool detectorRan;       // whether the frame went through the detector
+  size_t verifiedTracks;  // tracks verified on this frame
+  size_t embeddedTracks;  // tracks whose embedding was computed this frame
+};
+
+/**
+ * Processes video streams frame by frame, running the (expensive) face
+ * detector only every detectEveryNFrames frames or when a track is lost, and
+ * following the faces in between with dlib's correlation tracker. Each track
+ * is verified when it appears and again once its identity is older than
+ * maxIdentityAge frames, so per-frame cost is bounded by the trackers rather
+ * than by detection and embedding.
+ *
+ * Each track keeps a running mean of its embeddings. The network only runs
+ * again for a track when its identity is stale or its face changed: the
+ * landmarks moved (pose) or the face thumbnail differs (content). Otherwise,
+ * the cached embedding is reused.
+ *
+ * Frames of a stream must be processed in order from a single thread.
+ */
+class FaceStreamProcessor {
+ public:
+  // Tracks the faces found by the given detector, verifying them with the
+  // given verificator if it is not null. Pose changes are only detected with
+  // a shape predictor.
+  FaceStreamProcessor(
+      std::shared_ptr<IFaceDetector> detector,
+      std::shared_ptr<IFaceVerificator> verificator = nullptr,
+      std::shared_ptr<dlib::shape_predictor> sp = nullptr,
+      const FaceStreamProcessorConfig config = FaceStreamProcessorConfig());
+
+  // Processes the next frame of the stream.
+  FaceStreamFrameResult processFrame(const cv::Mat frame);
+
+  // Drops every track, e.g. when the stream restarts.
+  void reset();
+
+ private:
+  // Appearance of a face when its embedding was last computed.
+  struct FaceAppearance {
+    cv::Mat thumbnail;  // 32x32 grayscale face
+    std::vector<cv::Point2f> landmarks;  // relative to the face box
+  };
+
+  struct Track {
+    FaceTrack face;
+    dlib::correlation_tracker tracker;
+    bool verified = false;
+    FaceAppearance embeddedAppearance;
+  };
+
+  // Re-anchors the matching tracks on the detections of the frame, starts
+  // tracks for new faces and drops the tracks the detector no longer sees.
+  void applyDetections(const dlib::cv_image<dlib::bgr_pixel>& image,
+                       const FaceDetectionResult& detections);
+
+  // Verifies the face of the given track in the frame if its identity is
+  // stale or its face changed, computing a new embedding in the latter case.
+  void verifyTrack(const cv::Mat& frame, Track& track,
+                   FaceStreamFrameResult& result);
+
+  // Describes the face of the given entry.
+  FaceAppearance describeFace(const FaceDetectionResultEntry& entry) const;
+
+  // Whether the given appearance differs from the one of the last embedding.
+  bool hasFaceChanged(const Track& track,
+                      const FaceAppearance& appearance) const;
+
+  std::shared_ptr<IFaceDetector> detector;
+  std::shared_ptr<IFaceVerificator> verificator;
+  std::shared_ptr<dlib::shape_predictor> sp;
+  FaceStreamProcessorConfig config;
+  std::vector<Track> tracks;
+  uint64_t frameCount = 0;
+  uint64_t nextTrackId = 0;
+};
+
+}  // namespace impl
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_DLIB_FACE_STREAM_PROCESSOR_H_
@@ -4,7 +4,9 @@
 #include <dlib/dnn.h>
 #include <dlib/opencv.h>
 
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include "trustid_image_processing/face_verificator.h"
@@ -67,16 +69,39 @@ namespace trustid {
 namespace image {
 namespace impl {
 
+class EmbeddingBatcher;
+
 class DlibFaceChipExtractor : public IFaceVerifyImageProcessor {
  public:
   DlibFaceChipExtractor(std::shared_ptr<dlib::shape_predictor> sp);
   virtual FaceDetectionResultEntry operator()(
       const FaceDetectionResultEntry detectionResultEntry) override;
 
+  // Predicts the landmarks of the face of the given entry.
+  dlib::full_object_detection getLandmarks(
+      const FaceDetectionResultEntry& detectionResultEntry) const;
+
+  // Extracts the face chip aligned on the given landmarks, e.g. when they
+  // were also used to estimate the head pose.
+  FaceDetectionResultEntry extractChip(
+      const FaceDetectionResultEntry& detectionResultEntry,
+      const dlib::full_object_detection& shape) const;
+
  private:
   std::shared_ptr<dlib::shape_predictor> sp;
 };
 
+/**
+ * Metric used to compare the embeddings of a user.
+ */
+enum DistanceMetricEnum {
+  // Euclidean distance between the raw embeddings
+  EUCLIDEAN_DISTANCE,
+  // cosine similarity (dot product) between L2-normalized embeddings, with
+  // the threshold converted from the Euclidean distance threshold
+  COSINE_SIMILARITY
+};
+
 struct DlibFaceVerificatorModelParams {
   DlibFaceVerificatorModelParams() {}
   DlibFaceVerificatorModelParams(
@@ -85,32 +110,164 @@ struct DlibFaceVerificatorModelParams {
       : groundTruthVecs(groundTruthVecs),
         distanceThreshold(distanceThreshold),
         votingThreshold(votingThreshold) {}
+  DlibFaceVerificatorModelParams(
+      const std::vector<dlib::matrix<float, 0, 1>> groundTruthVecs,
+      const std::vector<float> groundTruthWeights,
+      const float distanceThreshold = 0.6, const float votingThreshold = 0.5)
+      : groundTruthVecs(groundTruthVecs),
+        groundTruthWeights(groundTruthWeights),
+        distanceThreshold(distanceThreshold),
+        votingThreshold(votingThreshold) {}
+
+  // Weight of the given ground truth vector in the voting score.
+  float getWeight(size_t idx) const;
+
+  // Sum of the weights of all ground truth vectors.
+  float getTotalWeight() const;
 
   // user specific data
   std::vector<dlib::matrix<float, 0, 1>> groundTruthVecs;
 
+  // number of enrollment samples each ground truth vector stands for (empty
+  // means every vector counts as a single vote)
+  std::vector<float> groundTruthWeights;
+
   // generic model building info
   float distanceThreshold;
   float votingThreshold;
 
-  DLIB_DEFINE_DEFAULT_SERIALIZATION(DlibFaceVerificatorModelParams,
-                                    groundTruthVecs, distanceThreshold,
-                                    votingThreshold);
+  // metric used to compare embeddings, the ground truth vectors are
+  // L2-normalized when using COSINE_SIMILARITY
+  DistanceMetricEnum metric = EUCLIDEAN_DISTANCE;
+};
+
+/**
+ * Precision of the ground truth vectors of serialized user params.
+ */
+enum EmbeddingPrecisionEnum {
+  FLOAT32_PRECISION,
+  // half the size, with a relative error below 1e-3 (far below the distance
+  // threshold margins)
+  FLOAT16_PRECISION
 };
 
-// Class that implements face verification using a simple voting algorithm based on Euclidean distances between ResNet34 embeddings.
+// Serializes the given params in the compact format: a version marker, a
+// fixed little-endian header (dims, count, flags, metric and thresholds),
+// then the weights and the ground truth vectors as raw little-endian float32
+// (or fp16) blocks, each padded to a multiple of 4 bytes. The blocks start
+// right after the 2-byte marker and the 24-byte header, so they are not
+// aligned in memory and are copied out when read. Every ground truth vector
+// must have the same size.
+void serialize(const DlibFaceVerificatorModelParams& item, std::ostream& out,
+               EmbeddingPrecisionEnum precision = FLOAT32_PRECISION);
+
+// Deserializes params written in the compact format or in any of the former
+// dlib encoded formats.
+void deserialize(DlibFaceVerificatorModelParams& item, std::istream& in);
+
+// Serializes the given users back to back, e.g. to fill a cache blob that is
+// read back with deserializeUserParamsBatch.
+void serializeUserParamsBatch(
+    const std::vector<DlibFaceVerificatorModelParams>& users,
+    std::ostream& out, EmbeddingPrecisionEnum precision = FLOAT32_PRECISION);
+
+// Reads every user of the given buffer, holding serialized params back to
+// back. Compact records are parsed straight from memory, without going
+// through a stream, and older records are still accepted.
+std::vector<DlibFaceVerificatorModelParams> deserializeUserParamsBatch(
+    const char* data, size_t size);
+
+// Reduces the enrollment set of a user to (at most) k weighted prototypes
+// using k-means, so verification cost no longer depends on the number of
+// enrollment frames. Each prototype is weighted by the number of samples in
+// its cluster. If useMedoids is set, the prototypes are the enrollment vectors
+// closest to each cluster centroid instead of the centroids themselves.
+DlibFaceVerificatorModelParams compressUserParams(
+    const DlibFaceVerificatorModelParams& userParams, unsigned long k,
+    bool useMedoids = true);
+
+// Returns a copy of the given params using the COSINE_SIMILARITY metric, with
+// the ground truth vectors L2-normalized (empty vectors are left as they are).
+// The distance threshold is kept, and converted to a similarity threshold when
+// verifying. The conversion assumes unit length embeddings: the embeddings of
+// the ResNet34 model are only close to unit length, so the cosine decision
+// approximates the Euclidean one and the threshold may need tuning.
+DlibFaceVerificatorModelParams convertToCosineSimilarity(
+    const DlibFaceVerificatorModelParams& userParams);
+
+// Scales the given embedding to unit length.
+void normalizeEmbedding(float* embedding, uint32_t dims);
+
+// Converts a Euclidean distance threshold to the equivalent cosine similarity
+// threshold for unit length embeddings, since |a - b|^2 = 2 - 2 * a.b
+float distanceToSimilarityThreshold(float distanceThreshold);
+
+/**
+ * Non-owning view of the model parameters of a user, with the ground truth
+ * vectors packed in a single row-major block. Allows verifying users straight
+ * from memory owned elsewhere (e.g. a memory-mapped TemplateStore) without
+ * copying or deserializing the user model.
+ */
+struct UserTemplateView {
+  const float* vectors = nullptr;  // count x dims floats, row-major
+  const float* weights = nullptr;  // count floats
+  uint32_t count = 0;
+  uint32_t dims = 0;
+  float distanceThreshold = 0.6f;
+  float votingThreshold = 0.5f;
+  DistanceMetricEnum metric = EUCLIDEAN_DISTANCE;
+
+  // Returns a pointer to the given ground truth vector.
+  const float* getVector(size_t idx) const { return vectors + idx * dims; }
+
+  // Sum of the weights of all ground truth vectors.
+  float getTotalWeight() const;
+
+  // Copies the viewed data into standalone model parameters.
+  DlibFaceVerificatorModelParams toModelParams() const;
+};
+
+/**
+ * How the votes of the ground truth vectors are evaluated when verifying a
+ * user.
+ */
+enum VotingEvaluationModeEnum {
+  // compares the probe with every ground truth vector, the match confidence
+  // is the exact voting score
+  FULL_EVALUATION,
+  // stops as soon as the verification result can no longer change, the match
+  // confidence is the score of the votes evaluated so far
+  EARLY_TERMINATION,
+  // same as EARLY_TERMINATION, but evaluates the ground truth vectors with
+  // the highest historical hit rate first so decisions resolve earlier
+  EARLY_TERMINATION_BY_HIT_RATE
+};
+
+// Class that implements face verification using a simple voting algorithm based on Euclidean distances (or cosine similarities) between ResNet34 embeddings.
 //   
 class DlibFaceVerificator : public IFaceVerificator {
  public:
+  // Builds the user model from the given enrollment images. If maxPrototypes
+  // is non-zero, the enrollment set is compressed to at most that many
+  // weighted prototypes (see compressUserParams). Embeddings are compared
+  // with the given metric.
   DlibFaceVerificator(const std::shared_ptr<ResNet34> net,
       const std::shared_ptr<dlib::shape_predictor> sp,
       const std::vector<FaceDetectionResultEntry> groundTruthChips,
-      const float distanceThreshold = 0.6, const float votingThreshold = 0.5);
+      const float distanceThreshold = 0.6, const float votingThreshold = 0.5,
+      const unsigned long maxPrototypes = 0,
+      const DistanceMetricEnum metric = EUCLIDEAN_DISTANCE);
 
   DlibFaceVerificator(const std::shared_ptr<ResNet34> net,
                       const std::shared_ptr<dlib::shape_predictor> sp,
                       const DlibFaceVerificatorModelParams userParams);
 
+  // Builds a verificator that reads the user model from the given view, which
+  // must outlive the verificator.
+  DlibFaceVerificator(const std::shared_ptr<ResNet34> net,
+                      const std::shared_ptr<dlib::shape_predictor> sp,
+                      const UserTemplateView userTemplate);
+
   // Get the model parameters for the given user.
   DlibFaceVerificatorModelParams getUserParams();
 
@@ -118,12 +275,43 @@ class DlibFaceVerificator : public IFaceVerificator {
   // loaded or not.
   bool canVerifyUser();
 
+  // Set how the votes are evaluated, callers that need the exact match
+  // confidence should use FULL_EVALUATION (the default).
+  void setVotingEvaluationMode(VotingEvaluationModeEnum evaluationMode);
+
+  // Computes embeddings through the given batcher instead of the network, so
+  // the forward passes of many verificators are coalesced (pass nullptr to go
+  // back to the network).
+  void setEmbeddingBatcher(std::shared_ptr<EmbeddingBatcher> batcher);
+
  private:
-  virtual FaceVerificationResult _verifyUser(
+  virtual FaceEmbedding _extractEmbedding(
       const FaceDetectionResultEntry detectionResultEntry) override;
 
+  virtual FaceVerificationResult _verifyEmbedding(
+      const FaceEmbedding& embedding) override;
+
+  // Packs the owned user params into the template view used for voting.
+  void packUserParams();
+
+  // Resets the evaluation order and hit counts of the ground truth vectors.
+  void resetEvaluationOrder();
+
   DlibFaceVerificatorModelParams userParams;
-  std::shared_ptr<ResNet34> net;
+  std::shared_ptr<ResNet34> net;  // each thread runs its own copy
+  std::shared_ptr<EmbeddingBatcher> batcher;
+
+  // ground truth vectors used for voting, either pointing to the packed
+  // copy of userParams or to externally owned memory
+  UserTemplateView userTemplate;
+  bool ownsTemplate = true;
+  std::vector<float> packedVecs;
+  std::vector<float> packedWeights;
+
+  VotingEvaluationModeEnum evaluationMode = FULL_EVALUATION;
+  std::vector<size_t> evaluationOrder;  // order to evaluate the vectors in
+  std::vector<unsigned long> sampleHits;  // number of matches of each vector
+  std::mutex hitStatsMutex;  // guards evaluationOrder and sampleHits
 };
 
 // util functions for loading model objects into memory
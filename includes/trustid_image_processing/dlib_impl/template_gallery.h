@@ -0,0 +1,92 @@
+#ifndef TRUSTID_DLIB_TEMPLATE_GALLERY_H_
+#define TRUSTID_DLIB_TEMPLATE_GALLERY_H_
+
+#include <dlib/matrix.h>
+
+#include <vector>
+
+#include "trustid_image_processing/dlib_impl/face_verificator.h"
+#include "trustid_image_processing/face_verificator.h"
+
+namespace trustid {
+namespace image {
+namespace impl {
+
+/**
+ * Templates of many users packed into a single matrix, used to score batches
+ * of probe embeddings at once (e.g. re-scoring captured probes against their
+ * claimed identities, or deduplicating a gallery).
+ *
+ * Every probe/template comparison comes from one matrix product between the
+ * probes and the templates, which dlib runs as an SGEMM when built with BLAS,
+ * plus the precomputed norm terms: |p - t|^2 = |p|^2 + |t|^2 - 2 p.t for
+ * Euclidean users and p.t / |p| for cosine similarity users. The per-user
+ * voting rule is then applied on the result, matching
+ * DlibFaceVerificator::verifyUser. Blocks of probes (and the users of
+ * verifyEmbeddings) are spread over the library executor.
+ */
+class TemplateGallery {
+ public:
+  TemplateGallery(const std::vector<DlibFaceVerificatorModelParams>& users);
+  TemplateGallery(const std::vector<UserTemplateView>& users);
+
+  // Number of users in the gallery.
+  size_t getUserCount() const;
+
+  // Number of template vectors in the gallery, over all users.
+  long getTemplateCount() const;
+
+  // Computes the squared Euclidean distance between every probe (one per row)
+  // and every template vector of the gallery.
+  dlib::matrix<float> computeSquaredDistances(
+      const dlib::matrix<float>& probes) const;
+
+  // Computes the voting confidence of every probe (one per row) for every user
+  // of the gallery. Users without templates, or whose weights are all zero,
+  // get a confidence of 0.
+  dlib::matrix<float> scoreEmbeddings(const dlib::matrix<float>& probes) const;
+
+  // Verifies every probe (one per row) against the user it claims to be.
+  std::vector<FaceVerificationResult> verifyEmbeddings(
+      const dlib::matrix<float>& probes,
+      const std::vector<size_t>& claimedUsers) const;
+
+ private:
+  struct UserEntry {
+    long begin;  // first template row of the user
+    long end;    // one past the last template row of the user
+    float totalWeight;
+    float squaredDistanceThreshold;
+    float similarityThreshold;
+    float votingThreshold;
+    DistanceMetricEnum metric;
+  };
+
+  // Appends the given user to the packed template vectors.
+  void addUser(const UserTemplateView& userTemplate,
+               std::vector<float>& packedVecs);
+
+  // Builds the template matrix from the packed template vectors.
+  void buildTemplates(const std::vector<float>& packedVecs);
+
+  // Computes the dot products between the given probes and the templates in
+  // [begin, end), in blocks of probes to bound the memory used.
+  template <typename Callback>
+  void forEachProbeBlock(const dlib::matrix<float>& probes, long begin,
+                         long end, Callback callback) const;
+
+  // Applies the voting rule of the given user to the dot products of a probe
+  // with the templates of that user.
+  float vote(const UserEntry& user, const float* dots, float squaredNorm) const;
+
+  std::vector<UserEntry> users;
+  std::vector<float> weights;
+  dlib::matrix<float> templates;                  // one template per row
+  dlib::matrix<float, 0, 1> templateSquaredNorms;  // of each template row
+  long dims = 0;
+};
+
+}  // namespace impl
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_DLIB_TEMPLATE_GALLERY_H_
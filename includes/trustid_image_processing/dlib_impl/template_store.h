@@ -0,0 +1,103 @@
+#ifndef TRUSTID_DLIB_TEMPLATE_STORE_H_
+#define TRUSTID_DLIB_TEMPLATE_STORE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "trustid_image_processing/dlib_impl/face_verificator.h"
+
+namespace trustid {
+namespace image {
+namespace impl {
+
+/**
+ * On-disk store of user templates, kept in a single memory-mapped file.
+ *
+ * The file holds a header, an open addressing hash index (user id -> record)
+ * and fixed-width records, each one aligned to 64 bytes and with room for up
+ * to getMaxVectors() ground truth vectors. Looking up a user only hashes the
+ * id and returns a view into the mapped file, so nothing is allocated or
+ * parsed when loading a user model.
+ *
+ * Records are only appended: replacing or removing a user marks its old
+ * record as a tombstone, which compact() reclaims. Any modification may remap
+ * the file and invalidates the views previously returned by getUser(), so a
+ * store must not be modified while other threads are reading from it.
+ */
+class TemplateStore {
+ public:
+  // Opens an existing store.
+  TemplateStore(const std::string& pathToFile, bool readOnly = true);
+
+  ~TemplateStore();
+
+  TemplateStore(const TemplateStore&) = delete;
+  TemplateStore& operator=(const TemplateStore&) = delete;
+
+  // Creates an empty store for embeddings with the given number of
+  // dimensions, holding up to maxVectors ground truth vectors per user
+  // (larger models should be reduced with compressUserParams first).
+  static void create(const std::string& pathToFile, uint32_t dims = 128,
+                     uint32_t maxVectors = 32, uint64_t indexCapacity = 1024);
+
+  // Checks if the store has a model for the given user.
+  bool contains(std::string_view userId) const;
+
+  // Returns a view of the model of the given user, pointing straight into the
+  // mapped file. Throws if the user is not in the store.
+  UserTemplateView getUser(std::string_view userId) const;
+
+  // Appends the model of the given user, replacing any previous one.
+  void append(std::string_view userId,
+              const DlibFaceVerificatorModelParams& userParams);
+
+  // Marks the model of the given user as removed.
+  void remove(std::string_view userId);
+
+  // Rewrites the store without the removed records.
+  void compact();
+
+  // Flushes the pending changes to disk.
+  void flush();
+
+  // Number of users in the store.
+  uint64_t size() const;
+
+  // Number of removed records waiting to be reclaimed by compact().
+  uint64_t tombstoneCount() const;
+
+  uint32_t getDims() const;
+  uint32_t getMaxVectors() const;
+
+  // Maximum length of a user id.
+  static constexpr uint32_t kMaxUserIdLength = 63;
+
+ private:
+  struct MappedFile;
+
+  // Maps the file and validates its header.
+  void open();
+
+  // Returns the index slot holding the given user, or the index capacity if
+  // the user is not in the store.
+  uint64_t findSlot(std::string_view userId) const;
+
+  // Rewrites the store without the removed records, with the given index and
+  // record capacity.
+  void rewrite(uint64_t indexCapacity, uint64_t recordCapacity);
+
+  std::string pathToFile;
+  bool readOnly;
+  std::unique_ptr<MappedFile> file;
+};
+
+// util function for loading a template store into memory
+std::shared_ptr<TemplateStore> loadTemplateStoreFromDisk(
+    std::string pathToFile, bool readOnly = true);
+
+}  // namespace impl
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_DLIB_TEMPLATE_STORE_H_
@@ -0,0 +1,232 @@
+#ifndef TRUSTID_EXECUTOR_H_
+#define TRUSTID_EXECUTOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace trustid {
+namespace image {
+/**
+ * Priority class of the tasks run by an Executor.
+ */
+enum TaskPriorityEnum {
+  // latency sensitive work, such as 1:1 verifications
+  INTERACTIVE_PRIORITY = 0,
+  // bulk work, such as building user models from enrollment images
+  ENROLLMENT_PRIORITY = 1
+};
+
+/**
+ * Sets the priority class of the tasks posted by the calling thread while the
+ * scope is alive. Tasks posted from a running task inherit its priority, so
+ * every nested parallel section of an enrollment stays in the enrollment
+ * class. Threads outside any scope post interactive tasks.
+ */
+class TaskPriorityScope {
+ public:
+  explicit TaskPriorityScope(TaskPriorityEnum priority);
+  ~TaskPriorityScope();
+
+  TaskPriorityScope(const TaskPriorityScope&) = delete;
+  TaskPriorityScope& operator=(const TaskPriorityScope&) = delete;
+
+ private:
+  TaskPriorityEnum previousPriority;
+};
+
+/**
+ * Returns the priority class of the tasks posted by the calling thread.
+ */
+TaskPriorityEnum getCurrentTaskPriority();
+
+/**
+ * Work-stealing pool of worker threads, shared by every component of the
+ * library that runs work in parallel.
+ *
+ * Each worker has its own deque: tasks posted from a worker go to the back of
+ * its deque and are run newest first, so nested work stays on the same core,
+ * while idle workers steal the oldest tasks from the front of the others.
+ * Tasks posted from outside the pool go to a shared injection queue.
+ *
+ * A thread waiting on a parallelFor only waits for the iterations already
+ * running on other workers, never for queued tasks, so nesting parallel
+ * sections never needs more threads than the pool has, and a waiter never
+ * runs unrelated (possibly blocking) work in the middle of its own.
+ *
+ * Interactive tasks are run before queued enrollment tasks, and workers
+ * helping with an enrollment parallelFor hand their thread back between
+ * iterations while interactive tasks are waiting. Enrollment keeps a minimum
+ * share of the task dispatches while both classes have work, so it never
+ * starves.
+ */
+class Executor {
+ public:
+  // Starts the given number of workers (the number of cores if zero).
+  explicit Executor(unsigned threadCount = 0);
+
+  // Runs the pending tasks and stops every worker.
+  ~Executor();
+
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  /**
+   * Queues a task to be run by one of the workers, with the priority class of
+   * the calling thread. The task must not throw.
+   */
+  void post(std::function<void()> task);
+
+  /**
+   * Queues a function to be run by one of the workers, returning a future
+   * with its result (or the exception it threw).
+   */
+  template <typename Function>
+  auto submit(Function function) -> std::future<decltype(function())> {
+    typedef decltype(function()) ResultType;
+    // std::function needs a copyable target, so the task is shared
+    auto task =
+        std::make_shared<std::packaged_task<ResultType()>>(std::move(function));
+    auto future = task->get_future();
+    post([task]() { (*task)(); });
+    return future;
+  }
+
+  /**
+   * Calls body(i) for every i in [begin, end), spreading the calls over the
+   * workers and the calling thread. Returns once every call is done,
+   * rethrowing the first exception thrown by the body.
+   */
+  void parallelFor(size_t begin, size_t end,
+                   const std::function<void(size_t)>& body);
+
+  /**
+   * Sets the minimum fraction (in (0, 1]) of the task dispatches given to
+   * enrollment tasks while interactive tasks are also pending. Defaults to
+   * 0.2, i.e. one enrollment task every four interactive ones.
+   */
+  void setMinimumEnrollmentShare(double share);
+
+  unsigned getThreadCount() const;
+
+ private:
+  static constexpr size_t priorityCount = 2;
+
+  struct ParallelForState;
+
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks[priorityCount];
+  };
+
+  // Takes a task for the given worker (or for an outside thread if the index
+  // is the number of workers), picking the priority class first: interactive
+  // tasks, unless it is the turn of the enrollment ones.
+  bool popTask(size_t workerIdx, std::function<void()>& task,
+               TaskPriorityEnum& priority);
+
+  // Takes a task of the given class: the worker's own newest task, then the
+  // oldest shared task, then the oldest task of another worker.
+  bool popTaskOfPriority(size_t workerIdx, TaskPriorityEnum priority,
+                         std::function<void()>& task);
+
+  // Whether enrollment is due its minimum share of the dispatches.
+  bool isEnrollmentTurn() const;
+
+  // Updates the share bookkeeping after a task of the given class was taken.
+  void countDispatch(TaskPriorityEnum priority);
+
+  // Whether enrollment work running on a worker should hand its thread to
+  // the pending interactive tasks.
+  bool shouldYieldToInteractive() const;
+
+  // Runs iterations of the given parallelFor until none is left. Returns
+  // false if it stopped early to yield to interactive tasks.
+  bool claimIterations(ParallelForState& state, bool canYield);
+
+  // Helper task of a parallelFor, which queues itself again when it yields
+  // so the worker picks the interactive tasks first.
+  void runParallelForHelper(const std::shared_ptr<ParallelForState>& state);
+
+  // Worker loop, running tasks until the executor is destroyed.
+  void run(size_t workerIdx);
+
+  size_t workerCount;  // also the index of the injection queue
+
+  // one queue per worker, plus the injection queue at the end
+  std::vector<std::unique_ptr<TaskQueue>> queues;
+  std::atomic<size_t> pendingTasks{0};
+  std::atomic<size_t> pendingTasksByPriority[priorityCount];
+
+  // interactive tasks dispatched in a row while enrollment work was waiting,
+  // and how many of them are allowed before an enrollment task is due
+  std::atomic<unsigned> interactiveStreak{0};
+  std::atomic<unsigned> maxInteractiveStreak{4};
+
+  std::mutex sleepMutex;
+  std::condition_variable taskAvailable;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
+
+/**
+ * Runs the tasks posted to it one at a time and in posting order, on an
+ * executor, without blocking any of its workers: at most one task of the
+ * strand is queued on the executor at a time, and the next one is queued
+ * when it finishes. Each task keeps the priority class of the thread that
+ * posted it.
+ */
+class Strand {
+ public:
+  // Runs the tasks on the given executor, or on the shared one if null.
+  explicit Strand(std::shared_ptr<Executor> executor = nullptr);
+
+  Strand(const Strand&) = delete;
+  Strand& operator=(const Strand&) = delete;
+
+  /**
+   * Queues a task to be run after the ones already posted to the strand. The
+   * task must not throw.
+   */
+  void post(std::function<void()> task);
+
+  /**
+   * Queues a function to be run after the ones already posted to the strand,
+   * returning a future with its result (or the exception it threw).
+   */
+  template <typename Function>
+  auto submit(Function function) -> std::future<decltype(function())> {
+    typedef decltype(function()) ResultType;
+    auto task =
+        std::make_shared<std::packaged_task<ResultType()>>(std::move(function));
+    auto future = task->get_future();
+    post([task]() { (*task)(); });
+    return future;
+  }
+
+ private:
+  struct State;
+
+  // shared with the queued task, so it never points to a destroyed strand
+  std::shared_ptr<State> state;
+};
+
+/**
+ * Returns the executor shared by the library, creating it on first use.
+ */
+std::shared_ptr<Executor> getDefaultExecutor();
+
+/**
+ * Sets the number of workers of the shared executor (the number of cores if
+ * zero). Must be called before the executor is first used.
+ */
+void setDefaultExecutorThreadCount(unsigned threadCount);
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_EXECUTOR_H_
@@ -5,12 +5,14 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <future>
 #include <iostream>
 #include <memory>
 #include <opencv2/core.hpp>
 #include <stdexcept>
 #include <vector>
 
+#include "executor.h"
 #include "serialize.h"
 
 namespace trustid {
@@ -33,6 +35,45 @@ void deserialize(FaceDetectionResultValueEnum& item, std::istream& in);
  */
 enum BoundingBoxHeuristicEnum { LARGEST_AREA };
 
+/**
+ * How images are stored when serializing detection results and entries.
+ */
+enum ImageEncodingEnum { RAW_IMAGE, JPEG_IMAGE, PNG_IMAGE, WEBP_IMAGE };
+
+/**
+ * Context kept around a face when only its region of an image is kept, as a
+ * fraction of the face box size on each side. The chip extractor pads the
+ * landmarks by 25%, so this leaves it enough room.
+ */
+const double defaultFaceRegionMargin = 0.5;
+
+/**
+ * Serialization settings of the images of detection results and entries.
+ * Encoded images are decoded on first access after deserialization. Images
+ * the codec can't represent (e.g. float images, or 16-bit ones as JPEG) are
+ * stored raw.
+ */
+struct ImageSerializationOptions {
+  ImageEncodingEnum encoding = RAW_IMAGE;
+
+  // JPEG and WebP quality (1-100, WebP is lossless above 100), PNG
+  // compression level (0-9)
+  int quality = 90;
+
+  // only store the region around the faces, with the bounding boxes made
+  // relative to it (results without faces are then stored without image)
+  bool faceRegionOnly = false;
+
+  // context kept around each face, as a fraction of its box size per side
+  double faceRegionMargin = defaultFaceRegionMargin;
+};
+
+/**
+ * Encoded image of a deserialized result or entry, decoded once when first
+ * accessed.
+ */
+struct EncodedImage;
+
 /**
  * Stores information regarding a single detection for a face detection
  * operation.
@@ -84,14 +125,32 @@ class FaceDetectionResultEntry {
    */
   FaceDetectionResultEntry copy() const;
 
+  /**
+   * Writes the entry to the given stream, see serialize().
+   */
+  void serialize_to(std::ostream& out,
+                    const ImageSerializationOptions& options) const;
+
+  /**
+   * Reads the entry from the given stream, see deserialize().
+   */
+  void deserialize_from(std::istream& in);
+
  private:
   cv::Mat image;
+  std::shared_ptr<EncodedImage> encodedImage;  // set instead of image
   FaceDetectionConfidenceBoundingBox
       detectionBoundingbox;  // bounding box of the detected face
-  DLIB_DEFINE_DEFAULT_SERIALIZATION(FaceDetectionResultEntry, image,
-                                    detectionBoundingbox);
 };
 
+/**
+ * Serializes the given entry, storing its image as set by the options.
+ */
+void serialize(
+    const FaceDetectionResultEntry& item, std::ostream& out,
+    const ImageSerializationOptions& options = ImageSerializationOptions());
+void deserialize(FaceDetectionResultEntry& item, std::istream& in);
+
 /**
  * Stores information regarding a face detection operation.
  */
@@ -150,22 +209,71 @@ class FaceDetectionResult {
 
   FaceDetectionResult copy() const;
 
+  /**
+   * Writes the result to the given stream, see serialize().
+   */
+  void serialize_to(std::ostream& out,
+                    const ImageSerializationOptions& options) const;
+
+  /**
+   * Reads the result from the given stream, see deserialize().
+   */
+  void deserialize_from(std::istream& in);
+
  private:
   FaceDetectionResultValueEnum resultValue;
   cv::Mat image;
+  std::shared_ptr<EncodedImage> encodedImage;  // set instead of image
   std::vector<FaceDetectionConfidenceBoundingBox> boundingBoxes;
-  
-  DLIB_DEFINE_DEFAULT_SERIALIZATION(FaceDetectionResult, resultValue, image,
-                                    boundingBoxes);
 };
 
 /**
- * Class to implement a processing pipeline for images.
+ * Serializes the given result, storing its image as set by the options. Raw
+ * images keep the format of previous versions, which can still be read.
+ */
+void serialize(
+    const FaceDetectionResult& item, std::ostream& out,
+    const ImageSerializationOptions& options = ImageSerializationOptions());
+void deserialize(FaceDetectionResult& item, std::istream& in);
+
+/**
+ * Image produced by an IFaceDetectImageProcessor, with the affine transform
+ * mapping points of the processor input to points of this image.
+ */
+struct TransformedImage {
+  TransformedImage() : transform(cv::Matx23d::eye()) {}
+  TransformedImage(cv::Mat image,
+                   cv::Matx23d transform = cv::Matx23d::eye())
+      : image(image), transform(transform) {}
+
+  cv::Mat image;
+  cv::Matx23d transform;
+};
+
+/**
+ * Class to implement a processing pipeline for images. Processors must not
+ * modify their input, and those that move pixels around (e.g. resizing)
+ * return the transform they applied, so the detections can be mapped back to
+ * the original image.
  */
 class IFaceDetectImageProcessor {
  public:
   IFaceDetectImageProcessor();
-  virtual cv::Mat operator()(const cv::Mat image) = 0;
+  virtual TransformedImage operator()(const cv::Mat image) = 0;
+};
+
+/**
+ * Downscales images so that their longest side is at most the given size,
+ * leaving smaller images untouched. Detecting on the downscaled image and
+ * cropping from the original one is much faster on large frames.
+ */
+class DownscaleImageProcessor : public IFaceDetectImageProcessor {
+ public:
+  DownscaleImageProcessor(int maxImageSize);
+  virtual TransformedImage operator()(const cv::Mat image) override;
+
+ private:
+  int maxImageSize;
 };
 
 /**
@@ -178,10 +286,42 @@ class IFaceDetector {
   virtual ~IFaceDetector();
 
   /**
-   * Detects faces in an image.
+   * Detects faces in an image. Detection runs on the preprocessed image, but
+   * the result holds the original image and the boxes in its coordinates.
    */
   FaceDetectionResult detectFaces(const cv::Mat image);
 
+  /**
+   * Detects faces in an encoded (e.g. JPEG or PNG) image, decoding it at
+   * 1/reductionFactor scale (1, 2, 4 or 8) for detection. When faces are
+   * found, the image is decoded again only if the smallest face is narrower
+   * than minFaceSize pixels at that scale, at the smallest scale where it is
+   * not (or full resolution). The result keeps just the region around the
+   * faces of that image (with the boxes relative to it), which is all that
+   * landmarking and chip extraction need. Without faces, the result holds the
+   * reduced image.
+   *
+   * The default minFaceSize fits the 150 pixel face chips, which pad the
+   * face by 25% per side.
+   */
+  FaceDetectionResult detectFacesEncoded(
+      const std::vector<unsigned char>& encodedImage, int reductionFactor = 4,
+      int minFaceSize = 100);
+
+  /**
+   * Detects faces in an image on the library executor. Asynchronous calls on
+   * the same detector run one at a time, and the detector must outlive the
+   * returned future.
+   */
+  std::future<FaceDetectionResult> detectFacesAsync(const cv::Mat image);
+
+  /**
+   * Detects faces in every given image. Detectors that support it spread the
+   * images over the library executor.
+   */
+  std::vector<FaceDetectionResult> detectFacesBatch(
+      const std::vector<cv::Mat>& images);
+
   void addPreprocessor(std::unique_ptr<IFaceDetectImageProcessor> preprocessor);
 
  protected:
@@ -192,7 +332,24 @@ class IFaceDetector {
    * detection algorithm.
    */
   virtual FaceDetectionResult _detectFaces(const cv::Mat image) = 0;
+
+  /**
+   * Internal procedure for detecting faces in a batch of (already
+   * preprocessed) images. By default, it detects them one at a time.
+   */
+  virtual std::vector<FaceDetectionResult> _detectFacesBatch(
+      const std::vector<cv::Mat>& images);
+
   std::vector<std::unique_ptr<IFaceDetectImageProcessor>> imagePreprocessors;
+
+ private:
+  /**
+   * Runs every preprocessor over the given image, returning the processed
+   * image and the composed transform from the original one.
+   */
+  TransformedImage applyPreprocessors(const cv::Mat image);
+
+  Strand asyncStrand;  // runs the asynchronous calls one at a time
 };
 }  // namespace image
 }  // namespace trustid
@@ -1,28 +1,77 @@
 #ifndef TRUSTID_FACE_NORMALIZATION_H_
 #define TRUSTID_FACE_NORMALIZATION_H_
 
+#include <dlib/image_processing.h>
 #include <math.h>
 
+#include <algorithm>
+#include <memory>
 #include <opencv2/opencv.hpp>
 
+#include "face_detector.h"
+
 namespace trustid {
 namespace image {
+/**
+ * Head pose of a face, as the rotation and translation of a 3D face model in
+ * camera coordinates (x to the right, y down, z away from the camera). The
+ * rotation of a face looking straight at the camera is zero.
+ */
 class HeadPoseEstimationResult {
  public:
+  HeadPoseEstimationResult()
+      : rotationVector(0, 0, 0),
+        translationVector(0, 0, 0),
+        yaw(0),
+        pitch(0),
+        roll(0) {}
+
   HeadPoseEstimationResult(cv::Vec3d rotationVector,
                            cv::Vec3d translationVector)
       : rotationVector(rotationVector), translationVector(translationVector) {
-    cv::Mat rotationMatrix;
+    cv::Matx33d rotationMatrix;
     cv::Rodrigues(rotationVector, rotationMatrix);
+
+    // angles of the rotation Rz(roll) * Ry(yaw) * Rx(pitch)
+    const double radiansToDegrees = 180.0 / CV_PI;
+    yaw = asin(-std::max(-1.0, std::min(1.0, rotationMatrix(2, 0)))) *
+          radiansToDegrees;
+    pitch = atan2(rotationMatrix(2, 1), rotationMatrix(2, 2)) * radiansToDegrees;
+    roll = atan2(rotationMatrix(1, 0), rotationMatrix(0, 0)) * radiansToDegrees;
   }
 
-  cv::Vec3d getRotationVector() { return rotationVector; }
+  cv::Vec3d getRotationVector() const { return rotationVector; }
+
+  cv::Vec3d getTranslationVector() const { return translationVector; }
 
-  cv::Vec3d getTranslationVector() { return translationVector; }
+  /**
+   * Left/right turn of the head, in degrees.
+   */
+  double getYaw() const { return yaw; }
+
+  /**
+   * Up/down tilt of the head, in degrees.
+   */
+  double getPitch() const { return pitch; }
+
+  /**
+   * In-plane rotation of the head, in degrees.
+   */
+  double getRoll() const { return roll; }
+
+  /**
+   * Checks whether the absolute yaw and pitch are within the given limits.
+   */
+  bool isWithin(const double maxYaw, const double maxPitch) const {
+    return fabs(yaw) <= maxYaw && fabs(pitch) <= maxPitch;
+  }
 
  private:
   cv::Vec3d rotationVector;
   cv::Vec3d translationVector;
+  double yaw;
+  double pitch;
+  double roll;
 };
 
 class IFaceNormalizer {
@@ -38,12 +87,25 @@ class IFaceNormalizer {
 namespace impl {
 class FaceNormalizer {
  public:
-  FaceNormalizer();
+  FaceNormalizer(std::shared_ptr<dlib::shape_predictor> sp = nullptr);
 
+  /**
+   * Estimates the head pose of the given face from its 68 landmarks. Throws
+   * if the normalizer has no shape predictor.
+   */
   HeadPoseEstimationResult estimateHeadPose(
-      const FaceDetectionResultEntry detectionResultEntry) {
-    throw std::runtime_error("Not implemented");
-  }
+      const FaceDetectionResultEntry detectionResultEntry) const;
+
+  /**
+   * Estimates the head pose from the given 68 landmarks, already predicted
+   * on an image of the given size (e.g. by the chip extractor). Fits the
+   * rigid landmarks (brows, eyes, nose, mouth corners and chin) of sparse_3d
+   * with solvePnP, starting from a frontal pose, and doesn't allocate beyond
+   * what solvePnP itself does.
+   */
+  HeadPoseEstimationResult estimateHeadPose(
+      const dlib::full_object_detection& shape,
+      const cv::Size imageSize) const;
 
   static int constexpr triangles[] = {
       2,  1,  41, 29, 40, 39, 27, 39, 21, 36, 1,  0,  1,  36, 41, 17, 36, 0,
@@ -118,6 +180,9 @@ class FaceNormalizer {
       2.3563139e+01,  -2.7790844e+01, 4.2452679e+01,  8.3718014e+00,
       -2.6039980e+01, 5.3205944e+01,  -2.6260696e-02, -2.6413929e+01,
       5.4533428e+01,  -9.4196987e+00, -2.5974625e+01, 5.2579041e+01};
+
+ private:
+  std::shared_ptr<dlib::shape_predictor> sp;
 };
 }  // namespace impl
 }  // namespace image
@@ -1,6 +1,7 @@
 #ifndef TRUSTID_FACE_VERIFICATOR_H_
 #define TRUSTID_FACE_VERIFICATOR_H_
 
+#include <future>
 #include <opencv2/opencv.hpp>
 #include <utility>
 #include <vector>
@@ -17,6 +18,12 @@ enum FaceVerificationResultEnum {
   DIFFERENT_USER = 1,
   UNKNOWN = 2
 };
+/**
+ * Embedding of a face image, as computed by a face verificator. Embeddings
+ * can be cached or computed on a different machine and matched later.
+ */
+typedef std::vector<float> FaceEmbedding;
+
 /**
  * Stores information regarding a face verification operation.
  */
@@ -57,6 +64,18 @@ class IFaceVerifyImageProcessor {
   IFaceVerifyImageProcessor();
   virtual FaceDetectionResultEntry operator()(
       const FaceDetectionResultEntry detectionResultEntry) = 0;
+
+  /**
+   * Returns true if the processor is a purely geometric operation, setting
+   * the affine transform it applies to an image of the given size with the
+   * given face box, and the size of its output image. Consecutive geometric
+   * processors are fused into a single warp by IFaceVerificator. By default,
+   * processors are not geometric.
+   */
+  virtual bool getGeometricTransform(const cv::Size imageSize,
+                                     const cv::Rect boundingBox,
+                                     cv::Matx23d& transform,
+                                     cv::Size& outputSize) const;
 };
 
 /**
@@ -67,6 +86,10 @@ class ResizeImageProcessor : public IFaceVerifyImageProcessor {
   ResizeImageProcessor(int width, int height);
   virtual FaceDetectionResultEntry operator()(
       const FaceDetectionResultEntry detectionResultEntry);
+  virtual bool getGeometricTransform(const cv::Size imageSize,
+                                     const cv::Rect boundingBox,
+                                     cv::Matx23d& transform,
+                                     cv::Size& outputSize) const override;
 
  private:
   int width;
@@ -81,13 +104,17 @@ class CropImageProcessor : public IFaceVerifyImageProcessor {
   CropImageProcessor(cv::Rect cropInfo);
   virtual FaceDetectionResultEntry operator()(
       const FaceDetectionResultEntry detectionResultEntry) override;
+  virtual bool getGeometricTransform(const cv::Size imageSize,
+                                     const cv::Rect boundingBox,
+                                     cv::Matx23d& transform,
+                                     cv::Size& outputSize) const override;
 
  private:
   cv::Rect cropInfo;
 };
 
 /**
- * Detects faces in an image.
+ * Verifies if faces belong to a given user.
  */
 class IFaceVerificator {
  public:
@@ -100,12 +127,38 @@ class IFaceVerificator {
   void removePreprocessors();
 
   /**
-   * Detects faces in an image.
+   * Verifies if the face in the given detection belongs to the user.
    */
   FaceVerificationResult verifyUser(
       const FaceDetectionResultEntry detectionResultEntry);
 
+  /**
+   * Verifies if the face in the given detection belongs to the user, on the
+   * library executor. Asynchronous calls on the same verificator run one at a
+   * time, and the verificator must outlive the returned future.
+   */
+  std::future<FaceVerificationResult> verifyUserAsync(
+      const FaceDetectionResultEntry detectionResultEntry);
+
+  /**
+   * Computes the embedding of the face in the given detection (the expensive
+   * stage of verifyUser), running every preprocessor first.
+   */
+  FaceEmbedding extractEmbedding(
+      const FaceDetectionResultEntry detectionResultEntry);
+
+  /**
+   * Matches a precomputed embedding against the user model (the cheap stage
+   * of verifyUser). The detection result of the returned value is empty.
+   */
+  FaceVerificationResult verifyEmbedding(const FaceEmbedding& embedding);
+
  protected:
+  /**
+   * Runs every preprocessor over the given detection. Runs of consecutive
+   * geometric processors are composed into one transform, applied once to
+   * the face region only instead of materializing every intermediate frame.
+   */
   FaceDetectionResultEntry applyProcessors(
       const FaceDetectionResultEntry detectionResultEntry);
 
@@ -114,11 +167,27 @@ class IFaceVerificator {
    * Internal procedure for verifying a user.
    * This is split up from the public verifyUser procedure to allow the
    * implementation of pre and/or post-processing steps common to every face
-   * verification algorithm.
+   * verification algorithm. By default, it extracts the embedding of the
+   * (already preprocessed) detection and matches it.
    */
   virtual FaceVerificationResult _verifyUser(
+      const FaceDetectionResultEntry detectionResultEntry);
+
+  /**
+   * Internal procedure for computing the embedding of an already preprocessed
+   * detection.
+   */
+  virtual FaceEmbedding _extractEmbedding(
       const FaceDetectionResultEntry detectionResultEntry) = 0;
+
+  /**
+   * Internal procedure for matching an embedding against the user model.
+   */
+  virtual FaceVerificationResult _verifyEmbedding(
+      const FaceEmbedding& embedding) = 0;
+
   std::vector<std::unique_ptr<IFaceVerifyImageProcessor>> preprocessors;
+  Strand asyncStrand;  // runs the asynchronous calls one at a time
 };
 }  // namespace image
 }  // namespace trustid
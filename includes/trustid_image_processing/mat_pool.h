@@ -0,0 +1,63 @@
+#ifndef TRUSTID_MAT_POOL_H_
+#define TRUSTID_MAT_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+namespace trustid {
+namespace image {
+/**
+ * Counters of the pooled allocator used for the library image buffers.
+ */
+struct MatPoolStats {
+  uint64_t allocations;  // buffers requested from the pool
+  uint64_t hits;         // requests served by a cached buffer
+  double hitRate;        // hits / allocations
+  size_t bytesRetained;  // free bytes cached by the pool and thread caches
+  size_t bytesInUse;     // bytes of the pooled buffers currently in use
+};
+
+/**
+ * Returns the cv::MatAllocator the library uses for its internal image
+ * buffers (frame copies, detection entries, chips and resized frames).
+ *
+ * Buffers are rounded up to size classes (two per power of two) and freed
+ * buffers are cached for reuse, first in a small per-thread cache and then in
+ * a shared pool, so a steady stream of frames stops hitting the system
+ * allocator. Buffers larger than the biggest class bypass the pool. The
+ * allocator is never destroyed, so matrices using it may outlive any object.
+ */
+cv::MatAllocator* getPooledMatAllocator();
+
+/**
+ * Returns an empty matrix whose buffers come from the library pool, e.g. to
+ * be passed as the output of an OpenCV function.
+ */
+cv::Mat pooledMat();
+
+/**
+ * Returns a deep copy of the given matrix, stored in a pooled buffer.
+ */
+cv::Mat pooledClone(const cv::Mat& mat);
+
+/**
+ * Returns the counters of the library pool.
+ */
+MatPoolStats getMatPoolStats();
+
+/**
+ * Frees cached buffers until the shared pool retains at most the given
+ * number of bytes. The caches of the calling thread are emptied right away,
+ * those of other threads on their next pooled allocation or release.
+ */
+void trimMatPool(size_t maxRetainedBytes = 0);
+
+/**
+ * Sets the maximum number of free bytes kept by the shared pool (256 MB by
+ * default). Buffers released beyond it go back to the system.
+ */
+void setMatPoolCapacity(size_t maxRetainedBytes);
+}  // namespace image
+}  // namespace trustid
+#endif  // TRUSTID_MAT_POOL_H_
@@ -12,10 +12,35 @@ void serialize(const Rect& item, std::ostream& out);
 void deserialize(Rect& item, std::istream& in);
 void serialize(const Mat& item, std::ostream& out);
 void deserialize(Mat& item, std::istream& in);
+
+// Matrices are written as type, rows, cols and row size, followed by the
+// length of the pixel data and the rows themselves. Rows are streamed straight
+// from the matrix (also for ROIs and other non-continuous matrices) and read
+// straight into the buffer of the deserialized matrix. Only 2D matrices are
+// supported.
+
 template <typename _Tp, int m, int n>
-void serialize(const Matx<_Tp, m, n>& item, std::ostream& out);
+void serialize(const Matx<_Tp, m, n>& item, std::ostream& out) {
+  // same layout as a std::vector<_Tp> holding the values
+  const unsigned long size = m * n;
+  dlib::serialize(size, out);
+  for (int i = 0; i < m * n; i++) {
+    dlib::serialize(item.val[i], out);
+  }
+}
+
 template <typename _Tp, int m, int n>
-void deserialize(Matx<_Tp, m, n>& item, std::istream& in);
+void deserialize(Matx<_Tp, m, n>& item, std::istream& in) {
+  unsigned long size;
+  dlib::deserialize(size, in);
+  if (size != m * n) {
+    throw dlib::serialization_error(
+        "Unexpected number of values while deserializing a cv::Matx");
+  }
+  for (int i = 0; i < m * n; i++) {
+    dlib::deserialize(item.val[i], in);
+  }
+}
 }  // namespace cv
 
 // Add gRPC serialization support for cv::Rect and cv::Mat
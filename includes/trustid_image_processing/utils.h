@@ -9,23 +9,104 @@
 namespace trustid {
 namespace image {
 namespace utils {
-enum ImageQualityResultEnum { LOW_CONTRAST, HIGH_CONTRAST, UNKNOWN };
+/**
+ * Result of a quality check, naming the first check an image failed.
+ * HIGH_CONTRAST is not returned by checkImageQuality (excessive contrast
+ * shows up as an exposure failure), and UNKNOWN is returned for empty images.
+ */
+enum ImageQualityResultEnum {
+  LOW_CONTRAST,
+  HIGH_CONTRAST,
+  UNKNOWN,
+  GOOD_QUALITY,
+  BLURRY,
+  UNDEREXPOSED,
+  OVEREXPOSED,
+  FACE_TOO_SMALL
+};
+
+/**
+ * Limits of the quality checks. Blur and contrast are measured on the face
+ * downscaled to at most 128 pixels, so they don't depend on the face size.
+ */
+struct ImageQualityThresholds {
+  // minimum standard deviation of the gray levels
+  double minContrast = 20;
+
+  // minimum variance of the Laplacian of the gray levels
+  double minSharpness = 50;
+
+  // range of the mean gray level
+  double minBrightness = 50;
+  double maxBrightness = 205;
+
+  // maximum fraction of pixels clipped to black (<= 5) or white (>= 250)
+  double maxClippedFraction = 0.2;
+
+  // minimum side of the face bounding box, in pixels
+  int minFaceSize = 80;
+};
 
 /**
- * Checks the image contrast of a given image.
+ * Checks the exposure, contrast and sharpness of a given (face) image, in
+ * that order. Cheap enough to gate frames before embedding them.
  */
+ImageQualityResultEnum checkImageQuality(
+    const cv::Mat image,
+    const ImageQualityThresholds& thresholds = ImageQualityThresholds());
 
-ImageQualityResultEnum checkImageQuality(const cv::Mat image);
+/**
+ * Checks the face size of a given detection, then the quality of its cropped
+ * face.
+ */
+ImageQualityResultEnum checkImageQuality(
+    const trustid::image::FaceDetectionResultEntry detectionResultEntry,
+    const ImageQualityThresholds& thresholds = ImageQualityThresholds());
 
 /**
- * Checks the image contrast of a given image.
+ * Checks the quality of the largest face of a given detection result,
+ * without copying the image.
  */
 ImageQualityResultEnum checkImageQuality(
-    const trustid::image::FaceDetectionResultEntry detectionResultEntry);
+    const trustid::image::FaceDetectionResult& detectionResult,
+    const ImageQualityThresholds& thresholds = ImageQualityThresholds());
 
 cv::Rect dlibRectangleToOpenCV(const dlib::rectangle r);
 
 dlib::rectangle openCVRectToDlib(const cv::Rect r);
+
+/**
+ * Returns the affine transform applying first and then second.
+ */
+cv::Matx23d composeTransforms(const cv::Matx23d& first,
+                              const cv::Matx23d& second);
+
+/**
+ * Returns the inverse of the given (invertible) affine transform.
+ */
+cv::Matx23d invertTransform(const cv::Matx23d& transform);
+
+/**
+ * Maps the given box through an affine transform, returning the bounding box
+ * of its transformed corners.
+ */
+cv::Rect transformRect(const cv::Rect& rect, const cv::Matx23d& transform);
+
+/**
+ * Returns the region of an image of the given size holding the given face
+ * box, plus the given margin (as a fraction of the box size) on each side.
+ * The region is empty if the box is outside the image.
+ */
+cv::Rect getFaceRegion(const cv::Rect& boundingBox, const cv::Size imageSize,
+                       const double margin = defaultFaceRegionMargin);
+
+/**
+ * Returns the smallest region of an image of the given size holding the
+ * regions of all the given faces.
+ */
+cv::Rect getFaceRegion(
+    const std::vector<FaceDetectionConfidenceBoundingBox>& boundingBoxes,
+    const cv::Size imageSize, const double margin = defaultFaceRegionMargin);
 }  // namespace utils
 }  // namespace image
 }  // namespace trustid
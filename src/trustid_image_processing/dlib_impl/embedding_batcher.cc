@@ -0,0 +1,102 @@
+#include "trustid_image_processing/dlib_impl/embedding_batcher.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+// time given to the executor to start a batch before the collecting thread
+// runs it itself
+constexpr auto executorPickupTimeout = std::chrono::milliseconds(2);
+}  // namespace
+
+trustid::image::impl::EmbeddingBatcher::EmbeddingBatcher(
+    const std::shared_ptr<ResNet34> net, const EmbeddingBatcherConfig config)
+    : config(config),
+      net(*net),
+      queue(std::max<size_t>(config.queueCapacity, 1)) {
+  this->config.maxBatchSize = std::max<size_t>(config.maxBatchSize, 1);
+  collector = std::thread(&EmbeddingBatcher::run, this);
+}
+
+trustid::image::impl::EmbeddingBatcher::~EmbeddingBatcher() {
+  queue.close();
+  collector.join();
+}
+
+std::future<trustid::image::FaceEmbedding>
+trustid::image::impl::EmbeddingBatcher::submit(
+    dlib::matrix<dlib::rgb_pixel> chip) {
+  auto request = std::make_unique<Request>();
+  request->chip = std::move(chip);
+  request->submitTime = std::chrono::steady_clock::now();
+  auto future = request->promise.get_future();
+  if (!queue.push(std::move(request))) {
+    throw std::runtime_error("The embedding batcher is shutting down");
+  }
+  return future;
+}
+
+uint64_t trustid::image::impl::EmbeddingBatcher::getBatchCount() const {
+  return batchCount;
+}
+
+uint64_t trustid::image::impl::EmbeddingBatcher::getEmbeddingCount() const {
+  return embeddingCount;
+}
+
+void trustid::image::impl::EmbeddingBatcher::run() {
+  std::unique_ptr<Request> request;
+  while (queue.pop(request)) {
+    // the latency budget starts when the oldest chip was submitted
+    auto deadline = request->submitTime + config.maxWait;
+    // std::function needs a copyable target, so the batch is shared
+    auto batch = std::make_shared<Batch>();
+    batch->requests.push_back(std::move(request));
+    while (batch->requests.size() < config.maxBatchSize &&
+           queue.popUntil(request, deadline)) {
+      batch->requests.push_back(std::move(request));
+    }
+
+    // a single forward pass at a time on the network copy, the next chips
+    // keep queuing meanwhile
+    auto done = batch->done.get_future();
+    // the claim is checked before touching the batcher, which may be gone
+    // once the collecting thread ran the batch
+    getDefaultExecutor()->post([this, batch]() {
+      if (!batch->claimed.exchange(true)) {
+        runBatch(*batch);
+      }
+    });
+    // workers all waiting on embeddings would never pick the batch up
+    if (done.wait_for(executorPickupTimeout) == std::future_status::timeout) {
+      if (!batch->claimed.exchange(true)) {
+        runBatch(*batch);
+      }
+      done.wait();
+    }
+  }
+}
+
+void trustid::image::impl::EmbeddingBatcher::runBatch(Batch& batch) {
+  std::vector<dlib::matrix<dlib::rgb_pixel>> chips;
+  for (auto& batchRequest : batch.requests) {
+    chips.push_back(std::move(batchRequest->chip));
+  }
+
+  // counted before completing the futures, so callers see their batch
+  batchCount++;
+  embeddingCount += batch.requests.size();
+  try {
+    auto embeddings = net(chips, chips.size());
+    for (size_t i = 0; i < batch.requests.size(); i++) {
+      batch.requests[i]->promise.set_value(
+          FaceEmbedding(embeddings[i].begin(), embeddings[i].end()));
+    }
+  } catch (...) {
+    for (auto& batchRequest : batch.requests) {
+      batchRequest->promise.set_exception(std::current_exception());
+    }
+  }
+  batch.done.set_value();
+}
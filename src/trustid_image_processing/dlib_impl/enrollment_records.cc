@@ -0,0 +1,585 @@
+#include "trustid_image_processing/dlib_impl/enrollment_records.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <opencv2/imgcodecs.hpp>
+#include <stdexcept>
+
+#include "trustid_image_processing/executor.h"
+#include "trustid_image_processing/mat_pool.h"
+
+namespace {
+constexpr char kFileMagic[8] = {'T', 'I', 'D', 'E', 'N', 'R', 'E', 'C'};
+constexpr char kFooterMagic[8] = {'T', 'I', 'D', 'R', 'E', 'C', 'I', 'X'};
+constexpr uint32_t kFileVersion = 1;
+constexpr uint32_t kByteOrderMark = 0x01020304;
+constexpr uint32_t kRecordMarker = 0x52454344;  // "RECD"
+constexpr uint64_t kRecordAlignment = 8;
+
+// buffer of the writer stream, so records are written in large blocks
+constexpr size_t kWriteBufferSize = 4 * 1024 * 1024;
+
+constexpr uint32_t kDetectionFlag = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrderMark;
+};
+
+// followed by the user id, the encoded image and the landmarks (x and y
+// floats), and padded to kRecordAlignment
+struct RecordHeader {
+  uint32_t marker;
+  uint32_t userIdSize;
+  uint32_t flags;
+  uint32_t landmarkCount;
+  uint64_t imageSize;
+  int32_t box[4];  // x, y, width and height
+  double confidenceScore;
+};
+
+struct IndexEntry {
+  uint64_t offset;
+  uint64_t userHash;
+};
+
+// last bytes of a closed file
+struct Footer {
+  uint64_t indexOffset;
+  uint64_t recordCount;
+  char magic[8];
+};
+
+uint64_t alignTo(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// FNV-1a hash of the user id
+uint64_t hashUserId(std::string_view userId) {
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : userId) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+uint64_t getRecordSize(const RecordHeader& header) {
+  return alignTo(sizeof(RecordHeader) + header.userIdSize + header.imageSize +
+                     uint64_t(header.landmarkCount) * 2 * sizeof(float),
+                 kRecordAlignment);
+}
+
+// Parsed record, pointing into the bytes it was parsed from.
+struct RecordView {
+  RecordHeader header;
+  std::string_view userId;
+  const unsigned char* image;
+  const char* landmarks;
+};
+
+// Parses the record held by the given bytes, checking that it fits in them.
+RecordView parseRecord(const char* data, uint64_t size) {
+  RecordView view;
+  if (size < sizeof(RecordHeader)) {
+    throw std::runtime_error("Invalid enrollment record");
+  }
+  std::memcpy(&view.header, data, sizeof(RecordHeader));
+  if (view.header.marker != kRecordMarker ||
+      view.header.userIdSize >
+          trustid::image::impl::EnrollmentRecordWriter::kMaxUserIdLength ||
+      getRecordSize(view.header) > size) {
+    throw std::runtime_error("Invalid enrollment record");
+  }
+  const char* userId = data + sizeof(RecordHeader);
+  view.userId = std::string_view(userId, view.header.userIdSize);
+  view.image =
+      reinterpret_cast<const unsigned char*>(userId + view.header.userIdSize);
+  view.landmarks =
+      reinterpret_cast<const char*>(view.image) + view.header.imageSize;
+  return view;
+}
+
+std::vector<cv::Point2f> getLandmarks(const RecordView& view) {
+  std::vector<cv::Point2f> landmarks(view.header.landmarkCount);
+  for (size_t i = 0; i < landmarks.size(); i++) {
+    float point[2];
+    std::memcpy(point, view.landmarks + i * sizeof(point), sizeof(point));
+    landmarks[i] = cv::Point2f(point[0], point[1]);
+  }
+  return landmarks;
+}
+
+// Read of a chunk queued on the library executor. The thread needing the
+// chunk reads it itself if no worker started it yet, so it never waits for a
+// free worker.
+class ChunkPrefetch {
+ public:
+  explicit ChunkPrefetch(std::function<std::vector<char>()> readChunk)
+      : state(std::make_shared<State>()) {
+    state->readChunk = std::move(readChunk);
+    future = state->promise.get_future();
+    auto sharedState = state;
+    trustid::image::getDefaultExecutor()->post(
+        [sharedState]() { sharedState->run(); });
+  }
+
+  // Waits for a read started by a worker, since it uses the caller's stream.
+  ~ChunkPrefetch() {
+    if (state->claimed.exchange(true) && future.valid()) {
+      future.wait();
+    }
+  }
+
+  ChunkPrefetch(const ChunkPrefetch&) = delete;
+  ChunkPrefetch& operator=(const ChunkPrefetch&) = delete;
+
+  std::vector<char> get() {
+    state->run();
+    return future.get();
+  }
+
+ private:
+  // shared with the queued task, which may run after the prefetch is gone
+  struct State {
+    std::atomic<bool> claimed{false};
+    std::function<std::vector<char>()> readChunk;
+    std::promise<std::vector<char>> promise;
+
+    void run() {
+      if (claimed.exchange(true)) {
+        return;
+      }
+      try {
+        promise.set_value(readChunk());
+      } catch (...) {
+        promise.set_exception(std::current_exception());
+      }
+    }
+  };
+
+  std::shared_ptr<State> state;
+  std::future<std::vector<char>> future;
+};
+}  // namespace
+
+dlib::full_object_detection
+trustid::image::impl::DecodedEnrollmentRecord::getShape() const {
+  if (landmarks.empty()) {
+    throw std::runtime_error("The record has no precomputed landmarks");
+  }
+  std::vector<dlib::point> parts;
+  for (auto& landmark : landmarks) {
+    parts.emplace_back(std::lround(landmark.x), std::lround(landmark.y));
+  }
+  const cv::Rect box = entry.getBoundingBox();
+  return dlib::full_object_detection(
+      dlib::rectangle(box.x, box.y, box.x + box.width - 1,
+                      box.y + box.height - 1),
+      parts);
+}
+
+trustid::image::impl::EnrollmentRecordWriter::EnrollmentRecordWriter(
+    const std::string& pathToFile)
+    : pathToFile(pathToFile), buffer(kWriteBufferSize), offset(0) {
+  // the buffer has to be set before opening the file to be used
+  out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+  out.open(pathToFile, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("Could not open enrollment record file " +
+                             pathToFile);
+  }
+
+  FileHeader header = {};
+  std::memcpy(header.magic, kFileMagic, sizeof(kFileMagic));
+  header.version = kFileVersion;
+  header.byteOrderMark = kByteOrderMark;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  offset = sizeof(header);
+}
+
+trustid::image::impl::EnrollmentRecordWriter::~EnrollmentRecordWriter() {
+  if (out.is_open()) {
+    try {
+      close();
+    } catch (const std::exception&) {
+      // the file is left without an index, which the reader rebuilds
+    }
+  }
+}
+
+void trustid::image::impl::EnrollmentRecordWriter::append(
+    const EnrollmentRecord& record) {
+  if (!out.is_open()) {
+    throw std::runtime_error("Enrollment record file was already closed");
+  }
+  if (record.userId.empty() || record.userId.size() > kMaxUserIdLength) {
+    throw std::invalid_argument("Invalid user id length");
+  }
+  if (record.encodedImage.empty()) {
+    throw std::invalid_argument("The record has no image");
+  }
+
+  RecordHeader header = {};
+  header.marker = kRecordMarker;
+  header.userIdSize = static_cast<uint32_t>(record.userId.size());
+  header.landmarkCount = static_cast<uint32_t>(record.landmarks.size());
+  header.imageSize = record.encodedImage.size();
+  if (record.hasDetection) {
+    const cv::Rect& box = record.boundingBox.boundingBox;
+    header.flags |= kDetectionFlag;
+    header.box[0] = box.x;
+    header.box[1] = box.y;
+    header.box[2] = box.width;
+    header.box[3] = box.height;
+    header.confidenceScore = record.boundingBox.confidenceScore;
+  }
+
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(record.userId.data(), record.userId.size());
+  out.write(reinterpret_cast<const char*>(record.encodedImage.data()),
+            record.encodedImage.size());
+  for (auto& landmark : record.landmarks) {
+    const float point[2] = {landmark.x, landmark.y};
+    out.write(reinterpret_cast<const char*>(point), sizeof(point));
+  }
+  const uint64_t recordSize = getRecordSize(header);
+  const uint64_t written = sizeof(header) + header.userIdSize +
+                           header.imageSize +
+                           header.landmarkCount * 2 * sizeof(float);
+  const char padding[kRecordAlignment] = {};
+  out.write(padding, recordSize - written);
+  if (!out) {
+    throw std::runtime_error("Could not write enrollment record file " +
+                             pathToFile);
+  }
+
+  offsets.push_back(offset);
+  userHashes.push_back(hashUserId(record.userId));
+  offset += recordSize;
+}
+
+void trustid::image::impl::EnrollmentRecordWriter::append(
+    const std::string& userId, const FaceDetectionResultEntry& entry,
+    int jpegQuality) {
+  EnrollmentRecord record;
+  record.userId = userId;
+  if (!cv::imencode(".jpg", entry.getImage(), record.encodedImage,
+                    {cv::IMWRITE_JPEG_QUALITY, jpegQuality})) {
+    throw std::runtime_error("Could not encode the image");
+  }
+  record.hasDetection = true;
+  record.boundingBox = entry.getFaceDetBoundingBox();
+  append(record);
+}
+
+void trustid::image::impl::EnrollmentRecordWriter::close() {
+  if (!out.is_open()) {
+    return;
+  }
+  const uint64_t indexOffset = offset;
+  for (size_t i = 0; i < offsets.size(); i++) {
+    const IndexEntry entry = {offsets[i], userHashes[i]};
+    out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+  }
+  Footer footer = {};
+  footer.indexOffset = indexOffset;
+  footer.recordCount = offsets.size();
+  std::memcpy(footer.magic, kFooterMagic, sizeof(kFooterMagic));
+  out.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Could not write enrollment record file " +
+                             pathToFile);
+  }
+}
+
+uint64_t trustid::image::impl::EnrollmentRecordWriter::size() const {
+  return offsets.size();
+}
+
+trustid::image::impl::EnrollmentRecordReader::EnrollmentRecordReader(
+    const std::string& pathToFile)
+    : pathToFile(pathToFile), in(pathToFile, std::ios::binary) {
+  if (!in) {
+    throw std::runtime_error("Could not open enrollment record file " +
+                             pathToFile);
+  }
+  open();
+}
+
+void trustid::image::impl::EnrollmentRecordReader::open() {
+  in.seekg(0, std::ios::end);
+  const uint64_t fileSize = static_cast<uint64_t>(in.tellg());
+  in.seekg(0);
+
+  // validate the header before trusting anything else in the file
+  FileHeader header;
+  if (fileSize < sizeof(header) ||
+      !in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, kFileMagic, sizeof(kFileMagic)) != 0 ||
+      header.byteOrderMark != kByteOrderMark) {
+    throw std::runtime_error("Invalid enrollment record file " + pathToFile);
+  }
+  if (header.version != kFileVersion) {
+    throw std::runtime_error("Unsupported enrollment record file version");
+  }
+
+  // closed file: read the index pointed to by the footer
+  Footer footer;
+  if (fileSize >= sizeof(header) + sizeof(footer)) {
+    in.seekg(fileSize - sizeof(footer));
+    in.read(reinterpret_cast<char*>(&footer), sizeof(footer));
+    if (in &&
+        std::memcmp(footer.magic, kFooterMagic, sizeof(kFooterMagic)) == 0 &&
+        footer.indexOffset >= sizeof(header) &&
+        footer.recordCount <= fileSize / sizeof(IndexEntry) &&
+        footer.indexOffset + footer.recordCount * sizeof(IndexEntry) +
+                sizeof(footer) ==
+            fileSize) {
+      std::vector<IndexEntry> index(footer.recordCount);
+      in.seekg(footer.indexOffset);
+      if (!in.read(reinterpret_cast<char*>(index.data()),
+                   index.size() * sizeof(IndexEntry))) {
+        throw std::runtime_error("Could not read enrollment record file " +
+                                 pathToFile);
+      }
+      // offsets must increase, or chunks would be read with bogus sizes
+      uint64_t minOffset = sizeof(header);
+      for (auto& entry : index) {
+        if (entry.offset < minOffset || entry.offset >= footer.indexOffset) {
+          throw std::runtime_error("Invalid enrollment record file " +
+                                   pathToFile);
+        }
+        offsets.push_back(entry.offset);
+        userHashes.push_back(entry.userHash);
+        minOffset = entry.offset + sizeof(RecordHeader);
+      }
+      offsets.push_back(footer.indexOffset);
+      return;
+    }
+  }
+  in.clear();
+
+  // the writer was not closed, so walk the records up to the last complete
+  // one (only the headers and user ids are read)
+  uint64_t offset = sizeof(header);
+  std::vector<char> recordStart(sizeof(RecordHeader) +
+                                EnrollmentRecordWriter::kMaxUserIdLength);
+  while (offset + sizeof(RecordHeader) <= fileSize) {
+    const uint64_t available =
+        std::min<uint64_t>(recordStart.size(), fileSize - offset);
+    in.seekg(offset);
+    if (!in.read(recordStart.data(), available)) {
+      break;
+    }
+    RecordHeader recordHeader;
+    std::memcpy(&recordHeader, recordStart.data(), sizeof(recordHeader));
+    if (recordHeader.marker != kRecordMarker ||
+        recordHeader.userIdSize > available - sizeof(RecordHeader) ||
+        offset + getRecordSize(recordHeader) > fileSize) {
+      break;
+    }
+    offsets.push_back(offset);
+    userHashes.push_back(hashUserId(
+        std::string_view(recordStart.data() + sizeof(RecordHeader),
+                         recordHeader.userIdSize)));
+    offset += getRecordSize(recordHeader);
+  }
+  offsets.push_back(offset);
+  in.clear();
+}
+
+uint64_t trustid::image::impl::EnrollmentRecordReader::size() const {
+  return offsets.size() - 1;
+}
+
+std::vector<char> trustid::image::impl::EnrollmentRecordReader::readChunk(
+    std::ifstream& stream, uint64_t first, uint64_t last) const {
+  std::vector<char> chunk(offsets[last] - offsets[first]);
+  stream.seekg(offsets[first]);
+  if (!stream.read(chunk.data(), chunk.size())) {
+    stream.clear();
+    throw std::runtime_error("Could not read enrollment record file " +
+                             pathToFile);
+  }
+  return chunk;
+}
+
+trustid::image::impl::EnrollmentRecord
+trustid::image::impl::EnrollmentRecordReader::read(uint64_t recordIdx) {
+  if (recordIdx >= size()) {
+    throw std::out_of_range("Enrollment record index out of range");
+  }
+  const std::vector<char> chunk = readChunk(in, recordIdx, recordIdx + 1);
+  const RecordView view = parseRecord(chunk.data(), chunk.size());
+
+  EnrollmentRecord record;
+  record.userId = std::string(view.userId);
+  record.encodedImage.assign(view.image, view.image + view.header.imageSize);
+  record.hasDetection = (view.header.flags & kDetectionFlag) != 0;
+  if (record.hasDetection) {
+    record.boundingBox.boundingBox =
+        cv::Rect(view.header.box[0], view.header.box[1], view.header.box[2],
+                 view.header.box[3]);
+    record.boundingBox.confidenceScore = view.header.confidenceScore;
+  }
+  record.landmarks = getLandmarks(view);
+  return record;
+}
+
+std::vector<uint64_t> trustid::image::impl::EnrollmentRecordReader::findUser(
+    std::string_view userId) {
+  std::vector<uint64_t> recordIdxs;
+  const uint64_t hash = hashUserId(userId);
+  for (uint64_t recordIdx = 0; recordIdx < size(); recordIdx++) {
+    // check for hash collisions
+    if (userHashes[recordIdx] == hash && read(recordIdx).userId == userId) {
+      recordIdxs.push_back(recordIdx);
+    }
+  }
+  return recordIdxs;
+}
+
+void trustid::image::impl::EnrollmentRecordReader::readDecoded(
+    const ChunkCallback& onChunk, std::shared_ptr<IFaceDetector> detector,
+    size_t chunkSize) {
+  const uint64_t count = size();
+
+  // records [first, last) fill up to chunkSize bytes, and at least one record
+  auto getChunkEnd = [&](uint64_t first) {
+    uint64_t last = first + 1;
+    while (last < count && offsets[last + 1] - offsets[first] <= chunkSize) {
+      last++;
+    }
+    return last;
+  };
+
+  // the chunks are read ahead through a stream of their own, so onChunk can
+  // keep using the reader
+  std::ifstream prefetchIn(pathToFile, std::ios::binary);
+  if (!prefetchIn) {
+    throw std::runtime_error("Could not open enrollment record file " +
+                             pathToFile);
+  }
+  auto prefetch = [&](uint64_t first, uint64_t last) {
+    TaskPriorityScope priorityScope(ENROLLMENT_PRIORITY);
+    return std::make_unique<ChunkPrefetch>([this, &prefetchIn, first, last] {
+      return readChunk(prefetchIn, first, last);
+    });
+  };
+
+  uint64_t first = 0;
+  uint64_t last = count > 0 ? getChunkEnd(0) : 0;
+  std::unique_ptr<ChunkPrefetch> pendingChunk;
+  if (first < count) {
+    pendingChunk = prefetch(first, last);
+  }
+  while (first < count) {
+    const std::vector<char> chunk = pendingChunk->get();
+
+    // read the next chunk while this one is decoded
+    const uint64_t nextFirst = last;
+    const uint64_t nextLast =
+        nextFirst < count ? getChunkEnd(nextFirst) : count;
+    pendingChunk.reset();
+    if (nextFirst < count) {
+      pendingChunk = prefetch(nextFirst, nextLast);
+    }
+
+    std::vector<DecodedEnrollmentRecord> records(last - first);
+    std::vector<cv::Mat> undetectedImages(records.size());
+    {
+      TaskPriorityScope priorityScope(ENROLLMENT_PRIORITY);
+      getDefaultExecutor()->parallelFor(0, records.size(), [&](size_t i) {
+        const uint64_t recordIdx = first + i;
+        const RecordView view =
+            parseRecord(chunk.data() + offsets[recordIdx] - offsets[first],
+                        offsets[recordIdx + 1] - offsets[recordIdx]);
+        auto& record = records[i];
+        record.recordIdx = recordIdx;
+        record.userId = std::string(view.userId);
+        record.landmarks = getLandmarks(view);
+
+        // decode straight from the chunk, without copying the encoded bytes
+        const cv::Mat encodedImage(
+            1, static_cast<int>(view.header.imageSize), CV_8UC1,
+            const_cast<unsigned char*>(view.image));
+        cv::Mat image = pooledMat();
+        cv::imdecode(encodedImage, cv::IMREAD_COLOR, &image);
+        if (image.empty()) {
+          return;
+        }
+        if (view.header.flags & kDetectionFlag) {
+          FaceDetectionConfidenceBoundingBox boundingBox;
+          boundingBox.boundingBox =
+              cv::Rect(view.header.box[0], view.header.box[1],
+                       view.header.box[2], view.header.box[3]);
+          boundingBox.confidenceScore = view.header.confidenceScore;
+          record.entry = FaceDetectionResultEntry(image, boundingBox);
+          record.valid = true;
+        } else {
+          undetectedImages[i] = image;
+        }
+      });
+    }
+
+    // the detector runs on the records without a precomputed face, batched
+    // over the whole chunk
+    if (detector) {
+      std::vector<size_t> undetected;
+      std::vector<cv::Mat> images;
+      for (size_t i = 0; i < records.size(); i++) {
+        if (!undetectedImages[i].empty()) {
+          undetected.push_back(i);
+          images.push_back(undetectedImages[i]);
+        }
+      }
+      TaskPriorityScope priorityScope(ENROLLMENT_PRIORITY);
+      auto results = images.empty() ? std::vector<FaceDetectionResult>()
+                                    : detector->detectFacesBatch(images);
+      for (size_t i = 0; i < undetected.size(); i++) {
+        if (results[i].getResult() == ONE_RESULT) {
+          records[undetected[i]].entry = results[i].getEntry();
+          records[undetected[i]].valid = true;
+        }
+      }
+    }
+
+    onChunk(records);
+    first = nextFirst;
+    last = nextLast;
+  }
+}
+
+void trustid::image::impl::EnrollmentRecordReader::readUsers(
+    const UserCallback& onUser, std::shared_ptr<IFaceDetector> detector,
+    size_t chunkSize) {
+  bool started = false;
+  std::string userId;
+  std::vector<FaceDetectionResultEntry> entries;
+  readDecoded(
+      [&](std::vector<DecodedEnrollmentRecord>& records) {
+        for (auto& record : records) {
+          if (!started || record.userId != userId) {
+            if (started) {
+              onUser(userId, entries);
+            }
+            userId = record.userId;
+            entries.clear();
+            started = true;
+          }
+          if (record.valid) {
+            entries.push_back(std::move(record.entry));
+          }
+        }
+      },
+      detector, chunkSize);
+  if (started) {
+    onUser(userId, entries);
+  }
+}
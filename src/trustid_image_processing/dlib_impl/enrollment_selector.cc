@@ -0,0 +1,162 @@
+#include "trustid_image_processing/dlib_impl/enrollment_selector.h"
+
+#include <dlib/opencv.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "trustid_image_processing/executor.h"
+
+namespace {
+// Returns the mean displacement between the given landmarks, relative to the
+// face box.
+double getLandmarkDistance(const std::vector<cv::Point2f>& a,
+                           const std::vector<cv::Point2f>& b) {
+  double displacement = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    const cv::Point2f delta = a[i] - b[i];
+    displacement += std::sqrt(delta.dot(delta));
+  }
+  return a.empty() ? 0 : displacement / a.size();
+}
+
+// Returns how far the given angle is turned towards the given limit, from 0
+// (facing the camera) to 1 (at the limit). A limit of 0 only lets frontal
+// faces through, which then count as fully frontal.
+double getTurnRatio(const double angle, const double limit) {
+  return limit > 0 ? std::fabs(angle) / limit : 0;
+}
+}  // namespace
+
+trustid::image::impl::EnrollmentSelector::EnrollmentSelector(
+    std::shared_ptr<dlib::shape_predictor> sp,
+    const EnrollmentSelectorConfig config)
+    : sp(sp), normalizer(sp), config(config) {}
+
+trustid::image::impl::EnrollmentFrameScore
+trustid::image::impl::EnrollmentSelector::scoreFrame(
+    const FaceDetectionResultEntry& candidate,
+    std::vector<cv::Point2f>& landmarks) const {
+  EnrollmentFrameScore frameScore;
+  frameScore.score = 0;
+  frameScore.accepted = false;
+
+  // the quality check is the cheapest, so it runs first
+  frameScore.quality =
+      config.qualityGate
+          ? utils::checkImageQuality(candidate, config.qualityThresholds)
+          : utils::UNKNOWN;
+  if (config.qualityGate && frameScore.quality != utils::GOOD_QUALITY) {
+    return frameScore;
+  }
+
+  const cv::Rect box = candidate.getBoundingBox();
+  const cv::Mat image = candidate.getImage();
+  dlib::cv_image<dlib::bgr_pixel> dlibImage(image);
+  auto shape = sp->operator()(dlibImage, utils::openCVRectToDlib(box));
+  frameScore.pose = normalizer.estimateHeadPose(shape, image.size());
+  if (!frameScore.pose.isWithin(config.maxYaw, config.maxPitch)) {
+    return frameScore;
+  }
+
+  for (unsigned long i = 0; i < shape.num_parts(); i++) {
+    landmarks.emplace_back(
+        (shape.part(i).x() - box.x) / static_cast<float>(box.width),
+        (shape.part(i).y() - box.y) / static_cast<float>(box.height));
+  }
+  const double frontality =
+      1 - (getTurnRatio(frameScore.pose.getYaw(), config.maxYaw) +
+           getTurnRatio(frameScore.pose.getPitch(), config.maxPitch)) /
+              2;
+  frameScore.score =
+      frontality +
+      config.confidenceWeight *
+          candidate.getFaceDetBoundingBox().confidenceScore;
+  frameScore.accepted = true;
+  return frameScore;
+}
+
+std::vector<trustid::image::impl::EnrollmentFrameScore>
+trustid::image::impl::EnrollmentSelector::scoreFrames(
+    const std::vector<FaceDetectionResultEntry>& candidates,
+    std::vector<std::vector<cv::Point2f>>& landmarks) const {
+  std::vector<EnrollmentFrameScore> scores(candidates.size());
+  landmarks.assign(candidates.size(), std::vector<cv::Point2f>());
+  TaskPriorityScope priorityScope(ENROLLMENT_PRIORITY);
+  getDefaultExecutor()->parallelFor(0, candidates.size(), [&](size_t i) {
+    scores[i] = scoreFrame(candidates[i], landmarks[i]);
+    scores[i].index = i;
+  });
+  return scores;
+}
+
+std::vector<trustid::image::impl::EnrollmentFrameScore>
+trustid::image::impl::EnrollmentSelector::scoreFrames(
+    const std::vector<FaceDetectionResultEntry>& candidates) const {
+  std::vector<std::vector<cv::Point2f>> landmarks;
+  return scoreFrames(candidates, landmarks);
+}
+
+std::vector<size_t> trustid::image::impl::EnrollmentSelector::select(
+    const std::vector<FaceDetectionResultEntry>& candidates) const {
+  std::vector<std::vector<cv::Point2f>> landmarks;
+  const std::vector<EnrollmentFrameScore> scores =
+      scoreFrames(candidates, landmarks);
+
+  // greedy selection, tracking the distance of every frame to the closest
+  // selected one
+  std::vector<size_t> selected;
+  std::vector<double> minDistances(candidates.size(),
+                                   std::numeric_limits<double>::max());
+  std::vector<bool> available(candidates.size());
+  for (size_t i = 0; i < candidates.size(); i++) {
+    available[i] = scores[i].accepted;
+  }
+  while (selected.size() < config.maxFrames) {
+    size_t best = candidates.size();
+    double bestValue = -std::numeric_limits<double>::max();
+    for (size_t i = 0; i < candidates.size(); i++) {
+      if (!available[i]) {
+        continue;
+      }
+      // the first frame is picked on its score alone
+      const double diversity =
+          selected.empty()
+              ? 0
+              : std::min(minDistances[i] / config.diversityScale, 1.0);
+      const double value = scores[i].score + config.diversityWeight * diversity;
+      if (value > bestValue) {
+        bestValue = value;
+        best = i;
+      }
+    }
+    if (best == candidates.size()) {
+      break;
+    }
+
+    selected.push_back(best);
+    available[best] = false;
+    for (size_t i = 0; i < candidates.size(); i++) {
+      if (!available[i]) {
+        continue;
+      }
+      minDistances[i] = std::min(
+          minDistances[i], getLandmarkDistance(landmarks[i], landmarks[best]));
+      if (minDistances[i] < config.minLandmarkDistance) {
+        available[i] = false;
+      }
+    }
+  }
+  return selected;
+}
+
+std::vector<trustid::image::FaceDetectionResultEntry>
+trustid::image::impl::EnrollmentSelector::selectEntries(
+    const std::vector<FaceDetectionResultEntry>& candidates) const {
+  std::vector<FaceDetectionResultEntry> entries;
+  for (size_t idx : select(candidates)) {
+    entries.push_back(candidates[idx]);
+  }
+  return entries;
+}
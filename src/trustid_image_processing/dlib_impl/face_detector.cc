@@ -1,5 +1,6 @@
 #include "trustid_image_processing/dlib_impl/face_detector.h"
 
+#include "trustid_image_processing/executor.h"
 #include "trustid_image_processing/utils.h"
 
 trustid::image::impl::DlibFaceDetector::DlibFaceDetector() {
@@ -7,21 +8,42 @@ trustid::image::impl::DlibFaceDetector::DlibFaceDetector() {
   ffdetector = dlib::get_frontal_face_detector();
 }
 
-trustid::image::FaceDetectionResult
-trustid::image::impl::DlibFaceDetector::_detectFaces(const cv::Mat image) {
+namespace {
+trustid::image::FaceDetectionResult detectWith(
+    dlib::frontal_face_detector &ffdetector, const cv::Mat image) {
   // run dlib's face detector on the image passed in
   std::vector<dlib::rect_detection> dlibDetections = {};
   ffdetector(dlib::cv_image<dlib::bgr_pixel>(image), dlibDetections);
 
   // convert dlib's rectangle to our internal detection format
-  std::vector<FaceDetectionConfidenceBoundingBox> faces = {};
+  std::vector<trustid::image::FaceDetectionConfidenceBoundingBox> faces = {};
   for (auto &det : dlibDetections) {
-    FaceDetectionConfidenceBoundingBox detectResult;
-    detectResult.boundingBox = utils::dlibRectangleToOpenCV(det.rect);
+    trustid::image::FaceDetectionConfidenceBoundingBox detectResult;
+    detectResult.boundingBox =
+        trustid::image::utils::dlibRectangleToOpenCV(det.rect);
     detectResult.confidenceScore = det.detection_confidence;
     faces.push_back(detectResult);
   }
 
   // return the faces found
-  return FaceDetectionResult(image, faces);
+  return trustid::image::FaceDetectionResult(image, faces);
+}
+}  // namespace
+
+trustid::image::FaceDetectionResult
+trustid::image::impl::DlibFaceDetector::_detectFaces(const cv::Mat image) {
+  return detectWith(ffdetector, image);
+}
+
+std::vector<trustid::image::FaceDetectionResult>
+trustid::image::impl::DlibFaceDetector::_detectFacesBatch(
+    const std::vector<cv::Mat> &images) {
+  std::vector<FaceDetectionResult> results(images.size());
+  getDefaultExecutor()->parallelFor(0, images.size(), [&](size_t i) {
+    // the scanner keeps the feature pyramid of the last image, so it can't be
+    // shared between threads
+    auto detector = ffdetector;
+    results[i] = detectWith(detector, images[i]);
+  });
+  return results;
 }
@@ -0,0 +1,344 @@
+#include "trustid_image_processing/dlib_impl/face_pipeline.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "trustid_image_processing/mat_pool.h"
+
+namespace {
+// stages of the pipeline, in processing order
+enum FacePipelineStageEnum { DECODE, DETECT, CHIP, EMBED, MATCH };
+}  // namespace
+
+struct trustid::image::impl::FacePipeline::Job {
+  FacePipelineRequest request;
+  std::promise<FacePipelineResult> promise;
+  FacePipelineResult result;
+  dlib::matrix<dlib::rgb_pixel> chip;
+  bool done = false;      // set once the result is final
+  bool degraded = false;  // detect on a downscaled frame
+};
+
+struct trustid::image::impl::FacePipeline::Stage {
+  Stage(std::string name, unsigned workers, size_t queueCapacity,
+        size_t maxBatchSize)
+      : name(name),
+        workers(std::max(workers, 1u)),
+        maxBatchSize(std::max<size_t>(maxBatchSize, 1)),
+        queue(queueCapacity) {}
+
+  std::string name;
+  unsigned workers;
+  size_t maxBatchSize;
+  BoundedQueue<JobPtr> queue;
+  std::vector<std::thread> threads;
+  std::atomic<uint64_t> busyNanoseconds{0};
+  std::atomic<uint64_t> processed{0};
+};
+
+trustid::image::impl::FacePipeline::FacePipeline(
+    const std::shared_ptr<ResNet34> net,
+    const std::shared_ptr<dlib::shape_predictor> sp,
+    const FacePipelineConfig config)
+    : config(config), startTime(std::chrono::steady_clock::now()) {
+  // with no more requests in flight than a queue can hold, a stage never
+  // blocks for long on a full queue
+  this->config.maxInFlight = std::max<size_t>(
+      std::min(config.maxInFlight, config.queueCapacity), 1);
+
+  stages.push_back(std::make_unique<Stage>("decode", config.decodeWorkers,
+                                           config.queueCapacity, 1));
+  stages.push_back(std::make_unique<Stage>("detect", config.detectWorkers,
+                                           config.queueCapacity, 1));
+  stages.push_back(std::make_unique<Stage>("chip", config.chipWorkers,
+                                           config.queueCapacity, 1));
+  stages.push_back(std::make_unique<Stage>("embed", config.embedWorkers,
+                                           config.queueCapacity,
+                                           config.maxEmbedBatchSize));
+  stages.push_back(std::make_unique<Stage>("match", config.matchWorkers,
+                                           config.queueCapacity, 1));
+
+  startStage(DECODE, [this]() {
+    return [this](std::vector<JobPtr>& jobs) { decode(*jobs[0]); };
+  });
+  startStage(DETECT, [this]() {
+    // the detector keeps scratch state, so each worker needs its own
+    auto detector = std::make_shared<DlibFaceDetector>();
+    auto degradedDetector = std::make_shared<DlibFaceDetector>();
+    degradedDetector->addPreprocessor(std::make_unique<DownscaleImageProcessor>(
+        this->config.degradedMaxImageSize));
+    return [this, detector, degradedDetector](std::vector<JobPtr>& jobs) {
+      detect(*detector, *degradedDetector, *jobs[0]);
+    };
+  });
+  startStage(CHIP, [this, sp]() {
+    // the shape predictor is read-only, so it is shared by every worker
+    auto chipExtractor = std::make_shared<DlibFaceChipExtractor>(sp);
+    auto normalizer = std::make_shared<FaceNormalizer>();
+    return [this, chipExtractor, normalizer](std::vector<JobPtr>& jobs) {
+      extractChip(*chipExtractor, *normalizer, *jobs[0]);
+    };
+  });
+  startStage(EMBED, [this, net]() {
+    // forward passes write to the layer outputs, so each worker runs its own
+    // copy of the network
+    auto workerNet = std::make_shared<ResNet34>(*net);
+    return [this, workerNet](std::vector<JobPtr>& jobs) {
+      embed(*workerNet, jobs);
+    };
+  });
+  startStage(MATCH, [this]() {
+    return [this](std::vector<JobPtr>& jobs) { match(*jobs[0]); };
+  });
+}
+
+trustid::image::impl::FacePipeline::~FacePipeline() {
+  // wait for the admitted requests, then drain the stages in order
+  {
+    std::unique_lock<std::mutex> lock(admissionMutex);
+    stopping = true;
+    admissionChanged.notify_all();
+    admissionChanged.wait(
+        lock, [this] { return queuedJobs.empty() && inFlight == 0; });
+  }
+  for (auto& stage : stages) {
+    stage->queue.close();
+    for (auto& thread : stage->threads) {
+      thread.join();
+    }
+  }
+}
+
+template <typename MakeBody>
+void trustid::image::impl::FacePipeline::startStage(size_t stageIdx,
+                                                    MakeBody makeBody) {
+  Stage& stage = *stages[stageIdx];
+  for (unsigned i = 0; i < stage.workers; i++) {
+    stage.threads.emplace_back([this, &stage, stageIdx, makeBody]() {
+      auto body = makeBody();
+      std::vector<JobPtr> jobs;
+      JobPtr job;
+      while (stage.queue.pop(job)) {
+        // take whatever else is already waiting, up to the batch size
+        jobs.clear();
+        jobs.push_back(std::move(job));
+        while (jobs.size() < stage.maxBatchSize && stage.queue.tryPop(job)) {
+          jobs.push_back(std::move(job));
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        try {
+          body(jobs);
+        } catch (...) {
+          for (auto& failedJob : jobs) {
+            complete(std::move(failedJob), std::current_exception());
+          }
+          jobs.clear();
+        }
+        stage.busyNanoseconds +=
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - begin)
+                .count();
+        stage.processed += jobs.size();
+
+        for (auto& processedJob : jobs) {
+          if (processedJob->done || stageIdx + 1 == stages.size()) {
+            complete(std::move(processedJob));
+          } else {
+            // blocks while the next stage is full
+            stages[stageIdx + 1]->queue.push(std::move(processedJob));
+          }
+        }
+      }
+    });
+  }
+}
+
+std::future<trustid::image::impl::FacePipelineResult>
+trustid::image::impl::FacePipeline::submit(FacePipelineRequest request) {
+  auto job = std::make_unique<Job>();
+  job->request = std::move(request);
+  auto future = job->promise.get_future();
+
+  std::unique_lock<std::mutex> lock(admissionMutex);
+  // the overload policy only applies when every in-flight slot is taken and
+  // the queue is full, a free slot always admits the request straight away
+  auto isFull = [this] {
+    return inFlight >= config.maxInFlight &&
+           queuedJobs.size() >= config.maxQueuedRequests;
+  };
+  if (config.admissionPolicy == BLOCK_CALLER) {
+    admissionChanged.wait(lock,
+                          [this, &isFull] { return stopping || !isFull(); });
+  }
+  if (stopping) {
+    throw std::runtime_error("The pipeline is shutting down");
+  }
+
+  if (isFull()) {
+    if (config.admissionPolicy == DROP_OLDEST && !queuedJobs.empty()) {
+      // shed the request that waited the longest, it is the most stale one
+      queuedJobs.front()->promise.set_exception(std::make_exception_ptr(
+          FacePipelineOverloadedError("Request shed by the pipeline")));
+      queuedJobs.pop_front();
+      admissionStats.shed++;
+    } else {
+      job->promise.set_exception(std::make_exception_ptr(
+          FacePipelineOverloadedError("The pipeline is full")));
+      admissionStats.rejected++;
+      return future;
+    }
+  }
+
+  if (config.admissionPolicy == DEGRADE_TO_LOW_RES &&
+      inFlight >= config.maxInFlight) {
+    job->degraded = true;
+    admissionStats.degraded++;
+  }
+  admissionStats.admitted++;
+  queuedJobs.push_back(std::move(job));
+  dispatchQueuedJobs();
+  return future;
+}
+
+void trustid::image::impl::FacePipeline::dispatchQueuedJobs() {
+  while (inFlight < config.maxInFlight && !queuedJobs.empty()) {
+    inFlight++;
+    stages[DECODE]->queue.push(std::move(queuedJobs.front()));
+    queuedJobs.pop_front();
+  }
+  admissionChanged.notify_all();
+}
+
+void trustid::image::impl::FacePipeline::complete(
+    JobPtr job, std::exception_ptr exception) {
+  if (exception) {
+    job->promise.set_exception(exception);
+  } else {
+    job->promise.set_value(std::move(job->result));
+  }
+  job.reset();
+
+  std::lock_guard<std::mutex> lock(admissionMutex);
+  inFlight--;
+  dispatchQueuedJobs();
+}
+
+trustid::image::impl::FacePipelineAdmissionStats
+trustid::image::impl::FacePipeline::getAdmissionStats() const {
+  std::lock_guard<std::mutex> lock(admissionMutex);
+  FacePipelineAdmissionStats stats = admissionStats;
+  stats.inFlight = inFlight;
+  stats.queued = queuedJobs.size();
+  return stats;
+}
+
+std::vector<trustid::image::impl::FacePipelineStageStats>
+trustid::image::impl::FacePipeline::getStageStats() const {
+  const double elapsed =
+      std::chrono::duration<double, std::nano>(
+          std::chrono::steady_clock::now() - startTime)
+          .count();
+  std::vector<FacePipelineStageStats> stats;
+  for (auto& stage : stages) {
+    FacePipelineStageStats stageStats;
+    stageStats.name = stage->name;
+    stageStats.queueDepth = stage->queue.size();
+    stageStats.queueCapacity = stage->queue.capacity();
+    stageStats.workers = stage->workers;
+    stageStats.utilization =
+        elapsed > 0 ? stage->busyNanoseconds / (elapsed * stage->workers) : 0;
+    stageStats.processed = stage->processed;
+    stats.push_back(stageStats);
+  }
+  return stats;
+}
+
+void trustid::image::impl::FacePipeline::decode(Job& job) {
+  if (job.request.image.empty()) {
+    job.request.image = pooledMat();
+    cv::imdecode(job.request.encodedImage, cv::IMREAD_COLOR,
+                 &job.request.image);
+    if (job.request.image.empty()) {
+      throw std::runtime_error("Could not decode the image");
+    }
+    // the encoded bytes are no longer needed
+    std::vector<unsigned char>().swap(job.request.encodedImage);
+  }
+}
+
+void trustid::image::impl::FacePipeline::detect(
+    IFaceDetector& detector, IFaceDetector& degradedDetector, Job& job) {
+  // degraded jobs are detected on a downscaled frame, with the boxes mapped
+  // back so the chip is still cropped at full resolution
+  IFaceDetector& jobDetector = job.degraded ? degradedDetector : detector;
+  job.result.detectionResult = jobDetector.detectFaces(job.request.image);
+  job.request.image.release();
+  job.done = job.result.detectionResult.getResult() == NO_RESULTS;
+
+  // poor faces would only give unreliable embeddings, so they stop here
+  // instead of going through the expensive stages
+  if (!job.done && config.qualityGate) {
+    job.result.quality = utils::checkImageQuality(
+        job.result.detectionResult, config.qualityThresholds);
+    if (job.result.quality != utils::GOOD_QUALITY) {
+      job.done = true;
+      std::lock_guard<std::mutex> lock(admissionMutex);
+      admissionStats.poorQuality++;
+    }
+  }
+}
+
+void trustid::image::impl::FacePipeline::extractChip(
+    DlibFaceChipExtractor& chipExtractor, FaceNormalizer& normalizer,
+    Job& job) {
+  auto entry = job.result.detectionResult.getEntry();
+  auto shape = chipExtractor.getLandmarks(entry);
+
+  // the landmarks of the chip also give the head pose, turned faces are not
+  // worth a forward pass
+  if (config.poseGate) {
+    job.result.headPose =
+        normalizer.estimateHeadPose(shape, entry.getImage().size());
+    job.result.frontal =
+        job.result.headPose.isWithin(config.maxYaw, config.maxPitch);
+    if (!job.result.frontal) {
+      job.done = true;
+      std::lock_guard<std::mutex> lock(admissionMutex);
+      admissionStats.nonFrontal++;
+      return;
+    }
+  }
+
+  auto chipEntry = chipExtractor.extractChip(entry, shape);
+  cv::Mat chipImage = chipEntry.getCroppedImage();
+  dlib::assign_image(job.chip, dlib::cv_image<dlib::bgr_pixel>(chipImage));
+}
+
+void trustid::image::impl::FacePipeline::embed(ResNet34& net,
+                                               std::vector<JobPtr>& jobs) {
+  std::vector<dlib::matrix<dlib::rgb_pixel>> chips;
+  chips.reserve(jobs.size());
+  for (auto& job : jobs) {
+    chips.push_back(std::move(job->chip));
+  }
+
+  // a single forward pass for the whole batch
+  auto embeddings = net(chips, chips.size());
+  for (size_t i = 0; i < jobs.size(); i++) {
+    jobs[i]->result.embedding =
+        FaceEmbedding(embeddings[i].begin(), embeddings[i].end());
+  }
+}
+
+void trustid::image::impl::FacePipeline::match(Job& job) {
+  if (job.request.verificator) {
+    auto verificationResult =
+        job.request.verificator->verifyEmbedding(job.result.embedding);
+    job.result.verificationResult = FaceVerificationResult(
+        job.result.detectionResult.getEntry(),
+        verificationResult.getMatchConfidence(),
+        verificationResult.getResult());
+  }
+  job.done = true;
+}
@@ -0,0 +1,216 @@
+#include "trustid_image_processing/dlib_impl/face_stream_processor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <opencv2/imgproc.hpp>
+#include <utility>
+
+#include "trustid_image_processing/utils.h"
+
+namespace {
+// side of the grayscale thumbnails compared to detect appearance changes
+const int thumbnailSize = 32;
+
+// Returns the intersection over union of the given boxes.
+double getOverlap(const cv::Rect& a, const cv::Rect& b) {
+  const double intersection = (a & b).area();
+  const double unionArea = a.area() + b.area() - intersection;
+  return unionArea > 0 ? intersection / unionArea : 0;
+}
+
+// Builds a detection entry holding a copy of the region of the frame around
+// the given face box (the entry constructor clones the image into a pooled
+// buffer), so the entry doesn't keep the whole frame alive.
+trustid::image::FaceDetectionResultEntry makeFaceEntry(
+    const cv::Mat& frame,
+    trustid::image::FaceDetectionConfidenceBoundingBox boundingBox) {
+  const cv::Rect region = trustid::image::utils::getFaceRegion(
+      boundingBox.boundingBox, frame.size());
+  boundingBox.boundingBox -= region.tl();
+  return trustid::image::FaceDetectionResultEntry(frame(region), boundingBox);
+}
+}  // namespace
+
+trustid::image::impl::FaceStreamProcessor::FaceStreamProcessor(
+    std::shared_ptr<IFaceDetector> detector,
+    std::shared_ptr<IFaceVerificator> verificator,
+    std::shared_ptr<dlib::shape_predictor> sp,
+    const FaceStreamProcessorConfig config)
+    : detector(detector), verificator(verificator), sp(sp), config(config) {
+  this->config.detectEveryNFrames = std::max(config.detectEveryNFrames, 1u);
+  this->config.maxAveragedEmbeddings =
+      std::max(config.maxAveragedEmbeddings, 1u);
+}
+
+trustid::image::impl::FaceStreamFrameResult
+trustid::image::impl::FaceStreamProcessor::processFrame(const cv::Mat frame) {
+  FaceStreamFrameResult result;
+  result.detectorRan = false;
+  result.verifiedTracks = 0;
+  result.embeddedTracks = 0;
+
+  dlib::cv_image<dlib::bgr_pixel> image(frame);
+  const cv::Rect frameRect(0, 0, frame.cols, frame.rows);
+
+  // follow the faces with their trackers, dropping the lost ones
+  bool trackLost = false;
+  for (auto it = tracks.begin(); it != tracks.end();) {
+    const double quality = it->tracker.update(image);
+    const cv::Rect box =
+        utils::dlibRectangleToOpenCV(it->tracker.get_position()) & frameRect;
+    if (quality < config.minTrackQuality || box.empty()) {
+      it = tracks.erase(it);
+      trackLost = true;
+    } else {
+      it->face.boundingBox.boundingBox = box;
+      it->face.identityAge++;
+      ++it;
+    }
+  }
+
+  // the detector confirms the tracks and finds new faces
+  if (frameCount % config.detectEveryNFrames == 0 || trackLost) {
+    applyDetections(image, detector->detectFaces(frame));
+    result.detectorRan = true;
+  }
+  frameCount++;
+
+  for (auto& track : tracks) {
+    if (verificator) {
+      verifyTrack(frame, track, result);
+    }
+    result.tracks.push_back(track.face);
+  }
+  return result;
+}
+
+void trustid::image::impl::FaceStreamProcessor::applyDetections(
+    const dlib::cv_image<dlib::bgr_pixel>& image,
+    const FaceDetectionResult& detections) {
+  std::vector<Track> confirmedTracks;
+  for (auto& detection : detections.getBoundingBoxes()) {
+    // re-anchor the track overlapping the detection the most, if any
+    auto bestTrack = tracks.end();
+    double bestOverlap = config.minMatchOverlap;
+    for (auto it = tracks.begin(); it != tracks.end(); ++it) {
+      const double overlap = getOverlap(it->face.boundingBox.boundingBox,
+                                        detection.boundingBox);
+      if (overlap >= bestOverlap) {
+        bestOverlap = overlap;
+        bestTrack = it;
+      }
+    }
+
+    Track track;
+    if (bestTrack != tracks.end()) {
+      track = std::move(*bestTrack);
+      tracks.erase(bestTrack);
+    } else {
+      track.face.trackId = nextTrackId++;
+    }
+    track.face.boundingBox = detection;
+    track.tracker.start_track(
+        image, utils::openCVRectToDlib(detection.boundingBox));
+    confirmedTracks.push_back(std::move(track));
+  }
+
+  // tracks left unmatched are no longer seen by the detector
+  tracks = std::move(confirmedTracks);
+}
+
+void trustid::image::impl::FaceStreamProcessor::verifyTrack(
+    const cv::Mat& frame, Track& track, FaceStreamFrameResult& result) {
+  auto entry = makeFaceEntry(frame, track.face.boundingBox);
+  auto appearance = describeFace(entry);
+  const bool stale =
+      !track.verified || track.face.identityAge >= config.maxIdentityAge;
+  const bool changed = hasFaceChanged(track, appearance);
+  if (!stale && !changed) {
+    return;
+  }
+
+  // fold a new embedding into the running mean of the track, or verify the
+  // cached one again if only the identity is stale
+  if (changed) {
+    auto embedding = verificator->extractEmbedding(entry);
+    auto& mean = track.face.embedding;
+    if (track.face.embeddingCount == 0 || mean.size() != embedding.size()) {
+      mean = embedding;
+      track.face.embeddingCount = 1;
+    } else {
+      track.face.embeddingCount = std::min(track.face.embeddingCount + 1,
+                                           config.maxAveragedEmbeddings);
+      const float weight = 1.0f / track.face.embeddingCount;
+      for (size_t i = 0; i < mean.size(); i++) {
+        mean[i] += (embedding[i] - mean[i]) * weight;
+      }
+    }
+    track.embeddedAppearance = appearance;
+    result.embeddedTracks++;
+  }
+
+  auto verificationResult = verificator->verifyEmbedding(track.face.embedding);
+  track.face.identity = verificationResult.getResult();
+  track.face.matchConfidence = verificationResult.getMatchConfidence();
+  track.face.identityAge = 0;
+  track.verified = true;
+  result.verifiedTracks++;
+}
+
+trustid::image::impl::FaceStreamProcessor::FaceAppearance
+trustid::image::impl::FaceStreamProcessor::describeFace(
+    const FaceDetectionResultEntry& entry) const {
+  FaceAppearance appearance;
+  cv::Mat gray;
+  cv::cvtColor(entry.getCroppedImage(), gray, cv::COLOR_BGR2GRAY);
+  cv::resize(gray, appearance.thumbnail, cv::Size(thumbnailSize, thumbnailSize),
+             0, 0, cv::INTER_AREA);
+
+  if (sp) {
+    const cv::Rect box = entry.getBoundingBox();
+    dlib::cv_image<dlib::bgr_pixel> image(entry.getImage());
+    auto shape = sp->operator()(image, utils::openCVRectToDlib(box));
+    for (unsigned long i = 0; i < shape.num_parts(); i++) {
+      appearance.landmarks.emplace_back(
+          (shape.part(i).x() - box.x) / static_cast<float>(box.width),
+          (shape.part(i).y() - box.y) / static_cast<float>(box.height));
+    }
+  }
+  return appearance;
+}
+
+bool trustid::image::impl::FaceStreamProcessor::hasFaceChanged(
+    const Track& track, const FaceAppearance& appearance) const {
+  const FaceAppearance& embedded = track.embeddedAppearance;
+  if (track.face.embeddingCount == 0 || embedded.thumbnail.empty()) {
+    return true;
+  }
+
+  // content: mean absolute difference of the thumbnails
+  const double appearanceChange =
+      cv::norm(appearance.thumbnail, embedded.thumbnail, cv::NORM_L1) /
+      (thumbnailSize * thumbnailSize);
+  if (appearanceChange > config.maxAppearanceChange) {
+    return true;
+  }
+
+  // pose: mean displacement of the landmarks within the face box
+  if (!appearance.landmarks.empty() &&
+      appearance.landmarks.size() == embedded.landmarks.size()) {
+    double displacement = 0;
+    for (size_t i = 0; i < appearance.landmarks.size(); i++) {
+      const cv::Point2f delta =
+          appearance.landmarks[i] - embedded.landmarks[i];
+      displacement += std::sqrt(delta.dot(delta));
+    }
+    if (displacement / appearance.landmarks.size() > config.maxPoseChange) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void trustid::image::impl::FaceStreamProcessor::reset() {
+  tracks.clear();
+  frameCount = 0;
+}
@@ -1,16 +1,65 @@
 #include "trustid_image_processing/face_verificator.h"
 
+#include <dlib/clustering.h>
 #include <dlib/dnn.h>
 #include <dlib/opencv.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <istream>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <streambuf>
+#include <utility>
 #include <vector>
 
+#include "trustid_image_processing/dlib_impl/embedding_batcher.h"
 #include "trustid_image_processing/dlib_impl/face_verificator.h"
+#include "trustid_image_processing/executor.h"
 #include "trustid_image_processing/utils.h"
 
+namespace {
+// Number of enrollment chips embedded per forward pass. Pending interactive
+// work runs between the passes instead of waiting for the whole enrollment.
+const size_t enrollmentEmbedBatchSize = 4;
+
+// Returns the copy of the given network owned by the calling thread. Forward
+// passes write to the layer outputs, so a network shared by verificators
+// running on different executor threads can't be used directly.
+ResNet34& getThreadNetReplica(const std::shared_ptr<ResNet34>& net) {
+  thread_local std::vector<
+      std::pair<std::weak_ptr<ResNet34>, std::unique_ptr<ResNet34>>>
+      replicas;
+  for (auto it = replicas.begin(); it != replicas.end();) {
+    auto replicaSource = it->first.lock();
+    if (!replicaSource) {
+      // the network was released, drop its copy
+      it = replicas.erase(it);
+    } else if (replicaSource == net) {
+      return *it->second;
+    } else {
+      ++it;
+    }
+  }
+  replicas.emplace_back(net, std::make_unique<ResNet34>(*net));
+  return *replicas.back().second;
+}
+
+// Converts the face chip of the given detection to the network input format.
+dlib::matrix<dlib::rgb_pixel> toNetInput(
+    const trustid::image::FaceDetectionResultEntry& detectionResultEntry) {
+  dlib::matrix<dlib::rgb_pixel> matrix;
+  dlib::assign_image(matrix, dlib::cv_image<dlib::bgr_pixel>(
+                                 detectionResultEntry.getCroppedImage()));
+  return matrix;
+}
+}  // namespace
+
 trustid::image::impl::DlibFaceChipExtractor::DlibFaceChipExtractor(
     std::shared_ptr<dlib::shape_predictor> sp)
     : sp(sp) {}
@@ -18,13 +67,26 @@ trustid::image::impl::DlibFaceChipExtractor::DlibFaceChipExtractor(
 trustid::image::FaceDetectionResultEntry
 trustid::image::impl::DlibFaceChipExtractor::operator()(
     const FaceDetectionResultEntry detectionResultEntry) {
+  return extractChip(detectionResultEntry, getLandmarks(detectionResultEntry));
+}
+
+dlib::full_object_detection
+trustid::image::impl::DlibFaceChipExtractor::getLandmarks(
+    const FaceDetectionResultEntry& detectionResultEntry) const {
   // get the bounding box of the face
   auto detection = detectionResultEntry.getBoundingBox();
   auto image = detectionResultEntry.getImage();
 
   // convert it to dlib objects
   dlib::cv_image<dlib::bgr_pixel> dlibImage(image);
-  auto shape = sp->operator()(dlibImage, utils::openCVRectToDlib(detection));
+  return sp->operator()(dlibImage, utils::openCVRectToDlib(detection));
+}
+
+trustid::image::FaceDetectionResultEntry
+trustid::image::impl::DlibFaceChipExtractor::extractChip(
+    const FaceDetectionResultEntry& detectionResultEntry,
+    const dlib::full_object_detection& shape) const {
+  dlib::cv_image<dlib::bgr_pixel> dlibImage(detectionResultEntry.getImage());
 
   // extract the face chip
   dlib::array2d<dlib::bgr_pixel> face_chip;
@@ -47,7 +109,8 @@ trustid::image::impl::DlibFaceVerificator::DlibFaceVerificator(
     const std::shared_ptr<ResNet34> net,
     const std::shared_ptr<dlib::shape_predictor> sp,
     const std::vector<FaceDetectionResultEntry> groundTruthChips,
-    const float distanceThreshold, const float votingThreshold) {
+    const float distanceThreshold, const float votingThreshold,
+    const unsigned long maxPrototypes, const DistanceMetricEnum metric) {
   // initialize config
   this->userParams = DlibFaceVerificatorModelParams();
   this->userParams.distanceThreshold = distanceThreshold;
@@ -59,14 +122,29 @@ trustid::image::impl::DlibFaceVerificator::DlibFaceVerificator(
   // add the preprocessor to extract the face chips
   this->addPreprocessor(std::make_unique<DlibFaceChipExtractor>(sp));
 
-  for (auto &chip : groundTruthChips) {
-    // Convert OpenCV image to dlib format
-    dlib::matrix<dlib::rgb_pixel> matrix;
-    dlib::assign_image(matrix, dlib::cv_image<dlib::bgr_pixel>(
-                                   applyProcessors(chip).getCroppedImage()));
+  // enrollment runs in the enrollment priority class, so interactive
+  // verifications are dispatched ahead of its parallel work
+  auto executor = getDefaultExecutor();
+  TaskPriorityScope priorityScope(ENROLLMENT_PRIORITY);
+
+  // extract the face chips in parallel, then embed them in batched forward
+  // passes
+  std::vector<dlib::matrix<dlib::rgb_pixel>> faceChips(groundTruthChips.size());
+  executor->parallelFor(0, groundTruthChips.size(), [&](size_t i) {
+    faceChips[i] = toNetInput(applyProcessors(groundTruthChips[i]));
+  });
+  std::vector<dlib::matrix<float, 0, 1>> embeddings(faceChips.size());
+  for (size_t begin = 0; begin < faceChips.size();
+       begin += enrollmentEmbedBatchSize) {
+    const size_t end =
+        std::min(begin + enrollmentEmbedBatchSize, faceChips.size());
+    getThreadNetReplica(net)(faceChips.begin() + begin,
+                             faceChips.begin() + end,
+                             embeddings.begin() + begin);
+  }
 
-    // Extract the face descriptor
-    auto groundTruthVec = this->net->operator()(matrix);
+  for (auto &embedding : embeddings) {
+    dlib::matrix<float, 0, 1> groundTruthVec = embedding;
 
     #ifndef NDEBUG
       std::cout << "vec: " << groundTruthVec << std::endl;
@@ -77,6 +155,15 @@ trustid::image::impl::DlibFaceVerificator::DlibFaceVerificator(
     this->userParams.groundTruthVecs.push_back(groundTruthVec);
   }
 
+  // reduce near-duplicate enrollment frames to a fixed number of prototypes
+  if (maxPrototypes > 0) {
+    this->userParams = compressUserParams(this->userParams, maxPrototypes);
+  }
+  if (metric == COSINE_SIMILARITY) {
+    this->userParams = convertToCosineSimilarity(this->userParams);
+  }
+  packUserParams();
+
 #ifndef NDEBUG
   std::cout << "Ground truth vector size: "
             << this->userParams.groundTruthVecs.size() << std::endl;
@@ -90,45 +177,729 @@ trustid::image::impl::DlibFaceVerificator::DlibFaceVerificator(
     : userParams(userParams), net(net) {
   // add the preprocessor to extract the face chips
   this->addPreprocessor(std::make_unique<DlibFaceChipExtractor>(sp));
+  packUserParams();
+}
+
+trustid::image::impl::DlibFaceVerificator::DlibFaceVerificator(
+    const std::shared_ptr<ResNet34> net,
+    const std::shared_ptr<dlib::shape_predictor> sp,
+    const UserTemplateView userTemplate)
+    : net(net), userTemplate(userTemplate), ownsTemplate(false) {
+  // add the preprocessor to extract the face chips
+  this->addPreprocessor(std::make_unique<DlibFaceChipExtractor>(sp));
+  resetEvaluationOrder();
 }
 
 trustid::image::impl::DlibFaceVerificatorModelParams
 trustid::image::impl::DlibFaceVerificator::getUserParams() {
-  return this->userParams;
+  return ownsTemplate ? this->userParams : userTemplate.toModelParams();
 }
 
-trustid::image::FaceVerificationResult
-trustid::image::impl::DlibFaceVerificator::_verifyUser(
+void trustid::image::impl::DlibFaceVerificator::packUserParams() {
+  // copy the ground truth vectors into a single contiguous block
+  const size_t count = userParams.groundTruthVecs.size();
+  const size_t dims = count > 0 ? userParams.groundTruthVecs[0].size() : 0;
+  packedVecs.resize(count * dims);
+  packedWeights.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    if (static_cast<size_t>(userParams.groundTruthVecs[i].size()) != dims) {
+      throw std::runtime_error("Ground truth vectors have different sizes");
+    }
+    std::copy(userParams.groundTruthVecs[i].begin(),
+              userParams.groundTruthVecs[i].end(),
+              packedVecs.begin() + i * dims);
+    packedWeights[i] = userParams.getWeight(i);
+  }
+
+  userTemplate.vectors = packedVecs.data();
+  userTemplate.weights = packedWeights.data();
+  userTemplate.count = static_cast<uint32_t>(count);
+  userTemplate.dims = static_cast<uint32_t>(dims);
+  userTemplate.distanceThreshold = userParams.distanceThreshold;
+  userTemplate.votingThreshold = userParams.votingThreshold;
+  userTemplate.metric = userParams.metric;
+  ownsTemplate = true;
+
+  // params built elsewhere may hold non-normalized vectors
+  if (userTemplate.metric == COSINE_SIMILARITY) {
+    for (size_t i = 0; i < count; i++) {
+      normalizeEmbedding(packedVecs.data() + i * dims, userTemplate.dims);
+    }
+  }
+
+  resetEvaluationOrder();
+}
+
+void trustid::image::impl::DlibFaceVerificator::setVotingEvaluationMode(
+    VotingEvaluationModeEnum evaluationMode) {
+  this->evaluationMode = evaluationMode;
+}
+
+void trustid::image::impl::DlibFaceVerificator::setEmbeddingBatcher(
+    std::shared_ptr<EmbeddingBatcher> batcher) {
+  this->batcher = batcher;
+}
+
+void trustid::image::impl::DlibFaceVerificator::resetEvaluationOrder() {
+  std::lock_guard<std::mutex> lock(hitStatsMutex);
+  // start with the heaviest prototypes, since they settle the vote sooner
+  evaluationOrder.resize(userTemplate.count);
+  std::iota(evaluationOrder.begin(), evaluationOrder.end(), 0);
+  std::stable_sort(evaluationOrder.begin(), evaluationOrder.end(),
+                   [this](size_t a, size_t b) {
+                     return userTemplate.weights[a] > userTemplate.weights[b];
+                   });
+  sampleHits.assign(userTemplate.count, 0);
+}
+
+trustid::image::FaceEmbedding
+trustid::image::impl::DlibFaceVerificator::_extractEmbedding(
     const FaceDetectionResultEntry detectionResultEntry) {
-  // Get the face embedding of the image to test
-  dlib::matrix<dlib::rgb_pixel> matrix;
-  dlib::assign_image(matrix, dlib::cv_image<dlib::bgr_pixel>(
-                                 detectionResultEntry.getCroppedImage()));
+  // Convert OpenCV image to dlib format
+  auto matrix = toNetInput(detectionResultEntry);
 
-  auto testVec = this->net->operator()(matrix);
-  // Calculate the distance to all ground truth vectors
-  int count = 0;
-  for (auto groundTruthVec : this->userParams.groundTruthVecs) {
-    // Calculate the distance ofS
-    auto distance = dlib::length(testVec - groundTruthVec);
-    //#ifndef NDEBUG
-    //std::cout << "distance: " << distance << std::endl;
-    //#endif // DEBUG
-    if (distance < this->userParams.distanceThreshold) {
-      count++;
+  // wait for the batched forward pass when sharing a batcher
+  if (batcher) {
+    return batcher->submit(std::move(matrix)).get();
+  }
+
+  // Get the face embedding of the image
+  auto embedding = getThreadNetReplica(net)(matrix);
+  return FaceEmbedding(embedding.begin(), embedding.end());
+}
+
+trustid::image::FaceVerificationResult
+trustid::image::impl::DlibFaceVerificator::_verifyEmbedding(
+    const FaceEmbedding &embedding) {
+  if (userTemplate.count > 0 &&
+      static_cast<uint32_t>(embedding.size()) != userTemplate.dims) {
+    throw std::runtime_error("Embedding size does not match the user model");
+  }
+  const bool useCosineSimilarity = userTemplate.metric == COSINE_SIMILARITY;
+  const float* probe = embedding.data();
+  FaceEmbedding normalizedEmbedding;
+  if (useCosineSimilarity) {
+    normalizedEmbedding = embedding;
+    normalizeEmbedding(normalizedEmbedding.data(),
+                       static_cast<uint32_t>(normalizedEmbedding.size()));
+    probe = normalizedEmbedding.data();
+  }
+  const bool earlyTermination = evaluationMode != FULL_EVALUATION;
+  const bool trackHits = evaluationMode == EARLY_TERMINATION_BY_HIT_RATE;
+  const float totalWeight = userTemplate.getTotalWeight();
+  // compare squared distances to skip the square root
+  const float squaredThreshold =
+      userTemplate.distanceThreshold * userTemplate.distanceThreshold;
+  const float similarityThreshold =
+      distanceToSimilarityThreshold(userTemplate.distanceThreshold);
+
+  // the hit statistics are shared by concurrent calls, so each call evaluates
+  // a snapshot of the order and records its hits afterwards
+  std::vector<size_t> orderSnapshot;
+  std::vector<size_t> hits;
+  if (trackHits) {
+    std::lock_guard<std::mutex> lock(hitStatsMutex);
+    orderSnapshot = evaluationOrder;
+  }
+  const std::vector<size_t>& order =
+      trackHits ? orderSnapshot : evaluationOrder;
+
+  // Calculate the distance to the ground truth vectors, each one voting with
+  // its weight
+  float votes = 0;
+  float remainingVotes = totalWeight;
+  for (size_t pos = 0; pos < order.size(); pos++) {
+    size_t i = order[pos];
+    float weight = userTemplate.weights[i];
+    remainingVotes -= weight;
+
+    // Compare the test vector with the ground truth vector
+    const float* groundTruthVec = userTemplate.getVector(i);
+    bool isMatch;
+    if (useCosineSimilarity) {
+      float similarity = 0;
+      for (uint32_t d = 0; d < userTemplate.dims; d++) {
+        similarity += probe[d] * groundTruthVec[d];
+      }
+      isMatch = similarity > similarityThreshold;
+    } else {
+      float squaredDistance = 0;
+      for (uint32_t d = 0; d < userTemplate.dims; d++) {
+        float diff = probe[d] - groundTruthVec[d];
+        squaredDistance += diff * diff;
+      }
+      //#ifndef NDEBUG
+      //std::cout << "distance: " << std::sqrt(squaredDistance) << std::endl;
+      //#endif // DEBUG
+      isMatch = squaredDistance < squaredThreshold;
+    }
+    if (isMatch) {
+      votes += weight;
+
+      if (trackHits) {
+        hits.push_back(i);
+      }
+    }
+
+    // stop once the remaining votes can no longer change the result
+    if (earlyTermination &&
+        (votes / totalWeight > userTemplate.votingThreshold ||
+         (votes + remainingVotes) / totalWeight <=
+             userTemplate.votingThreshold)) {
+      break;
+    }
+  }
+
+  if (!hits.empty()) {
+    // move the matched vectors ahead of the ones with fewer hits
+    std::lock_guard<std::mutex> lock(hitStatsMutex);
+    for (size_t i : hits) {
+      sampleHits[i]++;
+      size_t j = std::find(evaluationOrder.begin(), evaluationOrder.end(), i) -
+                 evaluationOrder.begin();
+      for (; j > 0 && sampleHits[evaluationOrder[j - 1]] <
+                          sampleHits[evaluationOrder[j]];
+           j--) {
+        std::swap(evaluationOrder[j - 1], evaluationOrder[j]);
+      }
     }
   }
 
   // Calculate the voting percentage and determine if it's the real user based
   // on voting threshold
-  auto votingConfidence =
-      static_cast<float>(count) / this->userParams.groundTruthVecs.size();
-  return FaceVerificationResult(detectionResultEntry, votingConfidence,
-                                votingConfidence > userParams.votingThreshold
+  auto votingConfidence = totalWeight > 0 ? votes / totalWeight : 0.0f;
+  return FaceVerificationResult(FaceDetectionResultEntry(), votingConfidence,
+                                votingConfidence > userTemplate.votingThreshold
                                     ? SAME_USER
                                     : DIFFERENT_USER);
 }
 
+float trustid::image::impl::DlibFaceVerificatorModelParams::getWeight(
+    size_t idx) const {
+  return groundTruthWeights.empty() ? 1.0f : groundTruthWeights[idx];
+}
+
+float trustid::image::impl::DlibFaceVerificatorModelParams::getTotalWeight()
+    const {
+  if (groundTruthWeights.empty()) {
+    return static_cast<float>(groundTruthVecs.size());
+  }
+  return std::accumulate(groundTruthWeights.begin(), groundTruthWeights.end(),
+                         0.0f);
+}
+
+float trustid::image::impl::UserTemplateView::getTotalWeight() const {
+  return std::accumulate(weights, weights + count, 0.0f);
+}
+
+trustid::image::impl::DlibFaceVerificatorModelParams
+trustid::image::impl::UserTemplateView::toModelParams() const {
+  DlibFaceVerificatorModelParams userParams({}, {}, distanceThreshold,
+                                            votingThreshold);
+  userParams.metric = metric;
+  for (uint32_t i = 0; i < count; i++) {
+    dlib::matrix<float, 0, 1> groundTruthVec(dims);
+    std::copy(getVector(i), getVector(i) + dims, groundTruthVec.begin());
+    userParams.groundTruthVecs.push_back(groundTruthVec);
+    userParams.groundTruthWeights.push_back(weights[i]);
+  }
+  return userParams;
+}
+
+namespace {
+// Serialized params start with a version marker. The original format, written
+// by DLIB_DEFINE_DEFAULT_SERIALIZATION, starts with a positive version 1, and
+// later versions with a negative one. Versions 1 to 3 go through the dlib
+// encoding, version 4 is the compact format.
+constexpr int kModelParamsSerializationVersion = 4;
+constexpr int kCompactSerializationVersion = 4;
+
+// dlib encoding of the compact version marker (one byte holding the sign and
+// length, then the value), matched when parsing records from memory
+constexpr unsigned char kCompactMarker[2] = {0x81, 0x04};
+
+// compact header: dims, count, flags, metric, distance and voting thresholds,
+// followed by the value blocks (26 bytes into the record, after the marker)
+constexpr size_t kCompactHeaderFields = 6;
+constexpr size_t kCompactHeaderSize = kCompactHeaderFields * 4;
+constexpr uint32_t kCompactFloat16Flag = 1;
+constexpr uint32_t kCompactWeightsFlag = 2;
+
+// largest embedding and model accepted when reading, to reject corrupted
+// headers before allocating
+constexpr uint32_t kMaxCompactDims = 1 << 16;
+constexpr uint64_t kMaxCompactValues = uint64_t(1) << 28;
+
+// values converted per chunk when the blocks can't be copied as is
+constexpr size_t kConversionChunkSize = 256;
+
+bool isLittleEndian() {
+  const uint32_t value = 1;
+  unsigned char firstByte;
+  std::memcpy(&firstByte, &value, 1);
+  return firstByte == 1;
+}
+
+void writeUint32(char* destination, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    destination[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+uint32_t readUint32(const char* source) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(source[i]))
+             << (8 * i);
+  }
+  return value;
+}
+
+uint32_t floatToBits(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, 4);
+  return bits;
+}
+
+float bitsToFloat(uint32_t bits) {
+  float value;
+  std::memcpy(&value, &bits, 4);
+  return value;
+}
+
+// Converts a float to IEEE half precision, rounding to nearest even.
+uint16_t floatToHalf(float value) {
+  const uint32_t bits = floatToBits(value);
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+  if (((bits >> 23) & 0xff) == 0xff) {
+    // infinity or NaN
+    return static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+  }
+  if (exponent >= 31) {
+    return static_cast<uint16_t>(sign | 0x7c00);
+  }
+  if (exponent <= 0) {
+    if (exponent < -10) {
+      return static_cast<uint16_t>(sign);
+    }
+    // subnormal half
+    mantissa |= 0x800000;
+    const uint32_t shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1))) {
+      half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+  }
+  uint32_t half = (exponent << 10) | (mantissa >> 13);
+  const uint32_t remainder = mantissa & 0x1fff;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+    // may carry into the exponent, up to infinity
+    half++;
+  }
+  return static_cast<uint16_t>(sign | half);
+}
+
+float halfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  int32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  if (exponent == 0x1f) {
+    return bitsToFloat(sign | 0x7f800000 | (mantissa << 13));
+  }
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      return bitsToFloat(sign);
+    }
+    // normalize the subnormal half
+    exponent = 1;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    mantissa &= 0x3ff;
+  }
+  return bitsToFloat(sign | (static_cast<uint32_t>(exponent + 127 - 15) << 23) |
+                     (mantissa << 13));
+}
+
+// Size in bytes of a block of the given number of values.
+size_t getBlockSize(size_t count, bool half) {
+  // fp16 blocks are padded to a multiple of 4 bytes, like float32 ones
+  return half ? (count * 2 + 3) / 4 * 4 : count * 4;
+}
+
+// Writes the given values as a little-endian float32 or fp16 block.
+void writeBlock(const float* values, size_t count, bool half,
+                std::ostream& out) {
+  if (!half && isLittleEndian()) {
+    out.write(reinterpret_cast<const char*>(values), count * 4);
+    return;
+  }
+  char buffer[kConversionChunkSize * 4];
+  for (size_t begin = 0; begin < count; begin += kConversionChunkSize) {
+    const size_t chunk = std::min(kConversionChunkSize, count - begin);
+    for (size_t i = 0; i < chunk; i++) {
+      if (half) {
+        const uint16_t bits = floatToHalf(values[begin + i]);
+        buffer[2 * i] = static_cast<char>(bits & 0xff);
+        buffer[2 * i + 1] = static_cast<char>(bits >> 8);
+      } else {
+        writeUint32(buffer + 4 * i, floatToBits(values[begin + i]));
+      }
+    }
+    out.write(buffer, chunk * (half ? 2 : 4));
+  }
+  const char padding[4] = {};
+  out.write(padding, getBlockSize(count, half) - count * (half ? 2 : 4));
+}
+
+// Converts a block written by writeBlock, already in memory.
+void convertBlock(const char* block, size_t count, bool half, float* values) {
+  if (!half && isLittleEndian()) {
+    std::memcpy(values, block, count * 4);
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    values[i] = half ? halfToFloat(static_cast<uint16_t>(
+                           static_cast<unsigned char>(block[2 * i]) |
+                           static_cast<unsigned char>(block[2 * i + 1]) << 8))
+                     : bitsToFloat(readUint32(block + 4 * i));
+  }
+}
+
+// Reads a block written by writeBlock from the given stream.
+void readBlock(std::istream& in, size_t count, bool half, float* values) {
+  if (!half && isLittleEndian()) {
+    in.read(reinterpret_cast<char*>(values), count * 4);
+  } else {
+    char buffer[kConversionChunkSize * 4];
+    for (size_t begin = 0; begin < count && in; begin += kConversionChunkSize) {
+      const size_t chunk = std::min(kConversionChunkSize, count - begin);
+      in.read(buffer, chunk * (half ? 2 : 4));
+      convertBlock(buffer, chunk, half, values + begin);
+    }
+    in.ignore(getBlockSize(count, half) - count * (half ? 2 : 4));
+  }
+  if (!in) {
+    throw dlib::serialization_error(
+        "Unexpected end of data while deserializing "
+        "DlibFaceVerificatorModelParams.");
+  }
+}
+
+// Fields of the compact header.
+struct CompactHeader {
+  uint32_t dims;
+  uint32_t count;
+  uint32_t flags;
+  uint32_t metric;
+  float distanceThreshold;
+  float votingThreshold;
+
+  bool isHalf() const { return flags & kCompactFloat16Flag; }
+  bool hasWeights() const { return flags & kCompactWeightsFlag; }
+
+  // Size of the weights and vectors following the header.
+  size_t getPayloadSize() const {
+    return (hasWeights() ? getBlockSize(count, false) : 0) +
+           count * getBlockSize(dims, isHalf());
+  }
+};
+
+CompactHeader parseCompactHeader(const char* data) {
+  CompactHeader header;
+  header.dims = readUint32(data);
+  header.count = readUint32(data + 4);
+  header.flags = readUint32(data + 8);
+  header.metric = readUint32(data + 12);
+  header.distanceThreshold = bitsToFloat(readUint32(data + 16));
+  header.votingThreshold = bitsToFloat(readUint32(data + 20));
+  if (header.dims > kMaxCompactDims ||
+      static_cast<uint64_t>(header.dims) * header.count > kMaxCompactValues ||
+      header.metric > trustid::image::impl::COSINE_SIMILARITY) {
+    throw dlib::serialization_error(
+        "Corrupted header found while deserializing "
+        "DlibFaceVerificatorModelParams.");
+  }
+  return header;
+}
+
+// Sets up the given params for the vectors of the given header, calling
+// readValues(values, count, half) for each block in order.
+template <typename ReadValues>
+void readCompactParams(const CompactHeader& header,
+                       trustid::image::impl::DlibFaceVerificatorModelParams& item,
+                       ReadValues readValues) {
+  item.distanceThreshold = header.distanceThreshold;
+  item.votingThreshold = header.votingThreshold;
+  item.metric =
+      static_cast<trustid::image::impl::DistanceMetricEnum>(header.metric);
+  item.groundTruthWeights.clear();
+  if (header.hasWeights()) {
+    item.groundTruthWeights.resize(header.count);
+    readValues(item.groundTruthWeights.data(), header.count, false);
+  }
+  item.groundTruthVecs.resize(header.count);
+  for (auto& groundTruthVec : item.groundTruthVecs) {
+    groundTruthVec.set_size(header.dims);
+    if (header.dims > 0) {
+      readValues(&groundTruthVec(0), header.dims, header.isHalf());
+    }
+  }
+}
+
+// Read-only stream buffer over memory, for the records parsed through dlib.
+class MemoryStreamBuf : public std::streambuf {
+ public:
+  MemoryStreamBuf(const char* data, size_t size) {
+    char* begin = const_cast<char*>(data);
+    setg(begin, begin, begin + size);
+  }
+
+  // Bytes read so far.
+  size_t consumed() const { return gptr() - eback(); }
+};
+}  // namespace
+
+void trustid::image::impl::serialize(const DlibFaceVerificatorModelParams& item,
+                                     std::ostream& out,
+                                     EmbeddingPrecisionEnum precision) {
+  const uint32_t count = static_cast<uint32_t>(item.groundTruthVecs.size());
+  const uint32_t dims =
+      count > 0 ? static_cast<uint32_t>(item.groundTruthVecs[0].size()) : 0;
+  for (auto& groundTruthVec : item.groundTruthVecs) {
+    if (groundTruthVec.size() != dims) {
+      throw dlib::serialization_error(
+          "Ground truth vectors of different sizes can't be serialized.");
+    }
+  }
+  const bool hasWeights = !item.groundTruthWeights.empty();
+  if (hasWeights && item.groundTruthWeights.size() != count) {
+    throw dlib::serialization_error(
+        "Ground truth weights don't match the ground truth vectors.");
+  }
+  const bool half = precision == FLOAT16_PRECISION;
+
+  dlib::serialize(-kCompactSerializationVersion, out);
+  char header[kCompactHeaderSize];
+  writeUint32(header, dims);
+  writeUint32(header + 4, count);
+  writeUint32(header + 8, (half ? kCompactFloat16Flag : 0) |
+                              (hasWeights ? kCompactWeightsFlag : 0));
+  writeUint32(header + 12, static_cast<uint32_t>(item.metric));
+  writeUint32(header + 16, floatToBits(item.distanceThreshold));
+  writeUint32(header + 20, floatToBits(item.votingThreshold));
+  out.write(header, kCompactHeaderSize);
+  if (hasWeights) {
+    writeBlock(item.groundTruthWeights.data(), count, false, out);
+  }
+  for (auto& groundTruthVec : item.groundTruthVecs) {
+    if (dims > 0) {
+      writeBlock(&groundTruthVec(0), dims, half, out);
+    }
+  }
+  if (!out) {
+    throw dlib::serialization_error(
+        "Error while serializing DlibFaceVerificatorModelParams.");
+  }
+}
+
+void trustid::image::impl::deserialize(DlibFaceVerificatorModelParams& item,
+                                       std::istream& in) {
+  // the original format writes version 1, later ones a negative version
+  int marker;
+  dlib::deserialize(marker, in);
+  const int version = marker == 1 ? 1 : (marker < -1 ? -marker : 0);
+  if (version < 1 || version > kModelParamsSerializationVersion) {
+    throw dlib::serialization_error(
+        "Unexpected version found while deserializing "
+        "DlibFaceVerificatorModelParams.");
+  }
+
+  if (version == kCompactSerializationVersion) {
+    char header[kCompactHeaderSize];
+    if (!in.read(header, kCompactHeaderSize)) {
+      throw dlib::serialization_error(
+          "Unexpected end of data while deserializing "
+          "DlibFaceVerificatorModelParams.");
+    }
+    readCompactParams(parseCompactHeader(header), item,
+                      [&in](float* values, size_t count, bool half) {
+                        readBlock(in, count, half, values);
+                      });
+    return;
+  }
+
+  dlib::deserialize(item.groundTruthVecs, in);
+  item.groundTruthWeights.clear();
+  if (version >= 2) {
+    dlib::deserialize(item.groundTruthWeights, in);
+  }
+  dlib::deserialize(item.distanceThreshold, in);
+  dlib::deserialize(item.votingThreshold, in);
+  item.metric = EUCLIDEAN_DISTANCE;
+  if (version >= 3) {
+    int metric;
+    dlib::deserialize(metric, in);
+    item.metric = static_cast<DistanceMetricEnum>(metric);
+  }
+}
+
+void trustid::image::impl::serializeUserParamsBatch(
+    const std::vector<DlibFaceVerificatorModelParams>& users,
+    std::ostream& out, EmbeddingPrecisionEnum precision) {
+  for (auto& user : users) {
+    serialize(user, out, precision);
+  }
+}
+
+std::vector<trustid::image::impl::DlibFaceVerificatorModelParams>
+trustid::image::impl::deserializeUserParamsBatch(const char* data,
+                                                 size_t size) {
+  std::vector<DlibFaceVerificatorModelParams> users;
+  size_t offset = 0;
+  while (offset < size) {
+    users.emplace_back();
+    auto& user = users.back();
+    const char* record = data + offset;
+    const size_t remaining = size - offset;
+
+    if (remaining >= sizeof(kCompactMarker) &&
+        std::memcmp(record, kCompactMarker, sizeof(kCompactMarker)) == 0) {
+      // compact records are parsed in place
+      if (remaining < sizeof(kCompactMarker) + kCompactHeaderSize) {
+        throw dlib::serialization_error(
+            "Unexpected end of data while deserializing "
+            "DlibFaceVerificatorModelParams.");
+      }
+      const char* position = record + sizeof(kCompactMarker);
+      const CompactHeader header = parseCompactHeader(position);
+      position += kCompactHeaderSize;
+      if (static_cast<size_t>(data + size - position) <
+          header.getPayloadSize()) {
+        throw dlib::serialization_error(
+            "Unexpected end of data while deserializing "
+            "DlibFaceVerificatorModelParams.");
+      }
+      readCompactParams(header, user,
+                        [&position](float* values, size_t count, bool half) {
+                          convertBlock(position, count, half, values);
+                          position += getBlockSize(count, half);
+                        });
+      offset = position - data;
+    } else {
+      // older formats go through the dlib decoding
+      MemoryStreamBuf buffer(record, remaining);
+      std::istream in(&buffer);
+      deserialize(user, in);
+      offset += buffer.consumed();
+    }
+  }
+  return users;
+}
+
+trustid::image::impl::DlibFaceVerificatorModelParams
+trustid::image::impl::compressUserParams(
+    const DlibFaceVerificatorModelParams& userParams, unsigned long k,
+    bool useMedoids) {
+  if (k == 0) {
+    throw std::invalid_argument("Number of prototypes must be positive");
+  }
+  const auto& samples = userParams.groundTruthVecs;
+  if (samples.size() <= k) {
+    // nothing to compress
+    return userParams;
+  }
+
+  // cluster the enrollment vectors
+  std::vector<dlib::matrix<float, 0, 1>> centers;
+  if (k == 1) {
+    dlib::matrix<float, 0, 1> mean = samples[0];
+    for (size_t i = 1; i < samples.size(); i++) {
+      mean += samples[i];
+    }
+    centers.push_back(mean / static_cast<float>(samples.size()));
+  } else {
+    dlib::pick_initial_centers(k, centers, samples);
+    dlib::find_clusters_using_kmeans(samples, centers);
+  }
+
+  // assign each sample to its cluster, accumulating the weights and keeping
+  // track of the sample closest to each centroid
+  std::vector<float> weights(centers.size(), 0.0f);
+  std::vector<size_t> medoids(centers.size(), 0);
+  std::vector<float> medoidDistances(centers.size(),
+                                     std::numeric_limits<float>::max());
+  for (size_t i = 0; i < samples.size(); i++) {
+    auto center = dlib::nearest_center(centers, samples[i]);
+    weights[center] += userParams.getWeight(i);
+
+    auto distance = dlib::length(samples[i] - centers[center]);
+    if (distance < medoidDistances[center]) {
+      medoidDistances[center] = distance;
+      medoids[center] = i;
+    }
+  }
+
+  // drop empty clusters and build the compressed params
+  DlibFaceVerificatorModelParams compressedParams(
+      {}, {}, userParams.distanceThreshold, userParams.votingThreshold);
+  compressedParams.metric = userParams.metric;
+  for (size_t c = 0; c < centers.size(); c++) {
+    if (weights[c] <= 0) {
+      continue;
+    }
+    compressedParams.groundTruthVecs.push_back(
+        useMedoids ? samples[medoids[c]] : centers[c]);
+    compressedParams.groundTruthWeights.push_back(weights[c]);
+  }
+
+  // centroids of normalized vectors are no longer unit length
+  if (compressedParams.metric == COSINE_SIMILARITY && !useMedoids) {
+    compressedParams = convertToCosineSimilarity(compressedParams);
+  }
+  return compressedParams;
+}
+
+trustid::image::impl::DlibFaceVerificatorModelParams
+trustid::image::impl::convertToCosineSimilarity(
+    const DlibFaceVerificatorModelParams& userParams) {
+  DlibFaceVerificatorModelParams cosineParams = userParams;
+  cosineParams.metric = COSINE_SIMILARITY;
+  for (auto& groundTruthVec : cosineParams.groundTruthVecs) {
+    if (groundTruthVec.size() == 0) {
+      continue;
+    }
+    normalizeEmbedding(&groundTruthVec(0),
+                       static_cast<uint32_t>(groundTruthVec.size()));
+  }
+  return cosineParams;
+}
+
+void trustid::image::impl::normalizeEmbedding(float* embedding,
+                                              uint32_t dims) {
+  float squaredNorm = 0;
+  for (uint32_t d = 0; d < dims; d++) {
+    squaredNorm += embedding[d] * embedding[d];
+  }
+  if (squaredNorm > 0) {
+    const float scale = 1.0f / std::sqrt(squaredNorm);
+    for (uint32_t d = 0; d < dims; d++) {
+      embedding[d] *= scale;
+    }
+  }
+}
+
+float trustid::image::impl::distanceToSimilarityThreshold(
+    float distanceThreshold) {
+  return 1.0f - distanceThreshold * distanceThreshold / 2.0f;
+}
+
 std::shared_ptr<dlib::shape_predictor>
 trustid::image::impl::loadShapePredictorFromDisk(std::string pathToFile) {
   auto sp = std::make_shared<dlib::shape_predictor>();
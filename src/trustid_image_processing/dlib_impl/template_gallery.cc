@@ -0,0 +1,251 @@
+#include "trustid_image_processing/dlib_impl/template_gallery.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "trustid_image_processing/executor.h"
+
+namespace {
+// number of probes multiplied against the gallery at once
+constexpr long kProbeBlockSize = 256;
+}  // namespace
+
+trustid::image::impl::TemplateGallery::TemplateGallery(
+    const std::vector<DlibFaceVerificatorModelParams>& users) {
+  std::vector<float> packedVecs;
+  for (auto& userParams : users) {
+    // pack the params to view them like any other user template
+    UserTemplateView userTemplate;
+    std::vector<float> userVecs;
+    std::vector<float> userWeights;
+    for (size_t i = 0; i < userParams.groundTruthVecs.size(); i++) {
+      userVecs.insert(userVecs.end(), userParams.groundTruthVecs[i].begin(),
+                      userParams.groundTruthVecs[i].end());
+      userWeights.push_back(userParams.getWeight(i));
+    }
+    userTemplate.vectors = userVecs.data();
+    userTemplate.weights = userWeights.data();
+    userTemplate.count = static_cast<uint32_t>(userWeights.size());
+    userTemplate.dims = userWeights.empty()
+                            ? 0
+                            : static_cast<uint32_t>(
+                                  userParams.groundTruthVecs[0].size());
+    userTemplate.distanceThreshold = userParams.distanceThreshold;
+    userTemplate.votingThreshold = userParams.votingThreshold;
+    userTemplate.metric = userParams.metric;
+    addUser(userTemplate, packedVecs);
+  }
+  buildTemplates(packedVecs);
+}
+
+trustid::image::impl::TemplateGallery::TemplateGallery(
+    const std::vector<UserTemplateView>& users) {
+  std::vector<float> packedVecs;
+  for (auto& userTemplate : users) {
+    addUser(userTemplate, packedVecs);
+  }
+  buildTemplates(packedVecs);
+}
+
+void trustid::image::impl::TemplateGallery::addUser(
+    const UserTemplateView& userTemplate, std::vector<float>& packedVecs) {
+  if (userTemplate.count > 0) {
+    if (dims == 0) {
+      dims = userTemplate.dims;
+    } else if (dims != static_cast<long>(userTemplate.dims)) {
+      throw std::invalid_argument(
+          "All users of a gallery must have the same embedding size");
+    }
+  }
+
+  UserEntry user;
+  user.begin = static_cast<long>(weights.size());
+  user.end = user.begin + userTemplate.count;
+  user.totalWeight = userTemplate.getTotalWeight();
+  user.squaredDistanceThreshold =
+      userTemplate.distanceThreshold * userTemplate.distanceThreshold;
+  user.similarityThreshold =
+      distanceToSimilarityThreshold(userTemplate.distanceThreshold);
+  user.votingThreshold = userTemplate.votingThreshold;
+  user.metric = userTemplate.metric;
+  users.push_back(user);
+
+  for (uint32_t i = 0; i < userTemplate.count; i++) {
+    auto offset = packedVecs.size();
+    packedVecs.insert(packedVecs.end(), userTemplate.getVector(i),
+                      userTemplate.getVector(i) + userTemplate.dims);
+    if (user.metric == COSINE_SIMILARITY) {
+      normalizeEmbedding(packedVecs.data() + offset, userTemplate.dims);
+    }
+    weights.push_back(userTemplate.weights[i]);
+  }
+}
+
+void trustid::image::impl::TemplateGallery::buildTemplates(
+    const std::vector<float>& packedVecs) {
+  const long count = static_cast<long>(weights.size());
+  templates.set_size(count, dims);
+  std::copy(packedVecs.begin(), packedVecs.end(), templates.begin());
+  templateSquaredNorms = dlib::sum_cols(dlib::squared(templates));
+}
+
+size_t trustid::image::impl::TemplateGallery::getUserCount() const {
+  return users.size();
+}
+
+long trustid::image::impl::TemplateGallery::getTemplateCount() const {
+  return templates.nr();
+}
+
+template <typename Callback>
+void trustid::image::impl::TemplateGallery::forEachProbeBlock(
+    const dlib::matrix<float>& probes, long begin, long end,
+    Callback callback) const {
+  if (probes.nr() > 0 && probes.nc() != dims) {
+    throw std::invalid_argument(
+        "Probe embedding size does not match the gallery");
+  }
+
+  // keep the plain matrix when using the whole gallery, so the product is
+  // dispatched to BLAS without copying the templates
+  dlib::matrix<float> templateSubset;
+  const dlib::matrix<float>* galleryTemplates = &templates;
+  if (begin != 0 || end != templates.nr()) {
+    templateSubset = dlib::subm(templates, begin, 0, end - begin, dims);
+    galleryTemplates = &templateSubset;
+  }
+
+  // the blocks write to disjoint rows of the results, so they run in parallel
+  const long blockCount = (probes.nr() + kProbeBlockSize - 1) / kProbeBlockSize;
+  getDefaultExecutor()->parallelFor(0, blockCount, [&](size_t block) {
+    const long row = static_cast<long>(block) * kProbeBlockSize;
+    const long rows = std::min(kProbeBlockSize, probes.nr() - row);
+    dlib::matrix<float> probeBlock = dlib::subm(probes, row, 0, rows, dims);
+    dlib::matrix<float> dots = probeBlock * dlib::trans(*galleryTemplates);
+    dlib::matrix<float, 0, 1> probeSquaredNorms =
+        dlib::sum_cols(dlib::squared(probeBlock));
+    callback(row, dots, probeSquaredNorms);
+  });
+}
+
+float trustid::image::impl::TemplateGallery::vote(const UserEntry& user,
+                                                  const float* dots,
+                                                  float squaredNorm) const {
+  float votes = 0;
+  if (user.metric == COSINE_SIMILARITY) {
+    // the templates are normalized, so only the probe norm is left
+    const float invNorm = squaredNorm > 0 ? 1.0f / std::sqrt(squaredNorm) : 0;
+    for (long j = 0; j < user.end - user.begin; j++) {
+      if (dots[j] * invNorm > user.similarityThreshold) {
+        votes += weights[user.begin + j];
+      }
+    }
+  } else {
+    for (long j = 0; j < user.end - user.begin; j++) {
+      float squaredDistance =
+          squaredNorm + templateSquaredNorms(user.begin + j) - 2 * dots[j];
+      if (squaredDistance < user.squaredDistanceThreshold) {
+        votes += weights[user.begin + j];
+      }
+    }
+  }
+  // users without templates (or with zero weights) never match
+  return user.totalWeight > 0 ? votes / user.totalWeight : 0;
+}
+
+dlib::matrix<float>
+trustid::image::impl::TemplateGallery::computeSquaredDistances(
+    const dlib::matrix<float>& probes) const {
+  dlib::matrix<float> squaredDistances(probes.nr(), templates.nr());
+  forEachProbeBlock(
+      probes, 0, templates.nr(),
+      [&](long row, const dlib::matrix<float>& dots,
+          const dlib::matrix<float, 0, 1>& probeSquaredNorms) {
+        for (long i = 0; i < dots.nr(); i++) {
+          for (long j = 0; j < dots.nc(); j++) {
+            // clamp the rounding errors of the expanded form
+            squaredDistances(row + i, j) = std::max(
+                0.0f, probeSquaredNorms(i) + templateSquaredNorms(j) -
+                          2 * dots(i, j));
+          }
+        }
+      });
+  return squaredDistances;
+}
+
+dlib::matrix<float> trustid::image::impl::TemplateGallery::scoreEmbeddings(
+    const dlib::matrix<float>& probes) const {
+  dlib::matrix<float> scores(probes.nr(), static_cast<long>(users.size()));
+  forEachProbeBlock(
+      probes, 0, templates.nr(),
+      [&](long row, const dlib::matrix<float>& dots,
+          const dlib::matrix<float, 0, 1>& probeSquaredNorms) {
+        for (long i = 0; i < dots.nr(); i++) {
+          for (size_t u = 0; u < users.size(); u++) {
+            const float* userDots =
+                users[u].end > users[u].begin ? &dots(i, users[u].begin)
+                                              : nullptr;
+            scores(row + i, u) =
+                vote(users[u], userDots, probeSquaredNorms(i));
+          }
+        }
+      });
+  return scores;
+}
+
+std::vector<trustid::image::FaceVerificationResult>
+trustid::image::impl::TemplateGallery::verifyEmbeddings(
+    const dlib::matrix<float>& probes,
+    const std::vector<size_t>& claimedUsers) const {
+  if (claimedUsers.size() != static_cast<size_t>(probes.nr())) {
+    throw std::invalid_argument("Expected one claimed user per probe");
+  }
+
+  // group the probes by claimed user, so each user is scored with a single
+  // product against its own templates instead of the whole gallery
+  std::vector<std::vector<long>> probesPerUser(users.size());
+  for (long i = 0; i < probes.nr(); i++) {
+    if (claimedUsers[i] >= users.size()) {
+      throw std::out_of_range("Invalid claimed user index");
+    }
+    probesPerUser[claimedUsers[i]].push_back(i);
+  }
+
+  // users write to the confidences of disjoint probes, so they run in parallel
+  std::vector<float> confidences(probes.nr(), 0.0f);
+  getDefaultExecutor()->parallelFor(0, users.size(), [&](size_t u) {
+    const auto& probeRows = probesPerUser[u];
+    if (probeRows.empty()) {
+      return;
+    }
+    dlib::matrix<float> userProbes;
+    userProbes.set_size(static_cast<long>(probeRows.size()), probes.nc());
+    for (size_t i = 0; i < probeRows.size(); i++) {
+      dlib::set_rowm(userProbes, static_cast<long>(i)) =
+          dlib::rowm(probes, probeRows[i]);
+    }
+
+    forEachProbeBlock(
+        userProbes, users[u].begin, users[u].end,
+        [&](long row, const dlib::matrix<float>& dots,
+            const dlib::matrix<float, 0, 1>& probeSquaredNorms) {
+          for (long i = 0; i < dots.nr(); i++) {
+            const float* userDots = dots.nc() > 0 ? &dots(i, 0) : nullptr;
+            confidences[probeRows[row + i]] =
+                vote(users[u], userDots, probeSquaredNorms(i));
+          }
+        });
+  });
+
+  std::vector<FaceVerificationResult> results;
+  results.reserve(confidences.size());
+  for (size_t i = 0; i < confidences.size(); i++) {
+    const auto& user = users[claimedUsers[i]];
+    results.push_back(FaceVerificationResult(
+        FaceDetectionResultEntry(), confidences[i],
+        confidences[i] > user.votingThreshold ? SAME_USER : DIFFERENT_USER));
+  }
+  return results;
+}
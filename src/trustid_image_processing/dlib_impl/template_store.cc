@@ -0,0 +1,584 @@
+#include "trustid_image_processing/dlib_impl/template_store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+constexpr char kStoreMagic[8] = {'T', 'I', 'D', 'T', 'P', 'L', 'S', 'T'};
+constexpr uint32_t kStoreVersion = 1;
+constexpr uint32_t kByteOrderMark = 0x01020304;
+constexpr uint64_t kHeaderSize = 4096;
+constexpr uint64_t kRecordAlignment = 64;
+constexpr uint64_t kMinIndexCapacity = 16;
+constexpr uint64_t kMinRecordCapacity = 64;
+
+// index slots hold the record index + 1, so zero marks an empty slot
+constexpr uint64_t kEmptySlot = 0;
+constexpr uint64_t kDeletedSlot = std::numeric_limits<uint64_t>::max();
+
+constexpr uint32_t kTombstoneFlag = 1;
+constexpr uint32_t kCosineSimilarityFlag = 2;
+
+struct StoreHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrderMark;
+  uint32_t dims;
+  uint32_t maxVectors;
+  uint64_t recordSize;
+  uint64_t weightsOffset;  // offset of the weights within a record
+  uint64_t vectorsOffset;  // offset of the vectors within a record
+  uint64_t indexOffset;
+  uint64_t indexCapacity;  // always a power of two
+  uint64_t indexUsed;      // slots that are either live or deleted
+  uint64_t recordsOffset;
+  uint64_t recordCapacity;
+  uint64_t recordCount;  // records written, including tombstones
+  uint64_t liveCount;
+};
+static_assert(sizeof(StoreHeader) <= kHeaderSize, "Store header too big");
+
+struct IndexEntry {
+  uint64_t hash;
+  uint64_t record;
+};
+
+struct RecordHeader {
+  char userId[trustid::image::impl::TemplateStore::kMaxUserIdLength + 1];
+  uint32_t flags;
+  uint32_t count;
+  float distanceThreshold;
+  float votingThreshold;
+};
+
+uint64_t alignTo(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+uint64_t nextPowerOfTwo(uint64_t value) {
+  uint64_t result = 1;
+  while (result < value) {
+    result <<= 1;
+  }
+  return result;
+}
+
+// FNV-1a hash of the user id
+uint64_t hashUserId(std::string_view userId) {
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : userId) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+StoreHeader* getHeader(char* data) {
+  return reinterpret_cast<StoreHeader*>(data);
+}
+
+IndexEntry* getIndex(char* data) {
+  return reinterpret_cast<IndexEntry*>(data + getHeader(data)->indexOffset);
+}
+
+char* getRecord(char* data, uint64_t recordIdx) {
+  auto header = getHeader(data);
+  return data + header->recordsOffset + recordIdx * header->recordSize;
+}
+
+RecordHeader* getRecordHeader(char* data, uint64_t recordIdx) {
+  return reinterpret_cast<RecordHeader*>(getRecord(data, recordIdx));
+}
+
+uint64_t getFileSize(const StoreHeader& header) {
+  return header.recordsOffset + header.recordCapacity * header.recordSize;
+}
+
+// Computes the layout of a store with the given dimensions and capacity.
+StoreHeader makeHeader(uint32_t dims, uint32_t maxVectors,
+                       uint64_t indexCapacity, uint64_t recordCapacity) {
+  StoreHeader header = {};
+  std::memcpy(header.magic, kStoreMagic, sizeof(kStoreMagic));
+  header.version = kStoreVersion;
+  header.byteOrderMark = kByteOrderMark;
+  header.dims = dims;
+  header.maxVectors = maxVectors;
+  header.weightsOffset = alignTo(sizeof(RecordHeader), kRecordAlignment);
+  header.vectorsOffset = alignTo(
+      header.weightsOffset + maxVectors * sizeof(float), kRecordAlignment);
+  header.recordSize =
+      alignTo(header.vectorsOffset + uint64_t(maxVectors) * dims * sizeof(float),
+              kRecordAlignment);
+  header.indexOffset = kHeaderSize;
+  header.indexCapacity =
+      nextPowerOfTwo(std::max(indexCapacity, kMinIndexCapacity));
+  header.recordsOffset =
+      alignTo(header.indexOffset + header.indexCapacity * sizeof(IndexEntry),
+              kHeaderSize);
+  header.recordCapacity = std::max(recordCapacity, kMinRecordCapacity);
+  return header;
+}
+
+// Inserts the given record in the hash index, using linear probing.
+void insertIntoIndex(char* data, uint64_t hash, uint64_t recordIdx) {
+  auto header = getHeader(data);
+  auto index = getIndex(data);
+  const uint64_t mask = header->indexCapacity - 1;
+  for (uint64_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    if (index[slot].record == kEmptySlot ||
+        index[slot].record == kDeletedSlot) {
+      if (index[slot].record == kEmptySlot) {
+        header->indexUsed++;
+      }
+      index[slot].hash = hash;
+      index[slot].record = recordIdx + 1;
+      return;
+    }
+  }
+}
+}  // namespace
+
+/**
+ * Platform specific handling of the memory-mapped file.
+ */
+struct trustid::image::impl::TemplateStore::MappedFile {
+  MappedFile(const std::string& pathToFile, bool readOnly, bool create)
+      : readOnly(readOnly) {
+#ifdef _WIN32
+    file = CreateFileA(pathToFile.c_str(),
+                       GENERIC_READ | (readOnly ? 0 : GENERIC_WRITE),
+                       FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                       create ? CREATE_ALWAYS : OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      throw std::runtime_error("Could not open template store " + pathToFile);
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    size = static_cast<uint64_t>(fileSize.QuadPart);
+#else
+    int flags = readOnly ? O_RDONLY : O_RDWR;
+    if (create) {
+      flags |= O_CREAT | O_TRUNC;
+    }
+    fd = ::open(pathToFile.c_str(), flags, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("Could not open template store " + pathToFile);
+    }
+    struct stat fileStat;
+    fstat(fd, &fileStat);
+    size = static_cast<uint64_t>(fileStat.st_size);
+#endif
+    try {
+      map();
+    } catch (...) {
+      // the destructor doesn't run for a partially constructed object
+      closeFile();
+      throw;
+    }
+  }
+
+  ~MappedFile() {
+    unmap();
+    closeFile();
+  }
+
+  // Resizes the file and maps it again, invalidating the previous mapping.
+  void resize(uint64_t newSize) {
+    unmap();
+#ifdef _WIN32
+    LARGE_INTEGER fileSize;
+    fileSize.QuadPart = static_cast<LONGLONG>(newSize);
+    if (!SetFilePointerEx(file, fileSize, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(file)) {
+      throw std::runtime_error("Could not resize template store");
+    }
+#else
+    if (ftruncate(fd, static_cast<off_t>(newSize)) != 0) {
+      throw std::runtime_error("Could not resize template store");
+    }
+#endif
+    size = newSize;
+    map();
+  }
+
+  void flush() {
+    if (data == nullptr || readOnly) {
+      return;
+    }
+#ifdef _WIN32
+    FlushViewOfFile(data, 0);
+    FlushFileBuffers(file);
+#else
+    msync(data, size, MS_SYNC);
+#endif
+  }
+
+  char* data = nullptr;
+  uint64_t size = 0;
+
+ private:
+  void map() {
+    if (size == 0) {
+      return;
+    }
+#ifdef _WIN32
+    mapping = CreateFileMappingA(file, NULL,
+                                 readOnly ? PAGE_READONLY : PAGE_READWRITE,
+                                 static_cast<DWORD>(size >> 32),
+                                 static_cast<DWORD>(size & 0xFFFFFFFF), NULL);
+    if (mapping != NULL) {
+      data = static_cast<char*>(MapViewOfFile(
+          mapping, readOnly ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, 0));
+    }
+    if (data == nullptr) {
+      if (mapping != NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+      }
+      throw std::runtime_error("Could not map template store");
+    }
+#else
+    void* address = mmap(nullptr, size,
+                         PROT_READ | (readOnly ? 0 : PROT_WRITE), MAP_SHARED,
+                         fd, 0);
+    if (address == MAP_FAILED) {
+      throw std::runtime_error("Could not map template store");
+    }
+    data = static_cast<char*>(address);
+#endif
+  }
+
+  void closeFile() {
+#ifdef _WIN32
+    CloseHandle(file);
+#else
+    ::close(fd);
+#endif
+  }
+
+  void unmap() {
+    if (data == nullptr) {
+      return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle(mapping);
+    mapping = NULL;
+#else
+    munmap(data, size);
+#endif
+    data = nullptr;
+  }
+
+  bool readOnly;
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#else
+  int fd = -1;
+#endif
+};
+
+trustid::image::impl::TemplateStore::TemplateStore(
+    const std::string& pathToFile, bool readOnly)
+    : pathToFile(pathToFile), readOnly(readOnly) {
+  open();
+}
+
+trustid::image::impl::TemplateStore::~TemplateStore() {
+  if (file != nullptr) {
+    file->flush();
+  }
+}
+
+void trustid::image::impl::TemplateStore::create(const std::string& pathToFile,
+                                                 uint32_t dims,
+                                                 uint32_t maxVectors,
+                                                 uint64_t indexCapacity) {
+  if (dims == 0 || maxVectors == 0) {
+    throw std::invalid_argument("Invalid template store dimensions");
+  }
+  auto header = makeHeader(dims, maxVectors, indexCapacity, 0);
+  MappedFile newFile(pathToFile, false, true);
+  newFile.resize(getFileSize(header));
+  std::memcpy(newFile.data, &header, sizeof(header));
+  newFile.flush();
+}
+
+void trustid::image::impl::TemplateStore::open() {
+  file = std::make_unique<MappedFile>(pathToFile, readOnly, false);
+
+  // validate the header before trusting any offsets in it
+  if (file->size < kHeaderSize) {
+    throw std::runtime_error("Invalid template store " + pathToFile);
+  }
+  auto header = getHeader(file->data);
+  if (std::memcmp(header->magic, kStoreMagic, sizeof(kStoreMagic)) != 0 ||
+      header->byteOrderMark != kByteOrderMark) {
+    throw std::runtime_error("Invalid template store " + pathToFile);
+  }
+  if (header->version != kStoreVersion) {
+    throw std::runtime_error("Unsupported template store version");
+  }
+  // the layout must be the one create() and rewrite() compute
+  if (header->dims == 0 || header->maxVectors == 0 ||
+      header->indexCapacity < kMinIndexCapacity ||
+      (header->indexCapacity & (header->indexCapacity - 1)) != 0) {
+    throw std::runtime_error("Corrupted template store header " + pathToFile);
+  }
+  const auto expectedLayout = makeHeader(header->dims, header->maxVectors,
+                                         header->indexCapacity,
+                                         header->recordCapacity);
+  if (header->recordSize != expectedLayout.recordSize ||
+      header->weightsOffset != expectedLayout.weightsOffset ||
+      header->vectorsOffset != expectedLayout.vectorsOffset ||
+      header->indexOffset != expectedLayout.indexOffset ||
+      header->indexCapacity != expectedLayout.indexCapacity ||
+      header->recordsOffset != expectedLayout.recordsOffset ||
+      header->recordCount > header->recordCapacity ||
+      header->liveCount > header->recordCount) {
+    throw std::runtime_error("Corrupted template store header " + pathToFile);
+  }
+  // checked without overflowing on corrupted capacities
+  if (file->size < header->recordsOffset ||
+      (file->size - header->recordsOffset) / header->recordSize <
+          header->recordCapacity) {
+    throw std::runtime_error("Truncated template store " + pathToFile);
+  }
+}
+
+uint64_t trustid::image::impl::TemplateStore::findSlot(
+    std::string_view userId) const {
+  auto header = getHeader(file->data);
+  auto index = getIndex(file->data);
+  const uint64_t hash = hashUserId(userId);
+  const uint64_t mask = header->indexCapacity - 1;
+  if (userId.size() > kMaxUserIdLength) {
+    return header->indexCapacity;
+  }
+
+  for (uint64_t slot = hash & mask, probes = 0; probes < header->indexCapacity;
+       slot = (slot + 1) & mask, probes++) {
+    const auto& entry = index[slot];
+    if (entry.record == kEmptySlot) {
+      break;
+    }
+    if (entry.record != kDeletedSlot && entry.hash == hash) {
+      if (entry.record > header->recordCount) {
+        throw std::runtime_error("Corrupted template store index");
+      }
+      // check for hash collisions
+      auto record = getRecordHeader(file->data, entry.record - 1);
+      if (std::memcmp(record->userId, userId.data(), userId.size()) == 0 &&
+          record->userId[userId.size()] == '\0') {
+        return slot;
+      }
+    }
+  }
+  return header->indexCapacity;
+}
+
+bool trustid::image::impl::TemplateStore::contains(
+    std::string_view userId) const {
+  return findSlot(userId) < getHeader(file->data)->indexCapacity;
+}
+
+trustid::image::impl::UserTemplateView
+trustid::image::impl::TemplateStore::getUser(std::string_view userId) const {
+  auto header = getHeader(file->data);
+  auto slot = findSlot(userId);
+  if (slot >= header->indexCapacity) {
+    throw std::runtime_error("User not found in template store");
+  }
+
+  const uint64_t recordIdx = getIndex(file->data)[slot].record - 1;
+  char* record = getRecord(file->data, recordIdx);
+  auto recordHeader = reinterpret_cast<const RecordHeader*>(record);
+  if (recordHeader->count > header->maxVectors) {
+    throw std::runtime_error("Corrupted template store record");
+  }
+
+  UserTemplateView view;
+  view.vectors = reinterpret_cast<const float*>(record + header->vectorsOffset);
+  view.weights = reinterpret_cast<const float*>(record + header->weightsOffset);
+  view.count = recordHeader->count;
+  view.dims = header->dims;
+  view.distanceThreshold = recordHeader->distanceThreshold;
+  view.votingThreshold = recordHeader->votingThreshold;
+  view.metric = (recordHeader->flags & kCosineSimilarityFlag)
+                    ? COSINE_SIMILARITY
+                    : EUCLIDEAN_DISTANCE;
+  return view;
+}
+
+void trustid::image::impl::TemplateStore::append(
+    std::string_view userId, const DlibFaceVerificatorModelParams& userParams) {
+  if (readOnly) {
+    throw std::runtime_error("Template store was opened as read-only");
+  }
+  if (userId.empty() || userId.size() > kMaxUserIdLength) {
+    throw std::invalid_argument("Invalid user id length");
+  }
+  auto header = getHeader(file->data);
+  if (userParams.groundTruthVecs.size() > header->maxVectors) {
+    throw std::invalid_argument(
+        "User model has more vectors than the store supports, reduce it "
+        "with compressUserParams first");
+  }
+  for (auto& groundTruthVec : userParams.groundTruthVecs) {
+    if (static_cast<uint32_t>(groundTruthVec.size()) != header->dims) {
+      throw std::invalid_argument(
+          "Embedding size does not match the template store");
+    }
+  }
+
+  // replacing a user leaves a tombstone behind
+  if (contains(userId)) {
+    remove(userId);
+  }
+
+  // keep the index load factor under 70%, rebuilding it if needed
+  if ((header->indexUsed + 1) * 10 > header->indexCapacity * 7) {
+    rewrite(std::max(header->indexCapacity, (header->liveCount + 1) * 4),
+            std::max(header->recordCapacity, header->liveCount + 1));
+    header = getHeader(file->data);
+  }
+
+  // grow the record area, which sits at the end of the file
+  if (header->recordCount == header->recordCapacity) {
+    const uint64_t newCapacity = header->recordCapacity * 2;
+    file->resize(header->recordsOffset + newCapacity * header->recordSize);
+    header = getHeader(file->data);
+    header->recordCapacity = newCapacity;
+  }
+
+  // write the record
+  const uint64_t recordIdx = header->recordCount;
+  char* record = getRecord(file->data, recordIdx);
+  std::memset(record, 0, header->recordSize);
+  auto recordHeader = reinterpret_cast<RecordHeader*>(record);
+  std::memcpy(recordHeader->userId, userId.data(), userId.size());
+  recordHeader->count =
+      static_cast<uint32_t>(userParams.groundTruthVecs.size());
+  recordHeader->distanceThreshold = userParams.distanceThreshold;
+  recordHeader->votingThreshold = userParams.votingThreshold;
+  if (userParams.metric == COSINE_SIMILARITY) {
+    recordHeader->flags |= kCosineSimilarityFlag;
+  }
+
+  auto weights = reinterpret_cast<float*>(record + header->weightsOffset);
+  auto vectors = reinterpret_cast<float*>(record + header->vectorsOffset);
+  for (size_t i = 0; i < userParams.groundTruthVecs.size(); i++) {
+    weights[i] = userParams.getWeight(i);
+    std::copy(userParams.groundTruthVecs[i].begin(),
+              userParams.groundTruthVecs[i].end(), vectors + i * header->dims);
+    if (userParams.metric == COSINE_SIMILARITY) {
+      normalizeEmbedding(vectors + i * header->dims, header->dims);
+    }
+  }
+
+  insertIntoIndex(file->data, hashUserId(userId), recordIdx);
+  header->recordCount++;
+  header->liveCount++;
+}
+
+void trustid::image::impl::TemplateStore::remove(std::string_view userId) {
+  if (readOnly) {
+    throw std::runtime_error("Template store was opened as read-only");
+  }
+  auto header = getHeader(file->data);
+  auto slot = findSlot(userId);
+  if (slot >= header->indexCapacity) {
+    throw std::runtime_error("User not found in template store");
+  }
+
+  auto& entry = getIndex(file->data)[slot];
+  getRecordHeader(file->data, entry.record - 1)->flags |= kTombstoneFlag;
+  entry.record = kDeletedSlot;
+  header->liveCount--;
+}
+
+void trustid::image::impl::TemplateStore::compact() {
+  if (readOnly) {
+    throw std::runtime_error("Template store was opened as read-only");
+  }
+  auto header = getHeader(file->data);
+  rewrite(std::max(kMinIndexCapacity, header->liveCount * 2),
+          header->liveCount);
+}
+
+void trustid::image::impl::TemplateStore::rewrite(uint64_t indexCapacity,
+                                                  uint64_t recordCapacity) {
+  auto header = getHeader(file->data);
+  auto newHeader = makeHeader(header->dims, header->maxVectors, indexCapacity,
+                              recordCapacity);
+
+  // write the live records into a new file
+  const std::string newPathToFile = pathToFile + ".tmp";
+  {
+    MappedFile newFile(newPathToFile, false, true);
+    newFile.resize(getFileSize(newHeader));
+    std::memcpy(newFile.data, &newHeader, sizeof(newHeader));
+
+    uint64_t newRecordIdx = 0;
+    for (uint64_t recordIdx = 0; recordIdx < header->recordCount;
+         recordIdx++) {
+      auto record = getRecordHeader(file->data, recordIdx);
+      if (record->flags & kTombstoneFlag) {
+        continue;
+      }
+      std::memcpy(getRecord(newFile.data, newRecordIdx), record,
+                  header->recordSize);
+      insertIntoIndex(newFile.data, hashUserId(record->userId), newRecordIdx);
+      newRecordIdx++;
+    }
+    getHeader(newFile.data)->recordCount = newRecordIdx;
+    getHeader(newFile.data)->liveCount = newRecordIdx;
+    newFile.flush();
+  }
+
+  // replace the current file with the new one
+  file.reset();
+  std::filesystem::rename(newPathToFile, pathToFile);
+  open();
+}
+
+void trustid::image::impl::TemplateStore::flush() { file->flush(); }
+
+uint64_t trustid::image::impl::TemplateStore::size() const {
+  return getHeader(file->data)->liveCount;
+}
+
+uint64_t trustid::image::impl::TemplateStore::tombstoneCount() const {
+  auto header = getHeader(file->data);
+  return header->recordCount - header->liveCount;
+}
+
+uint32_t trustid::image::impl::TemplateStore::getDims() const {
+  return getHeader(file->data)->dims;
+}
+
+uint32_t trustid::image::impl::TemplateStore::getMaxVectors() const {
+  return getHeader(file->data)->maxVectors;
+}
+
+std::shared_ptr<trustid::image::impl::TemplateStore>
+trustid::image::impl::loadTemplateStoreFromDisk(std::string pathToFile,
+                                                bool readOnly) {
+  return std::make_shared<TemplateStore>(pathToFile, readOnly);
+}
@@ -0,0 +1,348 @@
+#include "trustid_image_processing/executor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <stdexcept>
+
+namespace {
+std::mutex defaultExecutorMutex;
+std::shared_ptr<trustid::image::Executor> defaultExecutor;
+unsigned defaultExecutorThreadCount = 0;
+
+// executor and worker index of the current thread, if it is a worker
+thread_local const trustid::image::Executor* currentExecutor = nullptr;
+thread_local size_t currentWorkerIdx = 0;
+
+// priority class of the tasks posted by the current thread
+thread_local trustid::image::TaskPriorityEnum currentPriority =
+    trustid::image::INTERACTIVE_PRIORITY;
+}  // namespace
+
+trustid::image::TaskPriorityScope::TaskPriorityScope(TaskPriorityEnum priority)
+    : previousPriority(currentPriority) {
+  currentPriority = priority;
+}
+
+trustid::image::TaskPriorityScope::~TaskPriorityScope() {
+  currentPriority = previousPriority;
+}
+
+trustid::image::TaskPriorityEnum trustid::image::getCurrentTaskPriority() {
+  return currentPriority;
+}
+
+trustid::image::Executor::Executor(unsigned threadCount) {
+  if (threadCount == 0) {
+    threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  workerCount = threadCount;
+  for (auto& pending : pendingTasksByPriority) {
+    pending = 0;
+  }
+  for (unsigned i = 0; i <= threadCount; i++) {
+    queues.push_back(std::make_unique<TaskQueue>());
+  }
+  for (unsigned i = 0; i < threadCount; i++) {
+    workers.emplace_back(&Executor::run, this, i);
+  }
+}
+
+trustid::image::Executor::~Executor() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    stopping = true;
+  }
+  taskAvailable.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void trustid::image::Executor::post(std::function<void()> task) {
+  const size_t queueIdx =
+      currentExecutor == this ? currentWorkerIdx : workerCount;
+  const TaskPriorityEnum priority = currentPriority;
+  {
+    std::lock_guard<std::mutex> lock(queues[queueIdx]->mutex);
+    queues[queueIdx]->tasks[priority].push_back(std::move(task));
+  }
+  pendingTasksByPriority[priority]++;
+  pendingTasks++;
+
+  // taking the lock orders the count update with a worker going to sleep
+  { std::lock_guard<std::mutex> lock(sleepMutex); }
+  taskAvailable.notify_one();
+}
+
+bool trustid::image::Executor::popTask(size_t workerIdx,
+                                       std::function<void()>& task,
+                                       TaskPriorityEnum& priority) {
+  const TaskPriorityEnum first =
+      isEnrollmentTurn() ? ENROLLMENT_PRIORITY : INTERACTIVE_PRIORITY;
+  const TaskPriorityEnum second = first == INTERACTIVE_PRIORITY
+                                      ? ENROLLMENT_PRIORITY
+                                      : INTERACTIVE_PRIORITY;
+  if (popTaskOfPriority(workerIdx, first, task)) {
+    priority = first;
+  } else if (popTaskOfPriority(workerIdx, second, task)) {
+    priority = second;
+  } else {
+    return false;
+  }
+  countDispatch(priority);
+  return true;
+}
+
+bool trustid::image::Executor::popTaskOfPriority(size_t workerIdx,
+                                                 TaskPriorityEnum priority,
+                                                 std::function<void()>& task) {
+  if (pendingTasksByPriority[priority] == 0) {
+    return false;
+  }
+  const size_t queueCount = queues.size();
+  const size_t injectionIdx = workerCount;
+
+  // newest task of the own queue
+  if (workerIdx != injectionIdx) {
+    auto& queue = *queues[workerIdx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    auto& tasks = queue.tasks[priority];
+    if (!tasks.empty()) {
+      task = std::move(tasks.back());
+      tasks.pop_back();
+      pendingTasksByPriority[priority]--;
+      pendingTasks--;
+      return true;
+    }
+  }
+
+  // oldest task of the injection queue, then of the other workers
+  for (size_t i = 0; i < queueCount; i++) {
+    const size_t victimIdx = (injectionIdx + i) % queueCount;
+    if (victimIdx == workerIdx && workerIdx != injectionIdx) {
+      continue;
+    }
+    auto& queue = *queues[victimIdx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    auto& tasks = queue.tasks[priority];
+    if (!tasks.empty()) {
+      task = std::move(tasks.front());
+      tasks.pop_front();
+      pendingTasksByPriority[priority]--;
+      pendingTasks--;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool trustid::image::Executor::isEnrollmentTurn() const {
+  return interactiveStreak >= maxInteractiveStreak;
+}
+
+void trustid::image::Executor::countDispatch(TaskPriorityEnum priority) {
+  if (priority == ENROLLMENT_PRIORITY) {
+    interactiveStreak = 0;
+  } else if (pendingTasksByPriority[ENROLLMENT_PRIORITY] > 0) {
+    // only interactive tasks that overtook enrollment work count against
+    // the enrollment share
+    interactiveStreak++;
+  }
+}
+
+bool trustid::image::Executor::shouldYieldToInteractive() const {
+  return currentExecutor == this && currentPriority == ENROLLMENT_PRIORITY &&
+         pendingTasksByPriority[INTERACTIVE_PRIORITY] > 0 &&
+         !isEnrollmentTurn();
+}
+
+void trustid::image::Executor::setMinimumEnrollmentShare(double share) {
+  if (!(share > 0 && share <= 1)) {
+    throw std::invalid_argument("The enrollment share must be in (0, 1]");
+  }
+  // at most 1 / share - 1 interactive tasks before each enrollment one
+  maxInteractiveStreak =
+      static_cast<unsigned>(std::floor(1 / share + 1e-9)) - 1;
+}
+
+void trustid::image::Executor::run(size_t workerIdx) {
+  currentExecutor = this;
+  currentWorkerIdx = workerIdx;
+  std::function<void()> task;
+  TaskPriorityEnum priority;
+  while (true) {
+    if (popTask(workerIdx, task, priority)) {
+      TaskPriorityScope scope(priority);
+      task();
+      task = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    taskAvailable.wait(lock, [this] { return stopping || pendingTasks > 0; });
+    if (stopping && pendingTasks == 0) {
+      return;
+    }
+  }
+}
+
+struct trustid::image::Executor::ParallelForState {
+  std::atomic<size_t> next;
+  size_t end;
+  // only called for claimed iterations, which the caller waits for
+  const std::function<void(size_t)>* body;
+  std::atomic<size_t> runningHelpers{0};
+  std::mutex mutex;
+  std::condition_variable done;
+  std::exception_ptr exception;
+};
+
+bool trustid::image::Executor::claimIterations(ParallelForState& state,
+                                               bool canYield) {
+  // every participant claims the next index until none is left, which
+  // balances uneven iterations without choosing a chunk size
+  size_t i;
+  while (true) {
+    if (canYield && shouldYieldToInteractive()) {
+      return false;
+    }
+    if ((i = state.next++) >= state.end) {
+      return true;
+    }
+    try {
+      (*state.body)(i);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(state.mutex);
+      if (!state.exception) {
+        state.exception = std::current_exception();
+      }
+      state.next = state.end;
+    }
+  }
+}
+
+void trustid::image::Executor::runParallelForHelper(
+    const std::shared_ptr<ParallelForState>& state) {
+  // counted before claiming, so the caller waits for any claimed iteration
+  state->runningHelpers++;
+  if (!claimIterations(*state, true) && state->next < state->end) {
+    // queued behind the interactive tasks, at the enrollment priority
+    post([this, state]() { runParallelForHelper(state); });
+  }
+  if (--state->runningHelpers == 0) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->done.notify_all();
+  }
+}
+
+void trustid::image::Executor::parallelFor(
+    size_t begin, size_t end, const std::function<void(size_t)>& body) {
+  if (begin >= end) {
+    return;
+  }
+
+  auto state = std::make_shared<ParallelForState>();
+  state->next = begin;
+  state->end = end;
+  state->body = &body;
+
+  const size_t helperCount = std::min<size_t>(workerCount, end - begin - 1);
+  for (size_t i = 0; i < helperCount; i++) {
+    post([this, state]() { runParallelForHelper(state); });
+  }
+
+  // the caller can't hand its thread back, so it never yields
+  claimIterations(*state, false);
+
+  // every index is claimed, so only wait for the helpers running one. Helpers
+  // that start later find nothing left, and the caller doesn't run unrelated
+  // tasks while it waits.
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done.wait(lock, [&state] { return state->runningHelpers == 0; });
+  }
+  if (state->exception) {
+    std::rethrow_exception(state->exception);
+  }
+}
+
+unsigned trustid::image::Executor::getThreadCount() const {
+  return static_cast<unsigned>(workerCount);
+}
+
+struct trustid::image::Strand::State {
+  // resolved on the first post, so creating a strand doesn't start the shared
+  // executor
+  std::shared_ptr<Executor> executor;
+  std::mutex mutex;
+  std::deque<std::pair<std::function<void()>, TaskPriorityEnum>> tasks;
+  bool scheduled = false;  // whether a task of the strand is on the executor
+
+  // Queues the task at the front of the strand on the executor, with its
+  // priority class.
+  static void schedule(const std::shared_ptr<State>& state,
+                       TaskPriorityEnum priority) {
+    TaskPriorityScope priorityScope(priority);
+    state->executor->post([state]() { runNext(state); });
+  }
+
+  // Runs the task at the front of the strand, then schedules the next one.
+  static void runNext(const std::shared_ptr<State>& state) {
+    std::function<void()> task;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      task = std::move(state->tasks.front().first);
+      state->tasks.pop_front();
+    }
+    task();
+
+    TaskPriorityEnum priority;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (state->tasks.empty()) {
+        state->scheduled = false;
+        return;
+      }
+      priority = state->tasks.front().second;
+    }
+    schedule(state, priority);
+  }
+};
+
+trustid::image::Strand::Strand(std::shared_ptr<Executor> executor)
+    : state(std::make_shared<State>()) {
+  state->executor = executor;
+}
+
+void trustid::image::Strand::post(std::function<void()> task) {
+  const TaskPriorityEnum priority = getCurrentTaskPriority();
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->tasks.emplace_back(std::move(task), priority);
+    if (state->scheduled) {
+      return;
+    }
+    state->scheduled = true;
+    if (!state->executor) {
+      state->executor = getDefaultExecutor();
+    }
+  }
+  State::schedule(state, priority);
+}
+
+std::shared_ptr<trustid::image::Executor> trustid::image::getDefaultExecutor() {
+  std::lock_guard<std::mutex> lock(defaultExecutorMutex);
+  if (!defaultExecutor) {
+    defaultExecutor = std::make_shared<Executor>(defaultExecutorThreadCount);
+  }
+  return defaultExecutor;
+}
+
+void trustid::image::setDefaultExecutorThreadCount(unsigned threadCount) {
+  std::lock_guard<std::mutex> lock(defaultExecutorMutex);
+  if (defaultExecutor) {
+    throw std::logic_error("The default executor is already running");
+  }
+  defaultExecutorThreadCount = threadCount;
+}
@@ -4,11 +4,130 @@
 
 #include <algorithm>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "trustid_image_processing/executor.h"
+#include "trustid_image_processing/mat_pool.h"
+#include "trustid_image_processing/utils.h"
+
+namespace {
+// Serialization format versions of results and entries: version 1 stores the
+// image raw (the former dlib default serialization layout), version 2 stores
+// it encoded.
+const int rawImageVersion = 1;
+const int encodedImageVersion = 2;
+
+// Whether the given image can be stored (losslessly, apart from the codec
+// compression) with the given encoding.
+bool canEncode(const cv::Mat& image,
+               trustid::image::ImageEncodingEnum encoding) {
+  if (image.empty() || image.dims != 2) {
+    return false;
+  }
+  const int depth = image.depth();
+  const int channels = image.channels();
+  switch (encoding) {
+    case trustid::image::JPEG_IMAGE:
+      return depth == CV_8U && (channels == 1 || channels == 3);
+    case trustid::image::PNG_IMAGE:
+      return (depth == CV_8U || depth == CV_16U) &&
+             (channels == 1 || channels == 3 || channels == 4);
+    case trustid::image::WEBP_IMAGE:
+      return depth == CV_8U && (channels == 3 || channels == 4);
+    default:
+      return false;
+  }
+}
+
+// Writes the given image encoded as set by the options, along with its size
+// and type to check the decoded image against.
+void serializeEncodedImage(
+    const cv::Mat& image,
+    const trustid::image::ImageSerializationOptions& options,
+    std::ostream& out) {
+  std::string extension;
+  std::vector<int> params;
+  switch (options.encoding) {
+    case trustid::image::JPEG_IMAGE:
+      extension = ".jpg";
+      params = {cv::IMWRITE_JPEG_QUALITY, options.quality};
+      break;
+    case trustid::image::PNG_IMAGE:
+      extension = ".png";
+      params = {cv::IMWRITE_PNG_COMPRESSION,
+                std::max(0, std::min(options.quality, 9))};
+      break;
+    case trustid::image::WEBP_IMAGE:
+      extension = ".webp";
+      params = {cv::IMWRITE_WEBP_QUALITY, options.quality};
+      break;
+    default:
+      throw dlib::serialization_error("Unknown image encoding");
+  }
+  std::vector<unsigned char> bytes;
+  if (!cv::imencode(extension, image, bytes, params)) {
+    throw dlib::serialization_error("Could not encode the image as " +
+                                    extension);
+  }
+  dlib::serialize(static_cast<int>(options.encoding), out);
+  dlib::serialize(image.type(), out);
+  dlib::serialize(image.rows, out);
+  dlib::serialize(image.cols, out);
+  dlib::serialize(bytes, out);
+}
+
+// Returns the imread flag decoding color images at 1/reductionFactor scale.
+int getReducedReadFlag(int reductionFactor) {
+  switch (reductionFactor) {
+    case 1:
+      return cv::IMREAD_COLOR;
+    case 2:
+      return cv::IMREAD_REDUCED_COLOR_2;
+    case 4:
+      return cv::IMREAD_REDUCED_COLOR_4;
+    case 8:
+      return cv::IMREAD_REDUCED_COLOR_8;
+    default:
+      throw std::invalid_argument("The reduction factor must be 1, 2, 4 or 8");
+  }
+}
+
+// Decodes the given image into a pooled buffer.
+cv::Mat decodeImage(const std::vector<unsigned char>& encodedImage,
+                    int flags) {
+  cv::Mat image = trustid::image::pooledMat();
+  cv::imdecode(encodedImage, flags, &image);
+  if (image.empty()) {
+    throw std::runtime_error("Could not decode the image");
+  }
+  return image;
+}
+
+// Moves the boxes of a detection on a preprocessed image back to the original
+// image, which the returned result then holds.
+trustid::image::FaceDetectionResult mapToOriginalImage(
+    const trustid::image::FaceDetectionResult& result, const cv::Mat original,
+    const cv::Matx23d& transform) {
+  const cv::Matx23d inverse =
+      trustid::image::utils::invertTransform(transform);
+  auto boundingBoxes = result.getBoundingBoxes();
+  for (auto& boundingBox : boundingBoxes) {
+    boundingBox.boundingBox =
+        trustid::image::utils::transformRect(boundingBox.boundingBox, inverse);
+  }
+  return trustid::image::FaceDetectionResult(original, boundingBoxes,
+                                             result.getResult());
+}
+}  // namespace
+
 void trustid::image::serialize(const FaceDetectionResultValueEnum& item,
                                std::ostream& out) {
   dlib::serialize(static_cast<int>(item), out);
@@ -20,15 +139,72 @@ void trustid::image::deserialize(FaceDetectionResultValueEnum& item,
   dlib::deserialize(value, in);
   item = static_cast<FaceDetectionResultValueEnum>(value);
 }
+
+struct trustid::image::EncodedImage {
+  int type;
+  int rows;
+  int cols;
+  std::vector<unsigned char> bytes;
+  std::once_flag decodeFlag;
+  cv::Mat image;
+
+  // Reads an image written by serializeEncodedImage.
+  static std::shared_ptr<EncodedImage> deserialize(std::istream& in) {
+    auto encodedImage = std::make_shared<EncodedImage>();
+    int encoding;
+    dlib::deserialize(encoding, in);
+    dlib::deserialize(encodedImage->type, in);
+    dlib::deserialize(encodedImage->rows, in);
+    dlib::deserialize(encodedImage->cols, in);
+    dlib::deserialize(encodedImage->bytes, in);
+    return encodedImage;
+  }
+
+  // Returns the decoded image, decoding it on the first call.
+  cv::Mat decode() {
+    std::call_once(decodeFlag, [this]() {
+      cv::Mat decoded = pooledMat();
+      cv::imdecode(bytes, cv::IMREAD_UNCHANGED, &decoded);
+      if (decoded.rows != rows || decoded.cols != cols ||
+          decoded.type() != type) {
+        throw std::runtime_error("Could not decode the serialized image");
+      }
+      image = decoded;
+      std::vector<unsigned char>().swap(bytes);
+    });
+    return image;
+  }
+};
+
+void trustid::image::serialize(const FaceDetectionResultEntry& item,
+                               std::ostream& out,
+                               const ImageSerializationOptions& options) {
+  item.serialize_to(out, options);
+}
+
+void trustid::image::deserialize(FaceDetectionResultEntry& item,
+                                 std::istream& in) {
+  item.deserialize_from(in);
+}
+
+void trustid::image::serialize(const FaceDetectionResult& item,
+                               std::ostream& out,
+                               const ImageSerializationOptions& options) {
+  item.serialize_to(out, options);
+}
+
+void trustid::image::deserialize(FaceDetectionResult& item, std::istream& in) {
+  item.deserialize_from(in);
+}
 trustid::image::FaceDetectionResultEntry::FaceDetectionResultEntry(){}
 
 trustid::image::FaceDetectionResultEntry::FaceDetectionResultEntry(
     cv::Mat image,
     trustid::image::FaceDetectionConfidenceBoundingBox detectionBoundingbox)
-    : detectionBoundingbox(detectionBoundingbox), image(image.clone()) {}
+    : detectionBoundingbox(detectionBoundingbox), image(pooledClone(image)) {}
 
 cv::Mat trustid::image::FaceDetectionResultEntry::getImage() const {
-  return image;
+  return encodedImage ? encodedImage->decode() : image;
 }
 
 cv::Rect trustid::image::FaceDetectionResultEntry::getBoundingBox() const {
@@ -41,16 +217,70 @@ trustid::image::FaceDetectionResultEntry::getFaceDetBoundingBox() const {
 }
 
 cv::Mat trustid::image::FaceDetectionResultEntry::getCroppedImage() const {
-  if (image.empty()) {
+  // deserialized entries may only hold the encoded image
+  const cv::Mat fullImage = getImage();
+  if (fullImage.empty()) {
     throw std::runtime_error("Image is empty");
   } else {
-    return image(detectionBoundingbox.boundingBox);
+    return fullImage(detectionBoundingbox.boundingBox);
   }
 }
 
 trustid::image::FaceDetectionResultEntry
 trustid::image::FaceDetectionResultEntry::copy() const {
-  return FaceDetectionResultEntry(image, detectionBoundingbox);
+  return FaceDetectionResultEntry(getImage(), detectionBoundingbox);
+}
+
+void trustid::image::FaceDetectionResultEntry::serialize_to(
+    std::ostream& out, const ImageSerializationOptions& options) const {
+  try {
+    cv::Mat storedImage = getImage();
+    FaceDetectionConfidenceBoundingBox storedBoundingBox = detectionBoundingbox;
+    if (options.faceRegionOnly && !storedImage.empty()) {
+      const cv::Rect region =
+          utils::getFaceRegion(storedBoundingBox.boundingBox,
+                               storedImage.size(), options.faceRegionMargin);
+      storedImage = storedImage(region);
+      storedBoundingBox.boundingBox -= region.tl();
+    }
+
+    if (canEncode(storedImage, options.encoding)) {
+      dlib::serialize(encodedImageVersion, out);
+      serializeEncodedImage(storedImage, options, out);
+    } else {
+      dlib::serialize(rawImageVersion, out);
+      cv::serialize(storedImage, out);
+    }
+    serialize(storedBoundingBox, out);
+  } catch (dlib::serialization_error& e) {
+    throw dlib::serialization_error(
+        e.info +
+        "\n   while serializing object of type FaceDetectionResultEntry");
+  }
+}
+
+void trustid::image::FaceDetectionResultEntry::deserialize_from(
+    std::istream& in) {
+  try {
+    int version;
+    dlib::deserialize(version, in);
+    if (version == rawImageVersion) {
+      cv::deserialize(image, in);
+      encodedImage.reset();
+    } else if (version == encodedImageVersion) {
+      encodedImage = EncodedImage::deserialize(in);
+      image.release();
+    } else {
+      throw dlib::serialization_error(
+          "Unexpected version found while deserializing "
+          "FaceDetectionResultEntry");
+    }
+    deserialize(detectionBoundingbox, in);
+  } catch (dlib::serialization_error& e) {
+    throw dlib::serialization_error(
+        e.info +
+        "\n   while deserializing object of type FaceDetectionResultEntry");
+  }
 }
 trustid::image::FaceDetectionResult::FaceDetectionResult() {}
 trustid::image::FaceDetectionResult::FaceDetectionResult(
@@ -82,7 +312,9 @@ trustid::image::FaceDetectionResult::getResult() const {
 /**
  * Get the image that was used for the face detection operation.
  */
-cv::Mat trustid::image::FaceDetectionResult::getImage() const { return image; }
+cv::Mat trustid::image::FaceDetectionResult::getImage() const {
+  return encodedImage ? encodedImage->decode() : image;
+}
 
 /**
  * Returns the bounding box of the face detection operation according to the
@@ -106,10 +338,11 @@ cv::Rect trustid::image::FaceDetectionResult::getBoundingBox(
  */
 cv::Mat trustid::image::FaceDetectionResult::getCroppedImage(
     int detectionIdx, BoundingBoxHeuristicEnum heuristic) const {
-  if (image.empty()) {
+  const cv::Mat fullImage = getImage();
+  if (fullImage.empty()) {
     throw std::runtime_error("Image is empty");
   } else {
-    return image(getBoundingBox(detectionIdx, heuristic));
+    return fullImage(getBoundingBox(detectionIdx, heuristic));
   }
 }
 
@@ -145,6 +378,7 @@ trustid::image::FaceDetectionResult::getBoundingBoxEntries(
       getBoundingBoxes(heuristic);
 
   auto entries = std::vector<FaceDetectionResultEntry>();
+  const cv::Mat image = getImage();
   for (auto& boundingBox : sortedBoundingBoxes) {
     entries.push_back(FaceDetectionResultEntry(image, boundingBox));
   }
@@ -156,7 +390,7 @@ trustid::image::FaceDetectionResult::getEntry(
     int detectionIdx, BoundingBoxHeuristicEnum heuristic) const {
   if (detectionIdx < boundingBoxes.size()) {
     // TODO: Should this clone the image?
-    return FaceDetectionResultEntry(image,
+    return FaceDetectionResultEntry(getImage(),
                                     getBoundingBoxes(heuristic)[detectionIdx]);
   } else {
     throw std::runtime_error("Invalid detection index");
@@ -165,24 +399,202 @@ trustid::image::FaceDetectionResult::getEntry(
 
 trustid::image::FaceDetectionResult trustid::image::FaceDetectionResult::copy()
     const {
-  return FaceDetectionResult(image, boundingBoxes, resultValue);
+  return FaceDetectionResult(getImage(), boundingBoxes, resultValue);
+}
+
+void trustid::image::FaceDetectionResult::serialize_to(
+    std::ostream& out, const ImageSerializationOptions& options) const {
+  try {
+    cv::Mat storedImage = getImage();
+    std::vector<FaceDetectionConfidenceBoundingBox> storedBoundingBoxes =
+        boundingBoxes;
+    if (options.faceRegionOnly && !storedImage.empty()) {
+      const cv::Rect region = utils::getFaceRegion(
+          storedBoundingBoxes, storedImage.size(), options.faceRegionMargin);
+      storedImage = storedImage(region);
+      for (auto& boundingBox : storedBoundingBoxes) {
+        boundingBox.boundingBox -= region.tl();
+      }
+    }
+
+    const bool encoded = canEncode(storedImage, options.encoding);
+    dlib::serialize(encoded ? encodedImageVersion : rawImageVersion, out);
+    trustid::image::serialize(resultValue, out);
+    if (encoded) {
+      serializeEncodedImage(storedImage, options, out);
+    } else {
+      cv::serialize(storedImage, out);
+    }
+    dlib::serialize(storedBoundingBoxes, out);
+  } catch (dlib::serialization_error& e) {
+    throw dlib::serialization_error(
+        e.info + "\n   while serializing object of type FaceDetectionResult");
+  }
+}
+
+void trustid::image::FaceDetectionResult::deserialize_from(std::istream& in) {
+  try {
+    int version;
+    dlib::deserialize(version, in);
+    if (version != rawImageVersion && version != encodedImageVersion) {
+      throw dlib::serialization_error(
+          "Unexpected version found while deserializing FaceDetectionResult");
+    }
+    trustid::image::deserialize(resultValue, in);
+    if (version == rawImageVersion) {
+      cv::deserialize(image, in);
+      encodedImage.reset();
+    } else {
+      encodedImage = EncodedImage::deserialize(in);
+      image.release();
+    }
+    dlib::deserialize(boundingBoxes, in);
+  } catch (dlib::serialization_error& e) {
+    throw dlib::serialization_error(
+        e.info +
+        "\n   while deserializing object of type FaceDetectionResult");
+  }
 }
 
 trustid::image::IFaceDetectImageProcessor::IFaceDetectImageProcessor() {}
 
+trustid::image::DownscaleImageProcessor::DownscaleImageProcessor(
+    int maxImageSize)
+    : maxImageSize(maxImageSize) {}
+
+trustid::image::TransformedImage
+trustid::image::DownscaleImageProcessor::operator()(const cv::Mat image) {
+  const int maxSide = std::max(image.cols, image.rows);
+  if (maxSide <= maxImageSize) {
+    return TransformedImage(image);
+  }
+  const double scale = static_cast<double>(maxImageSize) / maxSide;
+  cv::Mat downscaled = pooledMat();
+  cv::resize(image, downscaled, cv::Size(), scale, scale, cv::INTER_AREA);
+
+  // use the actual scale of each axis, since the output size is rounded
+  return TransformedImage(
+      downscaled,
+      cv::Matx23d(downscaled.cols / static_cast<double>(image.cols), 0, 0, 0,
+                  downscaled.rows / static_cast<double>(image.rows), 0));
+}
+
 trustid::image::IFaceDetector::IFaceDetector() : imagePreprocessors() {}
 
 trustid::image::IFaceDetector::~IFaceDetector() {}
 
-trustid::image::FaceDetectionResult trustid::image::IFaceDetector::detectFaces(
-    const cv::Mat image) {
-  cv::Mat imageCopy = image.clone();
+trustid::image::TransformedImage
+trustid::image::IFaceDetector::applyPreprocessors(const cv::Mat image) {
+  TransformedImage processed(image);
   for (auto& processor : imagePreprocessors) {
     if (processor != nullptr) {
-      imageCopy = processor->operator()(imageCopy);
+      auto step = processor->operator()(processed.image);
+      processed.image = step.image;
+      processed.transform =
+          utils::composeTransforms(processed.transform, step.transform);
     }
   }
-  return _detectFaces(imageCopy);
+  return processed;
+}
+
+trustid::image::FaceDetectionResult trustid::image::IFaceDetector::detectFaces(
+    const cv::Mat image) {
+  cv::Mat imageCopy = pooledClone(image);
+  if (imagePreprocessors.empty()) {
+    return _detectFaces(imageCopy);
+  }
+  auto processed = applyPreprocessors(imageCopy);
+  return mapToOriginalImage(_detectFaces(processed.image), imageCopy,
+                            processed.transform);
+}
+
+trustid::image::FaceDetectionResult
+trustid::image::IFaceDetector::detectFacesEncoded(
+    const std::vector<unsigned char>& encodedImage, int reductionFactor,
+    int minFaceSize) {
+  cv::Mat reducedImage =
+      decodeImage(encodedImage, getReducedReadFlag(reductionFactor));
+  auto processed = applyPreprocessors(reducedImage);
+  auto result = _detectFaces(processed.image);
+  if (result.getResult() == NO_RESULTS) {
+    return FaceDetectionResult(reducedImage, {}, NO_RESULTS);
+  }
+  result = mapToOriginalImage(result, reducedImage, processed.transform);
+
+  // OpenCV can't decode only the face region, so the image is decoded again
+  // at the smallest scale keeping the smallest face wide enough, if the
+  // reduced image doesn't already
+  int smallestFace = std::numeric_limits<int>::max();
+  for (auto& boundingBox : result.getBoundingBoxes()) {
+    smallestFace =
+        std::min({smallestFace, boundingBox.boundingBox.width,
+                  boundingBox.boundingBox.height});
+  }
+  int decodeFactor = reductionFactor;
+  while (decodeFactor > 1 &&
+         smallestFace * reductionFactor / decodeFactor < minFaceSize) {
+    decodeFactor /= 2;
+  }
+  cv::Mat image = reducedImage;
+  if (decodeFactor != reductionFactor) {
+    // map the boxes to the new image (the reduced size is rounded up, so each
+    // axis has its own scale)
+    image = decodeImage(encodedImage, getReducedReadFlag(decodeFactor));
+    const cv::Matx23d reduceTransform(
+        reducedImage.cols / static_cast<double>(image.cols), 0, 0, 0,
+        reducedImage.rows / static_cast<double>(image.rows), 0);
+    result = mapToOriginalImage(result, image, reduceTransform);
+  }
+
+  // keep only the region around the faces, releasing the rest of the image
+  auto boundingBoxes = result.getBoundingBoxes();
+  const cv::Rect region = utils::getFaceRegion(boundingBoxes, image.size());
+  for (auto& boundingBox : boundingBoxes) {
+    boundingBox.boundingBox -= region.tl();
+  }
+  return FaceDetectionResult(pooledClone(image(region)), boundingBoxes,
+                             result.getResult());
+}
+
+std::vector<trustid::image::FaceDetectionResult>
+trustid::image::IFaceDetector::detectFacesBatch(
+    const std::vector<cv::Mat>& images) {
+  std::vector<cv::Mat> imageCopies;
+  std::vector<cv::Mat> processedImages;
+  std::vector<cv::Matx23d> transforms;
+  imageCopies.reserve(images.size());
+  processedImages.reserve(images.size());
+  transforms.reserve(images.size());
+  for (auto& image : images) {
+    imageCopies.push_back(pooledClone(image));
+    auto processed = applyPreprocessors(imageCopies.back());
+    processedImages.push_back(processed.image);
+    transforms.push_back(processed.transform);
+  }
+  auto results = _detectFacesBatch(processedImages);
+  if (!imagePreprocessors.empty()) {
+    for (size_t i = 0; i < results.size(); i++) {
+      results[i] =
+          mapToOriginalImage(results[i], imageCopies[i], transforms[i]);
+    }
+  }
+  return results;
+}
+
+std::vector<trustid::image::FaceDetectionResult>
+trustid::image::IFaceDetector::_detectFacesBatch(
+    const std::vector<cv::Mat>& images) {
+  std::vector<FaceDetectionResult> results;
+  results.reserve(images.size());
+  for (auto& image : images) {
+    results.push_back(_detectFaces(image));
+  }
+  return results;
+}
+
+std::future<trustid::image::FaceDetectionResult>
+trustid::image::IFaceDetector::detectFacesAsync(const cv::Mat image) {
+  return asyncStrand.submit([this, image]() { return detectFaces(image); });
 }
 
 void trustid::image::IFaceDetector::addPreprocessor(
@@ -0,0 +1,96 @@
+#include "trustid_image_processing/face_normalization.h"
+
+#include <dlib/opencv.h>
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+#include "trustid_image_processing/utils.h"
+
+namespace {
+// landmarks of the 68 point model that barely move with the expression or
+// the pose (the jaw line slides along the face as the head turns): brow ends,
+// eye corners, nose bridge, tip and wings, mouth corners and chin
+const int poseLandmarks[] = {17, 21, 22, 26, 36, 39, 42,
+                             45, 27, 30, 31, 35, 48, 54, 8};
+const int poseLandmarkCount = sizeof(poseLandmarks) / sizeof(poseLandmarks[0]);
+
+// distance between the outer eye corners of the 3D model
+const double modelEyeDistance = 89.8;
+
+// Returns the 3D points of the pose landmarks in camera axes (y down and z
+// away from the camera, while sparse_3d has y up and z towards the viewer),
+// so a frontal face has no rotation.
+const cv::Point3d* getModelPoints() {
+  static const auto modelPoints = [] {
+    std::array<cv::Point3d, poseLandmarkCount> points;
+    const double* model = trustid::image::impl::FaceNormalizer::sparse_3d;
+    for (int i = 0; i < poseLandmarkCount; i++) {
+      const int landmark = poseLandmarks[i];
+      points[i] = cv::Point3d(model[3 * landmark], -model[3 * landmark + 1],
+                              -model[3 * landmark + 2]);
+    }
+    return points;
+  }();
+  return modelPoints.data();
+}
+}  // namespace
+
+trustid::image::impl::FaceNormalizer::FaceNormalizer(
+    std::shared_ptr<dlib::shape_predictor> sp)
+    : sp(sp) {}
+
+trustid::image::HeadPoseEstimationResult
+trustid::image::impl::FaceNormalizer::estimateHeadPose(
+    const FaceDetectionResultEntry detectionResultEntry) const {
+  if (!sp) {
+    throw std::runtime_error("Head pose estimation needs a shape predictor");
+  }
+  const cv::Mat image = detectionResultEntry.getImage();
+  dlib::cv_image<dlib::bgr_pixel> dlibImage(image);
+  auto shape = sp->operator()(
+      dlibImage, utils::openCVRectToDlib(detectionResultEntry.getBoundingBox()));
+  return estimateHeadPose(shape, image.size());
+}
+
+trustid::image::HeadPoseEstimationResult
+trustid::image::impl::FaceNormalizer::estimateHeadPose(
+    const dlib::full_object_detection& shape, const cv::Size imageSize) const {
+  if (shape.num_parts() != 68) {
+    throw std::invalid_argument(
+        "Head pose estimation needs the 68 point landmarks");
+  }
+
+  // fixed size buffers, wrapped by (non-allocating) matrix headers
+  cv::Point2d imagePoints[poseLandmarkCount];
+  for (int i = 0; i < poseLandmarkCount; i++) {
+    const auto& part = shape.part(poseLandmarks[i]);
+    imagePoints[i] = cv::Point2d(part.x(), part.y());
+  }
+  const cv::Mat objectPointsMat(poseLandmarkCount, 1, CV_64FC3,
+                                const_cast<cv::Point3d*>(getModelPoints()));
+  const cv::Mat imagePointsMat(poseLandmarkCount, 1, CV_64FC2, imagePoints);
+
+  // pinhole camera with the focal length of a typical webcam (about 55
+  // degrees of horizontal field of view) and no distortion
+  const double focalLength = std::max(imageSize.width, imageSize.height);
+  const cv::Matx33d cameraMatrix(focalLength, 0, imageSize.width / 2.0, 0,
+                                 focalLength, imageSize.height / 2.0, 0, 0, 1);
+
+  // start from a frontal face at the distance matching the eye distance, so
+  // the iterative solver converges in a few steps
+  const cv::Point2d leftEye = imagePoints[4];
+  const cv::Point2d rightEye = imagePoints[7];
+  const double eyeDistance = std::max(cv::norm(rightEye - leftEye), 1.0);
+  const double distance = focalLength * modelEyeDistance / eyeDistance;
+  const cv::Point2d center = imagePoints[9];  // nose tip
+  cv::Vec3d rotationVector(0, 0, 0);
+  cv::Vec3d translationVector(
+      (center.x - cameraMatrix(0, 2)) * distance / focalLength,
+      (center.y - cameraMatrix(1, 2)) * distance / focalLength, distance);
+
+  cv::solvePnP(objectPointsMat, imagePointsMat, cameraMatrix, cv::noArray(),
+               rotationVector, translationVector, true, cv::SOLVEPNP_ITERATIVE);
+  return HeadPoseEstimationResult(rotationVector, translationVector);
+}
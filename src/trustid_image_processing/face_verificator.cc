@@ -5,6 +5,54 @@
 #include <utility>
 #include <vector>
 
+#include "trustid_image_processing/executor.h"
+#include "trustid_image_processing/mat_pool.h"
+#include "trustid_image_processing/utils.h"
+
+namespace {
+// Applies the given transform to the image of the detection, materializing
+// only the region around the face box (given in the output coordinates) of
+// an output image of the given size.
+trustid::image::FaceDetectionResultEntry warpFaceRegion(
+    const trustid::image::FaceDetectionResultEntry &detectionResultEntry,
+    const cv::Matx23d &transform, const cv::Size outputSize,
+    const cv::Rect boundingBox) {
+  const cv::Rect region =
+      trustid::image::utils::getFaceRegion(boundingBox, outputSize);
+  if (region.empty()) {
+    throw std::runtime_error("The face is outside the processed image");
+  }
+
+  // shift the output so that the region starts at the origin
+  const cv::Matx23d regionTransform = trustid::image::utils::composeTransforms(
+      transform, cv::Matx23d(1, 0, -region.x, 0, 1, -region.y));
+  cv::Mat image = detectionResultEntry.getImage();
+  cv::Mat regionImage = trustid::image::pooledMat();
+  const cv::Rect sourceRegion(cvRound(-regionTransform(0, 2)),
+                              cvRound(-regionTransform(1, 2)), region.width,
+                              region.height);
+  const bool integerShift =
+      regionTransform(0, 0) == 1 && regionTransform(0, 1) == 0 &&
+      regionTransform(1, 0) == 0 && regionTransform(1, 1) == 1 &&
+      sourceRegion.x == -regionTransform(0, 2) &&
+      sourceRegion.y == -regionTransform(1, 2);
+  if (integerShift &&
+      (sourceRegion & cv::Rect(0, 0, image.cols, image.rows)) ==
+          sourceRegion) {
+    // plain crops need no interpolation, the entry copies the view
+    regionImage = image(sourceRegion);
+  } else {
+    cv::warpAffine(image, regionImage, regionTransform, region.size(),
+                   cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+  }
+
+  auto faceBoundingBox = detectionResultEntry.getFaceDetBoundingBox();
+  faceBoundingBox.boundingBox = boundingBox - region.tl();
+  return trustid::image::FaceDetectionResultEntry(regionImage,
+                                                  faceBoundingBox);
+}
+}  // namespace
+
 trustid::image::FaceVerificationResult::FaceVerificationResult(
     FaceDetectionResultEntry detectionResultEntry, double matchConfidence,
     FaceVerificationResultEnum resultValue)
@@ -38,6 +86,12 @@ trustid::image::FaceVerificationResult::getDetectionResult() const {
 
 trustid::image::IFaceVerifyImageProcessor::IFaceVerifyImageProcessor() {}
 
+bool trustid::image::IFaceVerifyImageProcessor::getGeometricTransform(
+    const cv::Size imageSize, const cv::Rect boundingBox,
+    cv::Matx23d &transform, cv::Size &outputSize) const {
+  return false;
+}
+
 trustid::image::ResizeImageProcessor::ResizeImageProcessor(int width,
                                                            int height)
     : width(width), height(height) {}
@@ -77,7 +131,7 @@ trustid::image::ResizeImageProcessor::operator()(
                      (double)originalBoundingBox.boundingBox.height)
             << std::endl;
 
-  cv::Mat resizedImage;
+  cv::Mat resizedImage = pooledMat();
   cv::resize(originalImage, resizedImage, cv::Size(),
              width / (double)originalBoundingBox.boundingBox.width,
              height / (double)originalBoundingBox.boundingBox.height,
@@ -87,6 +141,18 @@ trustid::image::ResizeImageProcessor::operator()(
   return FaceDetectionResultEntry(resizedImage, newDetectionBoundingBox);
 }
 
+bool trustid::image::ResizeImageProcessor::getGeometricTransform(
+    const cv::Size imageSize, const cv::Rect boundingBox,
+    cv::Matx23d &transform, cv::Size &outputSize) const {
+  // scale the image so that the face box gets the specified size
+  const double scaleX = width / (double)boundingBox.width;
+  const double scaleY = height / (double)boundingBox.height;
+  transform = cv::Matx23d(scaleX, 0, 0, 0, scaleY, 0);
+  outputSize = cv::Size(cvRound(imageSize.width * scaleX),
+                        cvRound(imageSize.height * scaleY));
+  return true;
+}
+
 trustid::image::CropImageProcessor::CropImageProcessor(cv::Rect cropInfo)
     : cropInfo(cropInfo) {}
 
@@ -106,6 +172,14 @@ trustid::image::CropImageProcessor::operator()(
   return FaceDetectionResultEntry(image(cropInfo), cropBoundingBox);
 }
 
+bool trustid::image::CropImageProcessor::getGeometricTransform(
+    const cv::Size imageSize, const cv::Rect boundingBox,
+    cv::Matx23d &transform, cv::Size &outputSize) const {
+  transform = cv::Matx23d(1, 0, -cropInfo.x, 0, 1, -cropInfo.y);
+  outputSize = cropInfo.size();
+  return true;
+}
+
 trustid::image::IFaceVerificator::IFaceVerificator() : preprocessors() {}
 
 trustid::image::IFaceVerificator::IFaceVerificator(
@@ -127,13 +201,74 @@ trustid::image::IFaceVerificator::verifyUser(
   return _verifyUser(applyProcessors(detectionResultEntry));
 }
 
+std::future<trustid::image::FaceVerificationResult>
+trustid::image::IFaceVerificator::verifyUserAsync(
+    const FaceDetectionResultEntry detectionResultEntry) {
+  return asyncStrand.submit([this, detectionResultEntry]() {
+    return verifyUser(detectionResultEntry);
+  });
+}
+
+trustid::image::FaceEmbedding
+trustid::image::IFaceVerificator::extractEmbedding(
+    const FaceDetectionResultEntry detectionResultEntry) {
+  return _extractEmbedding(applyProcessors(detectionResultEntry));
+}
+
+trustid::image::FaceVerificationResult
+trustid::image::IFaceVerificator::verifyEmbedding(
+    const FaceEmbedding &embedding) {
+  return _verifyEmbedding(embedding);
+}
+
+trustid::image::FaceVerificationResult
+trustid::image::IFaceVerificator::_verifyUser(
+    const FaceDetectionResultEntry detectionResultEntry) {
+  auto result = _verifyEmbedding(_extractEmbedding(detectionResultEntry));
+
+  // attach the detection that was verified
+  return FaceVerificationResult(detectionResultEntry,
+                                result.getMatchConfidence(),
+                                result.getResult());
+}
+
 trustid::image::FaceDetectionResultEntry
 trustid::image::IFaceVerificator::applyProcessors(
     const FaceDetectionResultEntry detectionResultEntry) {
-  FaceDetectionResultEntry detectionResultEntryCopy =
-      detectionResultEntry.copy();
-  for (auto &processor : preprocessors) {
-    detectionResultEntryCopy = processor->operator()(detectionResultEntryCopy);
+  if (preprocessors.empty()) {
+    return detectionResultEntry.copy();
+  }
+
+  // every processor builds a new entry, so the input is never modified
+  FaceDetectionResultEntry processedEntry = detectionResultEntry;
+  size_t processorIdx = 0;
+  while (processorIdx < preprocessors.size()) {
+    // compose the run of geometric processors starting here, tracking the
+    // face box through it without touching any pixel
+    cv::Matx23d transform = cv::Matx23d::eye();
+    cv::Size imageSize = processedEntry.getImage().size();
+    cv::Rect boundingBox = processedEntry.getBoundingBox();
+    cv::Matx23d stepTransform;
+    cv::Size stepSize;
+    size_t fusedCount = 0;
+    while (processorIdx < preprocessors.size() &&
+           preprocessors[processorIdx]->getGeometricTransform(
+               imageSize, boundingBox, stepTransform, stepSize)) {
+      transform = utils::composeTransforms(transform, stepTransform);
+      boundingBox = utils::transformRect(boundingBox, stepTransform);
+      imageSize = stepSize;
+      processorIdx++;
+      fusedCount++;
+    }
+
+    if (fusedCount > 0) {
+      processedEntry =
+          warpFaceRegion(processedEntry, transform, imageSize, boundingBox);
+    } else {
+      processedEntry =
+          preprocessors[processorIdx]->operator()(processedEntry);
+      processorIdx++;
+    }
   }
-  return detectionResultEntryCopy;
+  return processedEntry;
 }
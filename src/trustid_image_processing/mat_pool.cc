@@ -0,0 +1,306 @@
+#include "trustid_image_processing/mat_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace {
+// buffers smaller than the first class are rounded up to it, larger than the
+// last one bypass the pool
+const size_t minClassSize = 256;
+const size_t maxClassSize = size_t(1) << 27;
+
+// blocks kept per size class and in total by each thread
+const size_t threadCacheBlocksPerClass = 4;
+const size_t threadCacheMaxBytes = size_t(32) << 20;
+
+// Returns the block size of every class: 2^k and 1.5 * 2^k, which wastes at
+// most a third of each block. Never destroyed, like the shared pool.
+const std::vector<size_t>& getClassSizes() {
+  static const std::vector<size_t>* classSizes = [] {
+    auto sizes = new std::vector<size_t>();
+    for (size_t size = minClassSize; size <= maxClassSize; size *= 2) {
+      sizes->push_back(size);
+      if (size + size / 2 <= maxClassSize) {
+        sizes->push_back(size + size / 2);
+      }
+    }
+    return sizes;
+  }();
+  return *classSizes;
+}
+
+// Returns the index of the smallest class holding the given size.
+size_t getClassIdx(size_t size) {
+  const auto& classSizes = getClassSizes();
+  return std::lower_bound(classSizes.begin(), classSizes.end(), size) -
+         classSizes.begin();
+}
+
+struct SharedPool {
+  std::mutex mutex;
+  std::vector<std::vector<void*>> blocks =
+      std::vector<std::vector<void*>>(getClassSizes().size());
+  size_t bytes = 0;  // free bytes held by the shared pool
+  size_t capacity = size_t(256) << 20;
+
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> hits{0};
+  std::atomic<size_t> bytesRetained{0};  // shared pool and thread caches
+  std::atomic<size_t> bytesInUse{0};
+  std::atomic<uint64_t> trimEpoch{0};
+};
+
+// never destroyed, since pooled matrices may be released during static
+// destruction or at thread exit
+SharedPool& getSharedPool() {
+  static SharedPool* pool = new SharedPool();
+  return *pool;
+}
+
+enum ThreadCacheStateEnum { CACHE_NOT_CREATED, CACHE_ALIVE, CACHE_DESTROYED };
+
+// state of the cache of the current thread. Trivially destructible, so it is
+// still readable when matrices are released after the cache was destroyed
+// (by other thread_local objects, or by static ones on the main thread).
+thread_local ThreadCacheStateEnum threadCacheState = CACHE_NOT_CREATED;
+
+struct ThreadCache {
+  std::vector<std::vector<void*>> blocks =
+      std::vector<std::vector<void*>>(getClassSizes().size());
+  size_t bytes = 0;
+  uint64_t trimEpoch = getSharedPool().trimEpoch;
+
+  ThreadCache() { threadCacheState = CACHE_ALIVE; }
+
+  // hands the cached blocks over to the shared pool at thread exit
+  ~ThreadCache() {
+    release(false);
+    threadCacheState = CACHE_DESTROYED;
+  }
+
+  // Empties the cache, moving the blocks to the shared pool (while it has
+  // room) or freeing them.
+  void release(bool freeBlocks) {
+    SharedPool& pool = getSharedPool();
+    const auto& classSizes = getClassSizes();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    for (size_t classIdx = 0; classIdx < blocks.size(); classIdx++) {
+      for (void* block : blocks[classIdx]) {
+        const size_t size = classSizes[classIdx];
+        if (!freeBlocks && pool.bytes + size <= pool.capacity) {
+          pool.blocks[classIdx].push_back(block);
+          pool.bytes += size;
+        } else {
+          cv::fastFree(block);
+          pool.bytesRetained -= size;
+        }
+      }
+      blocks[classIdx].clear();
+    }
+    bytes = 0;
+  }
+
+  // Drops the cached blocks if the pool was trimmed since the last call.
+  void checkTrimEpoch() {
+    const uint64_t epoch = getSharedPool().trimEpoch;
+    if (epoch != trimEpoch) {
+      release(true);
+      trimEpoch = epoch;
+    }
+  }
+};
+
+// Returns the cache of the current thread, or null once it was destroyed at
+// thread exit, in which case the shared pool is used directly.
+ThreadCache* getThreadCache() {
+  if (threadCacheState == CACHE_DESTROYED) {
+    return nullptr;
+  }
+  thread_local ThreadCache cache;
+  return &cache;
+}
+
+// Returns a buffer of (at least) the given size.
+void* acquireBlock(size_t size) {
+  SharedPool& pool = getSharedPool();
+  pool.allocations++;
+  if (size > maxClassSize) {
+    pool.bytesInUse += size;
+    return cv::fastMalloc(size);
+  }
+  const size_t classIdx = getClassIdx(size);
+  const size_t classSize = getClassSizes()[classIdx];
+  pool.bytesInUse += classSize;
+
+  // thread cache first, then the shared pool
+  ThreadCache* cache = getThreadCache();
+  if (cache) {
+    cache->checkTrimEpoch();
+  }
+  void* block = nullptr;
+  if (cache && !cache->blocks[classIdx].empty()) {
+    block = cache->blocks[classIdx].back();
+    cache->blocks[classIdx].pop_back();
+    cache->bytes -= classSize;
+  } else {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (!pool.blocks[classIdx].empty()) {
+      block = pool.blocks[classIdx].back();
+      pool.blocks[classIdx].pop_back();
+      pool.bytes -= classSize;
+    }
+  }
+  if (block == nullptr) {
+    return cv::fastMalloc(classSize);
+  }
+  pool.hits++;
+  pool.bytesRetained -= classSize;
+  return block;
+}
+
+// Returns a buffer obtained from acquireBlock with the same size.
+void releaseBlock(void* block, size_t size) {
+  SharedPool& pool = getSharedPool();
+  if (size > maxClassSize) {
+    pool.bytesInUse -= size;
+    cv::fastFree(block);
+    return;
+  }
+  const size_t classIdx = getClassIdx(size);
+  const size_t classSize = getClassSizes()[classIdx];
+  pool.bytesInUse -= classSize;
+
+  ThreadCache* cache = getThreadCache();
+  if (cache) {
+    cache->checkTrimEpoch();
+  }
+  if (cache && cache->blocks[classIdx].size() < threadCacheBlocksPerClass &&
+      cache->bytes + classSize <= threadCacheMaxBytes) {
+    cache->blocks[classIdx].push_back(block);
+    cache->bytes += classSize;
+    pool.bytesRetained += classSize;
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.bytes + classSize <= pool.capacity) {
+      pool.blocks[classIdx].push_back(block);
+      pool.bytes += classSize;
+      pool.bytesRetained += classSize;
+      return;
+    }
+  }
+  cv::fastFree(block);
+}
+
+/**
+ * cv::MatAllocator serving the matrix buffers from the size class pool. It
+ * follows the default OpenCV allocator otherwise.
+ */
+class PooledMatAllocator : public cv::MatAllocator {
+ public:
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                         size_t* step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usageFlags) const override {
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; i--) {
+      if (step) {
+        if (data && step[i] != CV_AUTOSTEP) {
+          CV_Assert(total <= step[i]);
+          total = step[i];
+        } else {
+          step[i] = total;
+        }
+      }
+      total *= sizes[i];
+    }
+
+    cv::UMatData* u = new cv::UMatData(this);
+    u->data = u->origdata =
+        static_cast<uchar*>(data ? data : acquireBlock(total));
+    u->size = total;
+    if (data) {
+      u->flags |= cv::UMatData::USER_ALLOCATED;
+    }
+    return u;
+  }
+
+  bool allocate(cv::UMatData* u, cv::AccessFlag accessFlags,
+                cv::UMatUsageFlags usageFlags) const override {
+    return u != nullptr;
+  }
+
+  void deallocate(cv::UMatData* u) const override {
+    if (!u) {
+      return;
+    }
+    CV_Assert(u->urefcount == 0);
+    CV_Assert(u->refcount == 0);
+    if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+      releaseBlock(u->origdata, u->size);
+      u->origdata = nullptr;
+    }
+    delete u;
+  }
+};
+}  // namespace
+
+cv::MatAllocator* trustid::image::getPooledMatAllocator() {
+  static PooledMatAllocator* allocator = new PooledMatAllocator();
+  return allocator;
+}
+
+cv::Mat trustid::image::pooledMat() {
+  cv::Mat mat;
+  mat.allocator = getPooledMatAllocator();
+  return mat;
+}
+
+cv::Mat trustid::image::pooledClone(const cv::Mat& mat) {
+  cv::Mat copy = pooledMat();
+  mat.copyTo(copy);
+  return copy;
+}
+
+trustid::image::MatPoolStats trustid::image::getMatPoolStats() {
+  SharedPool& pool = getSharedPool();
+  MatPoolStats stats;
+  stats.allocations = pool.allocations;
+  stats.hits = pool.hits;
+  stats.hitRate = stats.allocations > 0
+                      ? static_cast<double>(stats.hits) / stats.allocations
+                      : 0;
+  stats.bytesRetained = pool.bytesRetained;
+  stats.bytesInUse = pool.bytesInUse;
+  return stats;
+}
+
+void trustid::image::trimMatPool(size_t maxRetainedBytes) {
+  SharedPool& pool = getSharedPool();
+  // other threads drop their caches once they see the new epoch
+  pool.trimEpoch++;
+  if (ThreadCache* cache = getThreadCache()) {
+    cache->checkTrimEpoch();
+  }
+
+  // free the largest blocks first, they hold most of the memory
+  const auto& classSizes = getClassSizes();
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  for (size_t classIdx = classSizes.size(); classIdx-- > 0;) {
+    auto& blocks = pool.blocks[classIdx];
+    while (!blocks.empty() && pool.bytes > maxRetainedBytes) {
+      cv::fastFree(blocks.back());
+      blocks.pop_back();
+      pool.bytes -= classSizes[classIdx];
+      pool.bytesRetained -= classSizes[classIdx];
+    }
+  }
+}
+
+void trustid::image::setMatPoolCapacity(size_t maxRetainedBytes) {
+  SharedPool& pool = getSharedPool();
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  pool.capacity = maxRetainedBytes;
+}
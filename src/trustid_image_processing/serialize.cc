@@ -1,5 +1,9 @@
 #include "trustid_image_processing/serialize.h"
 
+#include <string>
+
+#include "trustid_image_processing/mat_pool.h"
+
 void cv::serialize(const Rect& item, std::ostream& out) {
   int x = item.x;
   int y = item.y;
@@ -24,51 +28,68 @@ void cv::deserialize(Rect& item, std::istream& in) {
 }
 
 void cv::serialize(const Mat& item, std::ostream& out) {
-  // convert to a placeholder vector to store byte data
-  std::vector<unsigned char> data(item.datastart, item.dataend);
+  if (item.dims > 2) {
+    throw dlib::serialization_error(
+        "Only 2D matrices can be serialized, got " +
+        std::to_string(item.dims) + " dimensions");
+  }
+  // rows are written back to back, whatever the step of the matrix
+  const size_t rowSize = item.cols * item.elemSize();
+  const unsigned long size = static_cast<unsigned long>(rowSize * item.rows);
   dlib::serialize(item.type(), out);
   dlib::serialize(item.rows, out);
   dlib::serialize(item.cols, out);
-  dlib::serialize(item.step, out);
-  dlib::serialize(data, out);
+  dlib::serialize(static_cast<uint64>(rowSize), out);
+  dlib::serialize(size, out);
+  if (item.isContinuous()) {
+    out.write(reinterpret_cast<const char*>(item.data), size);
+  } else {
+    for (int row = 0; row < item.rows; row++) {
+      out.write(reinterpret_cast<const char*>(item.ptr(row)), rowSize);
+    }
+  }
+  if (!out) {
+    throw dlib::serialization_error("Error writing a cv::Mat");
+  }
 }
 
 void cv::deserialize(Mat& item, std::istream& in) {
   int type, rows, cols;
   uint64 step;
-  // use placeholder vector to store byte data
-  std::vector<unsigned char> data;
+  unsigned long size;
   dlib::deserialize(type, in);
   dlib::deserialize(rows, in);
   dlib::deserialize(cols, in);
   dlib::deserialize(step, in);
-  dlib::deserialize(data, in);
+  dlib::deserialize(size, in);
 
-  // allocate memory and copy data (because simply moving the data pointer may
-  // cause a segfault since std::vector will free the memory when it goes out of
-  // scope, regardless of it being moved or not)
-  unsigned char* data_ptr = static_cast<unsigned char*>(malloc(data.size()));
-  std::copy(data.begin(), data.end(), data_ptr);
-  item = Mat(rows, cols, type, std::move(data_ptr), step);
-}
-
-template <typename _Tp, int m, int n>
-void cv::serialize(const Matx<_Tp, m, n>& item, std::ostream& out) {
-  // convert to a placeholder vector to store byte data
-  std::vector<_Tp> data(item.val, item.val + m * n);
-  dlib::serialize(data, out);
-}
+  // never write into a buffer shared with other matrices, otherwise reuse the
+  // buffer of the given matrix when it has the right size
+  if (item.isSubmatrix() || (item.u != nullptr && item.u->refcount > 1)) {
+    item.release();
+  }
+  if (item.u == nullptr) {
+    item = trustid::image::pooledMat();
+  }
+  item.create(rows, cols, type);
 
-template <typename _Tp, int m, int n>
-void cv::deserialize(Matx<_Tp, m, n>& item, std::istream& in) {
-  // use placeholder vector to store byte data
-  std::vector<_Tp> data;
-  dlib::deserialize(data, in);
-  
-  // allocate memory and copy data (because simply moving the data pointer may
-  // cause a segfault since std::vector will free the memory when it goes out of
-  // scope, regardless of it being moved or not)
-  _Tp* data_ptr = static_cast<_Tp*>(malloc(data.size() * sizeof(_Tp)));
-  std::copy(data.begin(), data.end(), data_ptr);
-  item = Matx<_Tp, m, n>(data_ptr);
+  // older versions wrote the rows with the (possibly padded) step of the
+  // matrix, the padding is skipped
+  const size_t rowSize = item.cols * item.elemSize();
+  if (step < rowSize || size < (rows > 0 ? step * (rows - 1) + rowSize : 0)) {
+    throw dlib::serialization_error("Corrupted cv::Mat data");
+  }
+  if (step == rowSize) {
+    in.read(reinterpret_cast<char*>(item.data), rowSize * rows);
+  } else {
+    for (int row = 0; row < rows; row++) {
+      in.read(reinterpret_cast<char*>(item.ptr(row)), rowSize);
+      in.ignore(row + 1 < rows ? step - rowSize : 0);
+    }
+  }
+  // whatever follows the last row in older versions
+  in.ignore(size - (rows > 0 ? step * (rows - 1) + rowSize : 0));
+  if (!in) {
+    throw dlib::serialization_error("Unexpected end of cv::Mat data");
+  }
 }
@@ -2,40 +2,96 @@
 
 #include <dlib/geometry.h>
 
+#include <algorithm>
+#include <limits>
 #include <opencv2/opencv.hpp>
 
 trustid::image::utils::ImageQualityResultEnum
-trustid::image::utils::checkImageQuality(const cv::Mat image) {
-  // convert image to grayscale
+trustid::image::utils::checkImageQuality(
+    const cv::Mat image, const ImageQualityThresholds& thresholds) {
+  if (image.empty()) {
+    return ImageQualityResultEnum::UNKNOWN;
+  }
+
+  // work on a small grayscale copy, which keeps the checks well under a
+  // millisecond and makes the sharpness independent of the face size
+  constexpr int kAnalysisSize = 128;
+  cv::Mat small = image;
+  const int maxSide = std::max(image.cols, image.rows);
+  if (maxSide > kAnalysisSize) {
+    const double scale = static_cast<double>(kAnalysisSize) / maxSide;
+    cv::resize(image, small, cv::Size(), scale, scale, cv::INTER_AREA);
+  }
   cv::Mat gray;
-  cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+  if (small.channels() == 1) {
+    gray = small;
+  } else {
+    cv::cvtColor(small, gray,
+                 small.channels() == 4 ? cv::COLOR_BGRA2GRAY
+                                       : cv::COLOR_BGR2GRAY);
+  }
 
-  // compute histogram of grayscale image
-  cv::Mat hist;
-  int histSize = 256;
-  float range[] = {0, 256};
-  const float* histRange = {range};
-  bool uniform = true, accumulate = false;
-  cv::calcHist(&gray, 1, 0, cv::Mat(), hist, 1, &histSize, &histRange, uniform,
-               accumulate);
+  // exposure: mean gray level and clipped pixels
+  cv::Scalar mean, stdDev;
+  cv::meanStdDev(gray, mean, stdDev);
+  const double pixelCount = gray.total();
+  const double darkFraction = cv::countNonZero(gray <= 5) / pixelCount;
+  const double brightFraction = cv::countNonZero(gray >= 250) / pixelCount;
+  if (mean[0] < thresholds.minBrightness ||
+      darkFraction > thresholds.maxClippedFraction) {
+    return ImageQualityResultEnum::UNDEREXPOSED;
+  }
+  if (mean[0] > thresholds.maxBrightness ||
+      brightFraction > thresholds.maxClippedFraction) {
+    return ImageQualityResultEnum::OVEREXPOSED;
+  }
 
-  // normalize histogram
-  cv::normalize(hist, hist, 0, 1, cv::NORM_MINMAX, -1, cv::Mat());
+  // contrast: spread of the gray levels
+  if (stdDev[0] < thresholds.minContrast) {
+    return ImageQualityResultEnum::LOW_CONTRAST;
+  }
 
-  // std::partial_sum(hist.begin(), hist.end(), Sum.begin(),
-  // std::plus<double>());
+  // blur: variance of the Laplacian, low when there are few sharp edges
+  cv::Mat laplacian;
+  cv::Laplacian(gray, laplacian, CV_16S);
+  cv::Scalar laplacianMean, laplacianStdDev;
+  cv::meanStdDev(laplacian, laplacianMean, laplacianStdDev);
+  if (laplacianStdDev[0] * laplacianStdDev[0] < thresholds.minSharpness) {
+    return ImageQualityResultEnum::BLURRY;
+  }
 
-  constexpr double kMinHistogramSum = 0.9;
-  constexpr double kMaxHistogramSum = 1.1;
+  return ImageQualityResultEnum::GOOD_QUALITY;
+}
 
-  return ImageQualityResultEnum::UNKNOWN;
+trustid::image::utils::ImageQualityResultEnum
+trustid::image::utils::checkImageQuality(
+    const trustid::image::FaceDetectionResultEntry detectionResultEntry,
+    const ImageQualityThresholds& thresholds) {
+  const cv::Rect box = detectionResultEntry.getBoundingBox();
+  if (std::min(box.width, box.height) < thresholds.minFaceSize) {
+    return ImageQualityResultEnum::FACE_TOO_SMALL;
+  }
+  return trustid::image::utils::checkImageQuality(
+      detectionResultEntry.getCroppedImage(), thresholds);
 }
 
 trustid::image::utils::ImageQualityResultEnum
 trustid::image::utils::checkImageQuality(
-    const trustid::image::FaceDetectionResultEntry detectionResultEntry) {
+    const trustid::image::FaceDetectionResult& detectionResult,
+    const ImageQualityThresholds& thresholds) {
+  if (detectionResult.getResult() == NO_RESULTS) {
+    return ImageQualityResultEnum::UNKNOWN;
+  }
+  const cv::Rect box = detectionResult.getBoundingBox();
+  if (std::min(box.width, box.height) < thresholds.minFaceSize) {
+    return ImageQualityResultEnum::FACE_TOO_SMALL;
+  }
+  // the box may reach outside the image, only check the visible part
+  const cv::Rect visibleBox =
+      box & cv::Rect(0, 0, detectionResult.getImage().cols,
+                     detectionResult.getImage().rows);
   return trustid::image::utils::checkImageQuality(
-      detectionResultEntry.getCroppedImage());
+      detectionResult.getImage()(visibleBox), thresholds);
 }
 
 cv::Rect trustid::image::utils::dlibRectangleToOpenCV(const dlib::rectangle r) {
@@ -47,3 +103,63 @@ dlib::rectangle trustid::image::utils::openCVRectToDlib(const cv::Rect r) {
   return dlib::rectangle((long)r.tl().x, (long)r.tl().y, (long)r.br().x - 1,
                          (long)r.br().y - 1);
 }
+
+cv::Matx23d trustid::image::utils::composeTransforms(
+    const cv::Matx23d& first, const cv::Matx23d& second) {
+  cv::Matx33d first3(first(0, 0), first(0, 1), first(0, 2), first(1, 0),
+                     first(1, 1), first(1, 2), 0, 0, 1);
+  return second * first3;
+}
+
+cv::Matx23d trustid::image::utils::invertTransform(
+    const cv::Matx23d& transform) {
+  cv::Matx22d linear(transform(0, 0), transform(0, 1), transform(1, 0),
+                     transform(1, 1));
+  cv::Matx22d inverse = linear.inv();
+  cv::Vec2d translation =
+      -(inverse * cv::Vec2d(transform(0, 2), transform(1, 2)));
+  return cv::Matx23d(inverse(0, 0), inverse(0, 1), translation[0],
+                     inverse(1, 0), inverse(1, 1), translation[1]);
+}
+
+cv::Rect trustid::image::utils::transformRect(const cv::Rect& rect,
+                                              const cv::Matx23d& transform) {
+  const cv::Point2d corners[] = {
+      cv::Point2d(rect.x, rect.y), cv::Point2d(rect.x + rect.width, rect.y),
+      cv::Point2d(rect.x, rect.y + rect.height),
+      cv::Point2d(rect.x + rect.width, rect.y + rect.height)};
+  cv::Point2d minCorner(std::numeric_limits<double>::max(),
+                        std::numeric_limits<double>::max());
+  cv::Point2d maxCorner(std::numeric_limits<double>::lowest(),
+                        std::numeric_limits<double>::lowest());
+  for (auto& corner : corners) {
+    cv::Vec2d point = transform * cv::Vec3d(corner.x, corner.y, 1);
+    minCorner.x = std::min(minCorner.x, point[0]);
+    minCorner.y = std::min(minCorner.y, point[1]);
+    maxCorner.x = std::max(maxCorner.x, point[0]);
+    maxCorner.y = std::max(maxCorner.y, point[1]);
+  }
+  return cv::Rect(cv::Point(cvRound(minCorner.x), cvRound(minCorner.y)),
+                  cv::Point(cvRound(maxCorner.x), cvRound(maxCorner.y)));
+}
+
+cv::Rect trustid::image::utils::getFaceRegion(const cv::Rect& boundingBox,
+                                              const cv::Size imageSize,
+                                              const double margin) {
+  const int marginX = cvRound(boundingBox.width * margin);
+  const int marginY = cvRound(boundingBox.height * margin);
+  const cv::Rect region(boundingBox.x - marginX, boundingBox.y - marginY,
+                        boundingBox.width + 2 * marginX,
+                        boundingBox.height + 2 * marginY);
+  return region & cv::Rect(cv::Point(0, 0), imageSize);
+}
+
+cv::Rect trustid::image::utils::getFaceRegion(
+    const std::vector<FaceDetectionConfidenceBoundingBox>& boundingBoxes,
+    const cv::Size imageSize, const double margin) {
+  cv::Rect region;
+  for (auto& boundingBox : boundingBoxes) {
+    region |= getFaceRegion(boundingBox.boundingBox, imageSize, margin);
+  }
+  return region;
+}
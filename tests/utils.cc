@@ -1,38 +1,967 @@
 /**
  * @file utils.cc
  * @brief Testing the serialization of multiple components of the TRUSTID image
- * processing library.113
+ * processing library.
  * @author jncfa
  * @date 2022-10-22
  */
 
 #include <dlib/serialize.h>
+#include <gtest/gtest.h>
 
-#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/calib3d.hpp>
 #include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
 
-#include "trustid_image_processing/client/client_processor.h"
+#include "trustid_image_processing/dlib_impl/enrollment_records.h"
+#include "trustid_image_processing/dlib_impl/face_verificator.h"
+#include "trustid_image_processing/dlib_impl/template_store.h"
+#include "trustid_image_processing/face_detector.h"
+#include "trustid_image_processing/face_normalization.h"
 #include "trustid_image_processing/serialize.h"
-#include "trustid_image_processing/server/server_processor.h"
+#include "trustid_image_processing/utils.h"
 
-namespace image = trustid::image;
-namespace impl = trustid::image::impl;
+namespace {
+// Returns whether the given matrices have the same size, type and values.
+bool isEqual(const cv::Mat& a, const cv::Mat& b) {
+  return a.size() == b.size() && a.type() == b.type() &&
+         (a.empty() || cv::norm(a, b, cv::NORM_INF) == 0);
+}
+
+// Serializes the given matrix and deserializes it back.
+cv::Mat roundTrip(const cv::Mat& image) {
+  std::stringstream ss;
+  cv::serialize(image, ss);
+  cv::Mat deserialized;
+  cv::deserialize(deserialized, ss);
+  return deserialized;
+}
 
-int main(int argc, char const *argv[]) {
-  // open image with opencv, serialize it with dlib, deserialize it and display
-  // both side by side
-  cv::Mat image(100, 100, cv::CV_64FC1);
-  cv::Mat image2;
+cv::Mat randomMat(int rows, int cols, int type) {
+  cv::Mat image(rows, cols, type);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+  return image;
+}
 
-  cv::randu(image, cv::Scalar(0, 0, 0), cv::Scalar(256, 256, 256));
+// Returns a smooth color image, which lossy codecs keep close to the original.
+cv::Mat gradientImage(int rows, int cols) {
+  cv::Mat image(rows, cols, CV_8UC3);
+  for (int y = 0; y < rows; y++) {
+    for (int x = 0; x < cols; x++) {
+      image.at<cv::Vec3b>(y, x) = cv::Vec3b(x * 255 / cols, y * 255 / rows,
+                                            (x + y) * 127 / (rows + cols));
+    }
+  }
+  return image;
+}
 
-  // serialize image and deserialize it into a new image
+// Returns the mean absolute difference between the values of the given
+// matrices.
+double meanDifference(const cv::Mat& a, const cv::Mat& b) {
+  return cv::norm(a, b, cv::NORM_L1) / (a.total() * a.channels());
+}
+
+// Serializes the given result or entry with the given options, returning the
+// serialized bytes.
+template <typename T>
+std::string serializeWith(const T& item,
+                          const trustid::image::ImageSerializationOptions&
+                              options) {
   std::stringstream ss;
-  dlib::serialize(ss) << image;
-  dlib::deserialize(ss) >> image2;
+  trustid::image::serialize(item, ss, options);
+  return ss.str();
+}
+
+template <typename T>
+T deserializeFrom(const std::string& bytes) {
+  std::stringstream ss(bytes);
+  T item;
+  trustid::image::deserialize(item, ss);
+  return item;
+}
+
+// Returns the format version at the start of a serialized result or entry.
+int getVersion(const std::string& bytes) {
+  std::stringstream ss(bytes);
+  int version;
+  dlib::deserialize(version, ss);
+  return version;
+}
+
+const trustid::image::FaceDetectionConfidenceBoundingBox faceBox = {
+    cv::Rect(100, 60, 40, 50), 0.9};
+
+// Returns user params with the given number of vectors of the given size.
+trustid::image::impl::DlibFaceVerificatorModelParams makeUserParams(
+    size_t count, long dims, float seed) {
+  trustid::image::impl::DlibFaceVerificatorModelParams userParams(
+      {}, {}, 0.55f + seed / 100, 0.4f);
+  for (size_t i = 0; i < count; i++) {
+    dlib::matrix<float, 0, 1> groundTruthVec(dims);
+    for (long j = 0; j < dims; j++) {
+      groundTruthVec(j) = std::sin(seed + i * dims + j) * 0.2f;
+    }
+    userParams.groundTruthVecs.push_back(groundTruthVec);
+    userParams.groundTruthWeights.push_back(1.0f + i);
+  }
+  return userParams;
+}
+
+// User params as the first version of the library declared and serialized
+// them.
+struct BaselineUserParams {
+  std::vector<dlib::matrix<float, 0, 1>> groundTruthVecs;
+  float distanceThreshold;
+  float votingThreshold;
+  DLIB_DEFINE_DEFAULT_SERIALIZATION(BaselineUserParams, groundTruthVecs,
+                                    distanceThreshold, votingThreshold);
+};
+
+// Writes the given params in the dlib encoded format of the given version
+// (1 to 3), as former versions of the library did.
+void serializeFormerVersion(
+    const trustid::image::impl::DlibFaceVerificatorModelParams& item,
+    int version, std::ostream& out) {
+  if (version == 1) {
+    BaselineUserParams baseline;
+    baseline.groundTruthVecs = item.groundTruthVecs;
+    baseline.distanceThreshold = item.distanceThreshold;
+    baseline.votingThreshold = item.votingThreshold;
+    serialize(baseline, out);
+    return;
+  }
+  dlib::serialize(-version, out);
+  dlib::serialize(item.groundTruthVecs, out);
+  dlib::serialize(item.groundTruthWeights, out);
+  dlib::serialize(item.distanceThreshold, out);
+  dlib::serialize(item.votingThreshold, out);
+  if (version >= 3) {
+    dlib::serialize(static_cast<int>(item.metric), out);
+  }
+}
+
+// Checks that the given params hold the same values, up to the given
+// relative error on the ground truth vectors (values too small for a normal
+// fp16 are compared with an absolute error instead).
+void expectSameParams(
+    const trustid::image::impl::DlibFaceVerificatorModelParams& actual,
+    const trustid::image::impl::DlibFaceVerificatorModelParams& expected,
+    float tolerance = 0) {
+  EXPECT_EQ(actual.distanceThreshold, expected.distanceThreshold);
+  EXPECT_EQ(actual.votingThreshold, expected.votingThreshold);
+  EXPECT_EQ(actual.metric, expected.metric);
+  EXPECT_EQ(actual.groundTruthWeights, expected.groundTruthWeights);
+  ASSERT_EQ(actual.groundTruthVecs.size(), expected.groundTruthVecs.size());
+  for (size_t i = 0; i < expected.groundTruthVecs.size(); i++) {
+    ASSERT_EQ(actual.groundTruthVecs[i].size(),
+              expected.groundTruthVecs[i].size());
+    for (long j = 0; j < expected.groundTruthVecs[i].size(); j++) {
+      const float value = expected.groundTruthVecs[i](j);
+      EXPECT_NEAR(actual.groundTruthVecs[i](j), value,
+                  tolerance * std::max(std::fabs(value), 1e-4f));
+    }
+  }
+}
+
+// Returns a path in the temporary directory, removing any file left there by
+// a previous run.
+std::string getTempPath(const std::string& name) {
+  const auto path =
+      std::filesystem::temp_directory_path() / ("trustid_" + name);
+  std::filesystem::remove(path);
+  return path.string();
+}
+
+// Overwrites a value of the given file at the given offset.
+template <typename T>
+void patchFile(const std::string& path, uint64_t offset, T value) {
+  std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+  file.seekp(offset);
+  file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Reads a value of the given file at the given offset.
+template <typename T>
+T readFromFile(const std::string& path, uint64_t offset) {
+  std::ifstream file(path, std::ios::binary);
+  file.seekg(offset);
+  T value;
+  file.read(reinterpret_cast<char*>(&value), sizeof(value));
+  return value;
+}
+
+// Offsets of the template store fields patched by the tests (see
+// template_store.cc).
+constexpr uint64_t kStoreIndexCapacityOffset = 56;
+constexpr uint64_t kStoreRecordsOffsetOffset = 72;
+constexpr uint64_t kStoreRecordCountOffset = 88;
+constexpr uint64_t kStoreIndexOffset = 4096;
+constexpr uint64_t kRecordCountOffset = 68;
+
+// Returns a gray checkerboard of the given square size, with gray levels of
+// 60 and 200.
+cv::Mat checkerboardImage(int size, int squareSize) {
+  cv::Mat image(size, size, CV_8UC1);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      image.at<uchar>(y, x) =
+          (x / squareSize + y / squareSize) % 2 == 0 ? 200 : 60;
+    }
+  }
+  return image;
+}
+
+// Returns the landmarks of the sparse_3d face model rotated by the given yaw
+// and pitch (in degrees), as seen by the camera estimateHeadPose assumes for
+// an image of the given size.
+dlib::full_object_detection projectFaceModel(double yaw, double pitch,
+                                             const cv::Size imageSize) {
+  const double* model = trustid::image::impl::FaceNormalizer::sparse_3d;
+  std::vector<cv::Point3d> modelPoints;
+  for (int i = 0; i < 68; i++) {
+    // camera axes, y down and z away from the camera
+    modelPoints.emplace_back(model[3 * i], -model[3 * i + 1],
+                             -model[3 * i + 2]);
+  }
+
+  // rotation Ry(yaw) * Rx(pitch), matching HeadPoseEstimationResult
+  const double y = yaw * CV_PI / 180;
+  const double p = pitch * CV_PI / 180;
+  const cv::Matx33d yawRotation(std::cos(y), 0, std::sin(y), 0, 1, 0,
+                                -std::sin(y), 0, std::cos(y));
+  const cv::Matx33d pitchRotation(1, 0, 0, 0, std::cos(p), -std::sin(p), 0,
+                                  std::sin(p), std::cos(p));
+  cv::Vec3d rotationVector;
+  cv::Rodrigues(yawRotation * pitchRotation, rotationVector);
+  const cv::Vec3d translationVector(10, -5, 300);
+
+  const double focalLength = std::max(imageSize.width, imageSize.height);
+  const cv::Matx33d cameraMatrix(focalLength, 0, imageSize.width / 2.0, 0,
+                                 focalLength, imageSize.height / 2.0, 0, 0, 1);
+  std::vector<cv::Point2d> imagePoints;
+  cv::projectPoints(modelPoints, rotationVector, translationVector,
+                    cameraMatrix, cv::noArray(), imagePoints);
+
+  std::vector<dlib::point> parts;
+  for (auto& point : imagePoints) {
+    parts.emplace_back(std::lround(point.x), std::lround(point.y));
+  }
+  return dlib::full_object_detection(
+      dlib::rectangle(0, 0, imageSize.width - 1, imageSize.height - 1), parts);
+}
+
+// Sizes of the index entries and of the footer appended when closing an
+// enrollment record file (see enrollment_records.cc).
+constexpr uint64_t kEnrollmentIndexEntrySize = 16;
+constexpr uint64_t kEnrollmentFooterSize = 24;
+
+// Returns a record of the given user holding a lossless encoding of a
+// gradient image, with a precomputed face and landmarks if requested.
+trustid::image::impl::EnrollmentRecord makeRecord(const std::string& userId,
+                                                  int seed,
+                                                  bool withDetection) {
+  trustid::image::impl::EnrollmentRecord record;
+  record.userId = userId;
+  cv::imencode(".png", gradientImage(40 + seed, 60), record.encodedImage);
+  if (withDetection) {
+    record.hasDetection = true;
+    record.boundingBox.boundingBox = cv::Rect(5, 6, 20 + seed, 21);
+    record.boundingBox.confidenceScore = 0.5 + seed;
+    for (int i = 0; i < 68; i++) {
+      record.landmarks.emplace_back(i + 0.25f, seed + i * 0.5f);
+    }
+  }
+  return record;
+}
+
+void expectSameRecord(const trustid::image::impl::EnrollmentRecord& actual,
+                      const trustid::image::impl::EnrollmentRecord& expected) {
+  EXPECT_EQ(actual.userId, expected.userId);
+  EXPECT_EQ(actual.encodedImage, expected.encodedImage);
+  ASSERT_EQ(actual.hasDetection, expected.hasDetection);
+  if (expected.hasDetection) {
+    EXPECT_EQ(actual.boundingBox.boundingBox, expected.boundingBox.boundingBox);
+    EXPECT_EQ(actual.boundingBox.confidenceScore,
+              expected.boundingBox.confidenceScore);
+  }
+  EXPECT_EQ(actual.landmarks, expected.landmarks);
+}
+
+// Writes the given records into a closed record file at the given path.
+void writeRecords(
+    const std::string& path,
+    const std::vector<trustid::image::impl::EnrollmentRecord>& records) {
+  trustid::image::impl::EnrollmentRecordWriter writer(path);
+  for (auto& record : records) {
+    writer.append(record);
+  }
+  EXPECT_EQ(writer.size(), records.size());
+  writer.close();
+}
+
+trustid::image::impl::DlibFaceVerificatorModelParams deserializeParams(
+    const std::string& bytes) {
+  std::stringstream ss(bytes);
+  trustid::image::impl::DlibFaceVerificatorModelParams userParams;
+  trustid::image::impl::deserialize(userParams, ss);
+  EXPECT_EQ(ss.peek(), std::char_traits<char>::eof());
+  return userParams;
+}
+}  // namespace
+
+TEST(MatSerialization, RoundTripsContinuousMatrices) {
+  for (int type : {CV_8UC1, CV_8UC3, CV_32FC1, CV_64FC1}) {
+    const cv::Mat image = randomMat(48, 64, type);
+    EXPECT_TRUE(isEqual(roundTrip(image), image)) << "type " << type;
+  }
+}
+
+TEST(MatSerialization, RoundTripsMultiChannelMatrices) {
+  for (int type : {CV_8UC2, CV_8UC4, CV_16UC3, CV_32FC2, CV_64FC3}) {
+    const cv::Mat image = randomMat(31, 17, type);
+    const cv::Mat deserialized = roundTrip(image);
+    EXPECT_EQ(deserialized.channels(), image.channels());
+    EXPECT_TRUE(isEqual(deserialized, image)) << "type " << type;
+  }
+}
+
+TEST(MatSerialization, RoundTripsRegionsOfInterest) {
+  const cv::Mat image = randomMat(120, 160, CV_8UC3);
+  const cv::Mat roi = image(cv::Rect(13, 7, 50, 40));
+  ASSERT_FALSE(roi.isContinuous());
+
+  const cv::Mat deserialized = roundTrip(roi);
+  EXPECT_TRUE(isEqual(deserialized, roi));
+  EXPECT_TRUE(deserialized.isContinuous());
+  EXPECT_EQ(deserialized.step[0], roi.cols * roi.elemSize());
+}
+
+TEST(MatSerialization, WritesOnlyThePixelsOfRegionsOfInterest) {
+  const cv::Mat image = randomMat(120, 160, CV_32FC1);
+  std::stringstream roiStream, copyStream;
+  cv::serialize(image(cv::Rect(10, 10, 30, 20)), roiStream);
+  cv::serialize(image(cv::Rect(10, 10, 30, 20)).clone(), copyStream);
+  EXPECT_EQ(roiStream.str(), copyStream.str());
+}
+
+TEST(MatSerialization, ReadsOldLayoutWithPaddedStep) {
+  // older versions wrote the bytes from the start of the first row to the end
+  // of the last one, with the step of the (padded) parent matrix
+  const cv::Mat parent = randomMat(20, 40, CV_8UC3);
+  const cv::Mat roi = parent(cv::Rect(5, 3, 24, 12));
+  const size_t rowSize = roi.cols * roi.elemSize();
+  const unsigned long size =
+      static_cast<unsigned long>(roi.step[0] * (roi.rows - 1) + rowSize);
+  ASSERT_GT(roi.step[0], rowSize);
+
+  std::stringstream ss;
+  dlib::serialize(roi.type(), ss);
+  dlib::serialize(roi.rows, ss);
+  dlib::serialize(roi.cols, ss);
+  dlib::serialize(static_cast<dlib::uint64>(roi.step[0]), ss);
+  dlib::serialize(size, ss);
+  ss.write(reinterpret_cast<const char*>(roi.data), size);
+  // a value following the matrix must still be read correctly
+  dlib::serialize(42, ss);
+
+  cv::Mat deserialized;
+  cv::deserialize(deserialized, ss);
+  EXPECT_TRUE(isEqual(deserialized, roi));
+  int trailing = 0;
+  dlib::deserialize(trailing, ss);
+  EXPECT_EQ(trailing, 42);
+}
+
+TEST(MatSerialization, DoesNotOverwriteSharedBuffers) {
+  const cv::Mat image = randomMat(16, 16, CV_8UC1);
+  const cv::Mat original = image.clone();
+  cv::Mat shared = image;
+
+  std::stringstream ss;
+  cv::serialize(randomMat(16, 16, CV_8UC1), ss);
+  cv::deserialize(shared, ss);
+  EXPECT_TRUE(isEqual(image, original));
+  EXPECT_NE(shared.data, image.data);
+}
+
+TEST(MatSerialization, RoundTripsEmptyMatrices) {
+  EXPECT_TRUE(roundTrip(cv::Mat()).empty());
+}
+
+TEST(MatSerialization, RejectsMultiDimensionalMatrices) {
+  const int sizes[] = {4, 4, 4};
+  const cv::Mat volume(3, sizes, CV_8UC1, cv::Scalar(0));
+  std::stringstream ss;
+  EXPECT_THROW(cv::serialize(volume, ss), dlib::serialization_error);
+}
+
+TEST(MatSerialization, RejectsTruncatedData) {
+  std::stringstream ss;
+  cv::serialize(randomMat(10, 10, CV_8UC3), ss);
+  std::stringstream truncated(ss.str().substr(0, ss.str().size() / 2));
+  cv::Mat deserialized;
+  EXPECT_THROW(cv::deserialize(deserialized, truncated),
+               dlib::serialization_error);
+}
+
+TEST(DetectionSerialization, CropsDeserializedEncodedEntries) {
+  const cv::Mat image = gradientImage(240, 320);
+  const trustid::image::FaceDetectionResultEntry entry(image, faceBox);
+  trustid::image::ImageSerializationOptions options;
+  options.encoding = trustid::image::JPEG_IMAGE;
+
+  const std::string bytes = serializeWith(entry, options);
+  ASSERT_EQ(getVersion(bytes), 2);
+  const auto deserialized =
+      deserializeFrom<trustid::image::FaceDetectionResultEntry>(bytes);
+  const cv::Mat cropped = deserialized.getCroppedImage();
+  EXPECT_EQ(cropped.size(), faceBox.boundingBox.size());
+  EXPECT_EQ(cropped.type(), image.type());
+  EXPECT_LT(meanDifference(cropped, image(faceBox.boundingBox)), 4);
+}
+
+TEST(DetectionSerialization, CropsDeserializedEncodedResults) {
+  const cv::Mat image = gradientImage(240, 320);
+  const trustid::image::FaceDetectionResult result(image, {faceBox});
+  trustid::image::ImageSerializationOptions options;
+  options.encoding = trustid::image::JPEG_IMAGE;
+
+  const std::string bytes = serializeWith(result, options);
+  ASSERT_EQ(getVersion(bytes), 2);
+  const auto deserialized =
+      deserializeFrom<trustid::image::FaceDetectionResult>(bytes);
+  EXPECT_EQ(deserialized.getResult(), trustid::image::ONE_RESULT);
+  const cv::Mat cropped = deserialized.getCroppedImage();
+  EXPECT_EQ(cropped.size(), faceBox.boundingBox.size());
+  EXPECT_LT(meanDifference(cropped, image(faceBox.boundingBox)), 4);
+}
+
+TEST(DetectionSerialization, RoundTripsLosslessEncodings) {
+  const cv::Mat image = randomMat(120, 160, CV_8UC3);
+  const trustid::image::FaceDetectionResultEntry entry(image, faceBox);
+  trustid::image::ImageSerializationOptions options;
+  options.encoding = trustid::image::PNG_IMAGE;
+
+  const auto deserialized =
+      deserializeFrom<trustid::image::FaceDetectionResultEntry>(
+          serializeWith(entry, options));
+  EXPECT_TRUE(isEqual(deserialized.getImage(), image));
+  EXPECT_EQ(deserialized.getBoundingBox(), faceBox.boundingBox);
+}
+
+TEST(DetectionSerialization, StoresImagesTheCodecCantRepresentRaw) {
+  const cv::Mat image = randomMat(120, 160, CV_32FC3);
+  const trustid::image::FaceDetectionResult result(image, {faceBox});
+  trustid::image::ImageSerializationOptions options;
+  options.encoding = trustid::image::JPEG_IMAGE;
+
+  const std::string bytes = serializeWith(result, options);
+  EXPECT_EQ(getVersion(bytes), 1);
+  EXPECT_TRUE(isEqual(
+      deserializeFrom<trustid::image::FaceDetectionResult>(bytes).getImage(),
+      image));
+}
+
+TEST(DetectionSerialization, KeepsTheSameFaceRegionRawAndEncoded) {
+  const cv::Mat image = randomMat(240, 320, CV_8UC3);
+  const trustid::image::FaceDetectionConfidenceBoundingBox secondBox = {
+      cv::Rect(220, 150, 30, 30), 0.7};
+  const trustid::image::FaceDetectionResult result(image,
+                                                   {faceBox, secondBox});
+  trustid::image::ImageSerializationOptions rawOptions;
+  rawOptions.faceRegionOnly = true;
+  trustid::image::ImageSerializationOptions encodedOptions = rawOptions;
+  encodedOptions.encoding = trustid::image::PNG_IMAGE;
+
+  const std::string rawBytes = serializeWith(result, rawOptions);
+  const std::string encodedBytes = serializeWith(result, encodedOptions);
+  ASSERT_EQ(getVersion(rawBytes), 1);
+  ASSERT_EQ(getVersion(encodedBytes), 2);
+  const auto raw =
+      deserializeFrom<trustid::image::FaceDetectionResult>(rawBytes);
+  const auto encoded =
+      deserializeFrom<trustid::image::FaceDetectionResult>(encodedBytes);
+
+  const cv::Rect region = trustid::image::utils::getFaceRegion(
+      result.getBoundingBoxes(), image.size());
+  EXPECT_LT(region.area(), image.size().area());
+  EXPECT_TRUE(isEqual(raw.getImage(), image(region)));
+  EXPECT_TRUE(isEqual(encoded.getImage(), image(region)));
+
+  // the boxes are relative to the region, so the crops are unchanged
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(raw.getBoundingBox(i), encoded.getBoundingBox(i));
+    EXPECT_EQ(raw.getBoundingBox(i) + region.tl(), result.getBoundingBox(i));
+    EXPECT_TRUE(isEqual(raw.getCroppedImage(i), result.getCroppedImage(i)));
+    EXPECT_TRUE(isEqual(encoded.getCroppedImage(i), result.getCroppedImage(i)));
+  }
+}
+
+TEST(DetectionSerialization, ClipsTheFaceRegionOfEntriesToTheImage) {
+  const cv::Mat image = randomMat(120, 160, CV_8UC1);
+  const trustid::image::FaceDetectionConfidenceBoundingBox cornerBox = {
+      cv::Rect(5, 4, 30, 30), 0.8};
+  const trustid::image::FaceDetectionResultEntry entry(image, cornerBox);
+  for (auto encoding : {trustid::image::RAW_IMAGE, trustid::image::PNG_IMAGE}) {
+    trustid::image::ImageSerializationOptions options;
+    options.encoding = encoding;
+    options.faceRegionOnly = true;
+    const auto deserialized =
+        deserializeFrom<trustid::image::FaceDetectionResultEntry>(
+            serializeWith(entry, options));
+    EXPECT_EQ(deserialized.getImage().size(), cv::Size(50, 49));
+    EXPECT_EQ(deserialized.getBoundingBox(), cornerBox.boundingBox);
+    EXPECT_TRUE(
+        isEqual(deserialized.getCroppedImage(), entry.getCroppedImage()));
+  }
+}
+
+TEST(DetectionSerialization, StoresResultsWithoutFacesWithoutImage) {
+  const trustid::image::FaceDetectionResult result(
+      randomMat(120, 160, CV_8UC3), {});
+  trustid::image::ImageSerializationOptions options;
+  options.encoding = trustid::image::JPEG_IMAGE;
+  options.faceRegionOnly = true;
+
+  const auto deserialized =
+      deserializeFrom<trustid::image::FaceDetectionResult>(
+          serializeWith(result, options));
+  EXPECT_EQ(deserialized.getResult(), trustid::image::NO_RESULTS);
+  EXPECT_TRUE(deserialized.getImage().empty());
+}
+
+TEST(UserParamsSerialization, RoundTripsTheCompactFormat) {
+  auto userParams = makeUserParams(5, 128, 1);
+  userParams.metric = trustid::image::impl::COSINE_SIMILARITY;
+  std::stringstream ss;
+  trustid::image::impl::serialize(userParams, ss);
+
+  // marker, header, weights and vectors, without any per value overhead
+  const std::string bytes = ss.str();
+  EXPECT_EQ(bytes.size(), 2 + 24 + 5 * 4 + 5 * 128 * 4);
+  EXPECT_EQ(static_cast<unsigned char>(bytes[0]), 0x81);
+  EXPECT_EQ(static_cast<unsigned char>(bytes[1]), 0x04);
+  expectSameParams(deserializeParams(bytes), userParams);
+}
+
+TEST(UserParamsSerialization, RoundTripsHalfPrecision) {
+  // an odd size, so the blocks need padding
+  const auto userParams = makeUserParams(3, 127, 2);
+  std::stringstream ss;
+  trustid::image::impl::serialize(userParams, ss,
+                                  trustid::image::impl::FLOAT16_PRECISION);
+
+  const std::string bytes = ss.str();
+  EXPECT_EQ(bytes.size(), 2 + 24 + 3 * 4 + 3 * 128 * 2);
+  expectSameParams(deserializeParams(bytes), userParams, 1e-3f);
+}
+
+TEST(UserParamsSerialization, RoundTripsParamsWithoutWeights) {
+  auto userParams = makeUserParams(4, 16, 3);
+  userParams.groundTruthWeights.clear();
+  std::stringstream ss;
+  trustid::image::impl::serialize(userParams, ss);
+  expectSameParams(deserializeParams(ss.str()), userParams);
+}
+
+TEST(UserParamsSerialization, RejectsVectorsOfDifferentSizes) {
+  auto userParams = makeUserParams(2, 16, 4);
+  userParams.groundTruthVecs[1].set_size(8);
+  std::stringstream ss;
+  EXPECT_THROW(trustid::image::impl::serialize(userParams, ss),
+               dlib::serialization_error);
+}
+
+TEST(UserParamsSerialization, ReadsFormerVersions) {
+  for (int version = 1; version <= 3; version++) {
+    auto userParams = makeUserParams(3, 128, version);
+    if (version < 2) {
+      userParams.groundTruthWeights.clear();
+    }
+    if (version >= 3) {
+      userParams.metric = trustid::image::impl::COSINE_SIMILARITY;
+    }
+    std::stringstream ss;
+    serializeFormerVersion(userParams, version, ss);
+    SCOPED_TRACE("version " + std::to_string(version));
+    expectSameParams(deserializeParams(ss.str()), userParams);
+
+    const std::string bytes = ss.str();
+    const auto users = trustid::image::impl::deserializeUserParamsBatch(
+        bytes.data(), bytes.size());
+    ASSERT_EQ(users.size(), 1u);
+    expectSameParams(users[0], userParams);
+  }
+}
+
+TEST(UserParamsSerialization, LoadsUserParamsSavedByTheBaseline) {
+  // written by the first version of the library, with 3 vectors of 128
+  // values following ((i * 128 + j) % 17) / 17 - 0.5
+  std::ifstream in(std::string(TRUSTID_TEST_RESOURCES) +
+                       "/baseline_user_params.dat",
+                   std::ios::binary);
+  ASSERT_TRUE(in.is_open());
+  trustid::image::impl::DlibFaceVerificatorModelParams expected(
+      {}, 0.6f, 0.5f);
+  for (int i = 0; i < 3; i++) {
+    dlib::matrix<float, 0, 1> groundTruthVec(128);
+    for (int j = 0; j < 128; j++) {
+      groundTruthVec(j) = ((i * 128 + j) % 17) / 17.0f - 0.5f;
+    }
+    expected.groundTruthVecs.push_back(groundTruthVec);
+  }
+
+  trustid::image::impl::DlibFaceVerificatorModelParams userParams;
+  trustid::image::impl::deserialize(userParams, in);
+  expectSameParams(userParams, expected);
+  EXPECT_EQ(in.peek(), std::char_traits<char>::eof());
+}
+
+TEST(UserParamsSerialization, RejectsUnknownVersions) {
+  for (int version : {0, 2, -1, -5}) {
+    std::stringstream ss;
+    dlib::serialize(version, ss);
+    serialize(makeUserParams(1, 16, 1), ss);
+    trustid::image::impl::DlibFaceVerificatorModelParams userParams;
+    EXPECT_THROW(trustid::image::impl::deserialize(userParams, ss),
+                 dlib::serialization_error)
+        << "version " << version;
+  }
+}
+
+TEST(UserParamsSerialization, ReadsMixedVersionBatches) {
+  std::vector<trustid::image::impl::DlibFaceVerificatorModelParams> users;
+  std::stringstream ss;
+  for (int i = 0; i < 10; i++) {
+    auto userParams = makeUserParams(1 + i % 4, 128, i);
+    const int version = 1 + i % 5;  // 4 is fp32 compact, 5 fp16 compact
+    if (version == 1) {
+      userParams.groundTruthWeights.clear();
+    }
+    if (version <= 3) {
+      serializeFormerVersion(userParams, version, ss);
+    } else {
+      trustid::image::impl::serialize(
+          userParams, ss,
+          version == 4 ? trustid::image::impl::FLOAT32_PRECISION
+                       : trustid::image::impl::FLOAT16_PRECISION);
+    }
+    users.push_back(userParams);
+  }
+
+  const std::string bytes = ss.str();
+  const auto deserialized = trustid::image::impl::deserializeUserParamsBatch(
+      bytes.data(), bytes.size());
+  ASSERT_EQ(deserialized.size(), users.size());
+  for (size_t i = 0; i < users.size(); i++) {
+    SCOPED_TRACE("user " + std::to_string(i));
+    expectSameParams(deserialized[i], users[i], i % 5 == 4 ? 1e-3f : 0);
+  }
+}
+
+TEST(UserParamsSerialization, RejectsTruncatedBatches) {
+  std::stringstream ss;
+  trustid::image::impl::serializeUserParamsBatch(
+      {makeUserParams(2, 64, 1), makeUserParams(3, 64, 2)}, ss);
+  const std::string bytes = ss.str();
+  EXPECT_THROW(trustid::image::impl::deserializeUserParamsBatch(
+                   bytes.data(), bytes.size() - 10),
+               dlib::serialization_error);
+}
+
+TEST(TemplateStore, RoundTripsUsers) {
+  const std::string path = getTempPath("round_trip.tpl");
+  trustid::image::impl::TemplateStore::create(path, 16, 4);
+  trustid::image::impl::TemplateStore store(path, false);
+  const auto alice = makeUserParams(3, 16, 1);
+  const auto bob = makeUserParams(4, 16, 2);
+  store.append("alice", alice);
+  store.append("bob", bob);
+
+  EXPECT_EQ(store.size(), 2u);
+  EXPECT_EQ(store.getDims(), 16u);
+  EXPECT_EQ(store.getMaxVectors(), 4u);
+  EXPECT_TRUE(store.contains("alice"));
+  EXPECT_FALSE(store.contains("carol"));
+  expectSameParams(store.getUser("alice").toModelParams(), alice);
+  expectSameParams(store.getUser("bob").toModelParams(), bob);
+  EXPECT_THROW(store.getUser("carol"), std::runtime_error);
+}
+
+TEST(TemplateStore, RejectsModelsNotMatchingTheStore) {
+  const std::string path = getTempPath("reject.tpl");
+  trustid::image::impl::TemplateStore::create(path, 16, 4);
+  trustid::image::impl::TemplateStore store(path, false);
+  EXPECT_THROW(store.append("alice", makeUserParams(5, 16, 1)),
+               std::invalid_argument);
+  EXPECT_THROW(store.append("alice", makeUserParams(2, 8, 1)),
+               std::invalid_argument);
+  EXPECT_THROW(store.append(std::string(64, 'a'), makeUserParams(2, 16, 1)),
+               std::invalid_argument);
+  EXPECT_EQ(store.size(), 0u);
+}
+
+TEST(TemplateStore, ReplacesAndRemovesUsers) {
+  const std::string path = getTempPath("remove.tpl");
+  trustid::image::impl::TemplateStore::create(path, 16, 4);
+  trustid::image::impl::TemplateStore store(path, false);
+  store.append("alice", makeUserParams(3, 16, 1));
+  store.append("bob", makeUserParams(2, 16, 2));
+  const auto newAlice = makeUserParams(4, 16, 3);
+  store.append("alice", newAlice);
+
+  EXPECT_EQ(store.size(), 2u);
+  EXPECT_EQ(store.tombstoneCount(), 1u);
+  expectSameParams(store.getUser("alice").toModelParams(), newAlice);
+
+  store.remove("bob");
+  EXPECT_FALSE(store.contains("bob"));
+  EXPECT_EQ(store.size(), 1u);
+  EXPECT_EQ(store.tombstoneCount(), 2u);
+  EXPECT_THROW(store.remove("bob"), std::runtime_error);
+}
+
+TEST(TemplateStore, CompactsAndReopens) {
+  const std::string path = getTempPath("compact.tpl");
+  trustid::image::impl::TemplateStore::create(path, 16, 4);
+  std::vector<trustid::image::impl::DlibFaceVerificatorModelParams> users;
+  {
+    trustid::image::impl::TemplateStore store(path, false);
+    // enough users to grow both the index and the record area
+    for (int i = 0; i < 100; i++) {
+      users.push_back(makeUserParams(1 + i % 4, 16, i));
+      store.append("user" + std::to_string(i), users.back());
+    }
+    for (int i = 0; i < 100; i += 3) {
+      store.remove("user" + std::to_string(i));
+    }
+    EXPECT_EQ(store.tombstoneCount(), 34u);
+    store.compact();
+    EXPECT_EQ(store.tombstoneCount(), 0u);
+    EXPECT_EQ(store.size(), 66u);
+  }
+
+  trustid::image::impl::TemplateStore store(path);
+  EXPECT_EQ(store.size(), 66u);
+  for (int i = 0; i < 100; i++) {
+    const std::string userId = "user" + std::to_string(i);
+    SCOPED_TRACE(userId);
+    ASSERT_EQ(store.contains(userId), i % 3 != 0);
+    if (i % 3 != 0) {
+      expectSameParams(store.getUser(userId).toModelParams(), users[i]);
+    }
+  }
+  EXPECT_THROW(store.append("user0", users[0]), std::runtime_error);
+}
+
+TEST(TemplateStore, RejectsCorruptedFiles) {
+  const std::string path = getTempPath("corrupted.tpl");
+  trustid::image::impl::TemplateStore::create(path, 16, 4);
+  {
+    trustid::image::impl::TemplateStore store(path, false);
+    store.append("alice", makeUserParams(3, 16, 1));
+  }
+
+  // vector count beyond the record capacity
+  const auto recordsOffset =
+      readFromFile<uint64_t>(path, kStoreRecordsOffsetOffset);
+  patchFile<uint32_t>(path, recordsOffset + kRecordCountOffset, 1000);
+  {
+    trustid::image::impl::TemplateStore store(path);
+    EXPECT_THROW(store.getUser("alice"), std::runtime_error);
+  }
+  patchFile<uint32_t>(path, recordsOffset + kRecordCountOffset, 3);
+
+  // index slot pointing past the records
+  const auto indexCapacity =
+      readFromFile<uint64_t>(path, kStoreIndexCapacityOffset);
+  for (uint64_t slot = 0; slot < indexCapacity; slot++) {
+    const uint64_t recordOffset = kStoreIndexOffset + slot * 16 + 8;
+    if (readFromFile<uint64_t>(path, recordOffset) == 1) {
+      patchFile<uint64_t>(path, recordOffset, 1000);
+    }
+  }
+  {
+    trustid::image::impl::TemplateStore store(path);
+    EXPECT_THROW(store.contains("alice"), std::runtime_error);
+  }
+
+  // more records than the file holds
+  patchFile<uint64_t>(path, kStoreRecordCountOffset, 1u << 20);
+  EXPECT_THROW(trustid::image::impl::TemplateStore store(path),
+               std::runtime_error);
+
+  // truncated file
+  patchFile<uint64_t>(path, kStoreRecordCountOffset, 1);
+  std::filesystem::resize_file(path, 4096 + 100);
+  EXPECT_THROW(trustid::image::impl::TemplateStore store(path),
+               std::runtime_error);
+}
+
+TEST(EnrollmentRecords, RoundTripsRecords) {
+  const std::string path = getTempPath("roundtrip.rec");
+  const std::vector<trustid::image::impl::EnrollmentRecord> records = {
+      makeRecord("alice", 0, true), makeRecord("alice", 1, false),
+      makeRecord("bob", 2, true), makeRecord("carol", 3, false)};
+  writeRecords(path, records);
+
+  trustid::image::impl::EnrollmentRecordReader reader(path);
+  ASSERT_EQ(reader.size(), records.size());
+  for (uint64_t i = 0; i < records.size(); i++) {
+    SCOPED_TRACE(i);
+    expectSameRecord(reader.read(i), records[i]);
+  }
+  EXPECT_EQ(reader.findUser("alice"), std::vector<uint64_t>({0, 1}));
+  EXPECT_EQ(reader.findUser("carol"), std::vector<uint64_t>({3}));
+  EXPECT_TRUE(reader.findUser("dave").empty());
+  EXPECT_THROW(reader.read(records.size()), std::out_of_range);
+}
+
+TEST(EnrollmentRecords, ReadsFilesWhoseWriterWasNotClosed) {
+  const std::string path = getTempPath("unclosed.rec");
+  const std::vector<trustid::image::impl::EnrollmentRecord> records = {
+      makeRecord("alice", 0, true), makeRecord("bob", 1, false),
+      makeRecord("bob", 2, true)};
+  writeRecords(path, records);
+
+  // what an interrupted writer leaves: the records without index and footer
+  const uint64_t recordsEnd =
+      std::filesystem::file_size(path) - kEnrollmentFooterSize -
+      records.size() * kEnrollmentIndexEntrySize;
+  std::filesystem::resize_file(path, recordsEnd);
+  {
+    trustid::image::impl::EnrollmentRecordReader reader(path);
+    ASSERT_EQ(reader.size(), records.size());
+    for (uint64_t i = 0; i < records.size(); i++) {
+      SCOPED_TRACE(i);
+      expectSameRecord(reader.read(i), records[i]);
+    }
+    EXPECT_EQ(reader.findUser("bob"), std::vector<uint64_t>({1, 2}));
+  }
+
+  // a partially written last record is left out
+  std::filesystem::resize_file(path, recordsEnd - 10);
+  trustid::image::impl::EnrollmentRecordReader reader(path);
+  ASSERT_EQ(reader.size(), records.size() - 1);
+  expectSameRecord(reader.read(1), records[1]);
+}
+
+TEST(EnrollmentRecords, DecodesChunksWhileTheReaderIsUsed) {
+  const std::string path = getTempPath("decoded.rec");
+  std::vector<trustid::image::impl::EnrollmentRecord> records;
+  for (int i = 0; i < 10; i++) {
+    records.push_back(makeRecord("user" + std::to_string(i / 2), i, true));
+  }
+  writeRecords(path, records);
+
+  trustid::image::impl::EnrollmentRecordReader reader(path);
+  uint64_t nextRecordIdx = 0;
+  size_t chunkCount = 0;
+  // chunks of a single record, so every callback runs while the next chunk
+  // is read ahead
+  reader.readDecoded(
+      [&](std::vector<trustid::image::impl::DecodedEnrollmentRecord>&
+              decodedRecords) {
+        chunkCount++;
+        for (auto& decoded : decodedRecords) {
+          SCOPED_TRACE(decoded.recordIdx);
+          ASSERT_EQ(decoded.recordIdx, nextRecordIdx++);
+          const auto& record = records[decoded.recordIdx];
+          EXPECT_EQ(decoded.userId, record.userId);
+          ASSERT_TRUE(decoded.valid);
+          EXPECT_TRUE(isEqual(decoded.entry.getImage(),
+                              gradientImage(40 + int(decoded.recordIdx), 60)));
+          EXPECT_EQ(decoded.entry.getBoundingBox(),
+                    record.boundingBox.boundingBox);
+          EXPECT_EQ(decoded.landmarks, record.landmarks);
+          EXPECT_EQ(decoded.getShape().num_parts(), 68u);
+
+          // the reader stays usable from the callback
+          expectSameRecord(reader.read(decoded.recordIdx), record);
+          EXPECT_EQ(reader.findUser(decoded.userId).size(), 2u);
+        }
+      },
+      nullptr, 1);
+  EXPECT_EQ(nextRecordIdx, records.size());
+  EXPECT_EQ(chunkCount, records.size());
+
+  // without a precomputed face nor a detector, the records are invalid
+  const std::string undetectedPath = getTempPath("undetected.rec");
+  writeRecords(undetectedPath,
+               {makeRecord("alice", 0, false), makeRecord("alice", 1, false),
+                makeRecord("bob", 2, true)});
+  std::vector<std::pair<std::string, size_t>> users;
+  trustid::image::impl::EnrollmentRecordReader(undetectedPath)
+      .readUsers(
+          [&](const std::string& userId,
+              std::vector<trustid::image::FaceDetectionResultEntry>& entries) {
+            users.emplace_back(userId, entries.size());
+          });
+  EXPECT_EQ(users, (std::vector<std::pair<std::string, size_t>>(
+                       {{"alice", 0}, {"bob", 1}})));
+}
+
+TEST(ImageQuality, AcceptsSharpImages) {
+  const cv::Mat sharp = checkerboardImage(128, 16);
+  EXPECT_EQ(trustid::image::utils::checkImageQuality(sharp),
+            trustid::image::utils::GOOD_QUALITY);
+}
+
+TEST(ImageQuality, DetectsLowContrast) {
+  const cv::Mat gray(128, 128, CV_8UC3, cv::Scalar::all(128));
+  EXPECT_EQ(trustid::image::utils::checkImageQuality(gray),
+            trustid::image::utils::LOW_CONTRAST);
+}
+
+TEST(ImageQuality, DetectsBlur) {
+  // keeps a standard deviation of about 36 gray levels, but hardly any edges
+  cv::Mat blurred;
+  cv::GaussianBlur(checkerboardImage(128, 16), blurred, cv::Size(), 4);
+  EXPECT_EQ(trustid::image::utils::checkImageQuality(blurred),
+            trustid::image::utils::BLURRY);
+}
+
+TEST(ImageQuality, DetectsUnderexposure) {
+  const cv::Mat black(128, 128, CV_8UC3, cv::Scalar::all(0));
+  EXPECT_EQ(trustid::image::utils::checkImageQuality(black),
+            trustid::image::utils::UNDEREXPOSED);
+}
+
+TEST(ImageQuality, DetectsSmallFaces) {
+  cv::Mat image;
+  cv::cvtColor(checkerboardImage(256, 16), image, cv::COLOR_GRAY2BGR);
+  const trustid::image::FaceDetectionResultEntry smallFace(
+      image, {cv::Rect(10, 10, 40, 40), 1.0});
+  EXPECT_EQ(trustid::image::utils::checkImageQuality(smallFace),
+            trustid::image::utils::FACE_TOO_SMALL);
+  const trustid::image::FaceDetectionResultEntry largeFace(
+      image, {cv::Rect(10, 10, 160, 160), 1.0});
+  EXPECT_EQ(trustid::image::utils::checkImageQuality(largeFace),
+            trustid::image::utils::GOOD_QUALITY);
+}
 
-  auto result = cv::sum(image - image2);
-  bool testIfZero =
-      result[0] == 0 && result[1] == 0 && result[2] == 0 && result[3] == 0;
-  return 0;
+TEST(HeadPose, RecoversTheRotationOfProjectedLandmarks) {
+  const cv::Size imageSize(640, 480);
+  const trustid::image::impl::FaceNormalizer normalizer;
+  const double poses[][2] = {{0, 0}, {20, 0}, {-25, 0}, {0, 15}, {0, -15},
+                             {-20, 10}};
+  for (auto& pose : poses) {
+    SCOPED_TRACE("yaw " + std::to_string(pose[0]) + ", pitch " +
+                 std::to_string(pose[1]));
+    const auto result = normalizer.estimateHeadPose(
+        projectFaceModel(pose[0], pose[1], imageSize), imageSize);
+    // the landmarks are rounded to whole pixels
+    EXPECT_NEAR(result.getYaw(), pose[0], 2.0);
+    EXPECT_NEAR(result.getPitch(), pose[1], 2.0);
+    EXPECT_NEAR(result.getRoll(), 0, 2.0);
+  }
 }